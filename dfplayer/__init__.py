@@ -16,6 +16,8 @@ def main():
     arg_parser.add_argument('--listen')
     arg_parser.add_argument('--no-reset', action='store_true')
     arg_parser.add_argument('--no-sound', action='store_true')
+    # E.g. 'gen:clicks,bpm=128' or 'file:test.wav,speed=4'.
+    arg_parser.add_argument('--sound-input')
     arg_parser.add_argument('--disable-net', action='store_true')
     arg_parser.add_argument('--mpd', action='store_true')
     arg_parser.add_argument('--disable-fin', action='store_true')
@@ -45,7 +47,8 @@ def main():
  
     player = Player(
         'playlist', args.no_sound, args.mpd, not args.disable_net,
-        not args.disable_fin, args.enable_kinect)
+        not args.disable_fin, args.enable_kinect,
+        sound_input=args.sound_input)
 
     if args.no_reset:
         player.disable_reset()
@@ -31,6 +31,10 @@ from .util import get_time_millis
 from .tcl_renderer import TclRenderer
 from .renderer_cc import KinectRange
 from .renderer_cc import Visualizer
+from .renderer_cc import AUDIO_FEATURE_BEAT_COUNT
+from .renderer_cc import AUDIO_FEATURE_BPM
+from .renderer_cc import AUDIO_FEATURE_BPM_CONFIDENCE
+from .renderer_cc import AUDIO_FEATURE_ONSET_COUNT
 
 FPS = 15
 _SCREEN_FRAME_WIDTH = 500
@@ -86,7 +90,7 @@ class Player(object):
 
     def __init__(
           self, playlist, no_sound, use_mpd, enable_net, enable_fin,
-          enable_kinect):
+          enable_kinect, sound_input=None):
         self._update_card_id()
 
         self._enable_fin = False
@@ -94,8 +98,11 @@ class Player(object):
 
         self._use_mpd = use_mpd
 
-        if no_sound:
-            self._sound_input = '_fake_'
+        if sound_input:
+            # See PcmSource::Create() for supported inputs.
+            self._sound_input = sound_input
+        elif no_sound:
+            self._sound_input = 'gen:silence'
         else:
             if self._use_mpd:
                 self._sound_input = _SOUND_INPUT_LOOPBACK
@@ -142,9 +149,11 @@ class Player(object):
 
         self._visualizer_size = (
             IMAGE_FRAME_WIDTH / MESH_RATIO, FRAME_HEIGHT / MESH_RATIO)
+        # Without an X display, render through EGL.
+        headless = not os.environ.get('DISPLAY')
         self._visualizer = Visualizer(
             self._visualizer_size[0], self._visualizer_size[1], 512, FPS,
-            _PRESET_DIR[0], _PRESET_DIR[1], _PRESET_DURATION)
+            _PRESET_DIR[0], _PRESET_DIR[1], _PRESET_DURATION, headless)
         self._visualizer.SetVolumeMultiplier(self._visualization_volume)
         # id, effect_mode, rotation_angle, flip_mode
         self._visualizer.AddTargetController(TCL_MAIN, 2, 0, 0)
@@ -172,9 +181,11 @@ class Player(object):
         duration, delays = self._tcl.get_and_clear_frame_delays()
         for d in delays:
             self._frame_delay_stats.add(d)
+        dropped = 0
         if self._visualizer:
             for d in self._visualizer.GetAndClearFramePeriods():
                 self._visualization_period_stats.add(d)
+            dropped = self._visualizer.GetAndClearDroppedFrameCount()
         # A rather hacky way to calculate FPS. Depends on get/clear
         # timestamp. OK while we call it once per second though.
         fps = 0
@@ -185,13 +196,13 @@ class Player(object):
             self._visualization_period_stats.get_average_and_stddev()
         render_avg = self._render_durations.get_average_and_stddev()
         return ('Player [%s %s %02d:%02d] (fps=%s, delay=%s/%s, '
-                'render=%d/%d, vis=%d/%d, queued=%s)') % (
+                'render=%d/%d, vis=%d/%d, dropped=%d, queued=%s)') % (
                    self.status, self.clip_name,
                    elapsed_sec / 60, elapsed_sec % 60, fps,
                    int(frame_avg[0]), int(frame_avg[1]),
                    int(render_avg[0]), int(render_avg[1]),
                    int(visual_period_avg[0]), int(visual_period_avg[1]),
-                   self._tcl.get_queue_size())
+                   dropped, self._tcl.get_queue_size())
 
     def get_status_lines(self):
         if self._seek_time:
@@ -234,6 +245,18 @@ class Player(object):
             self._visualizer.GetLastVolumeRms(),
             bass[1], bass[3], bass[5],
             self._visualization_volume))
+        features = self._visualizer.GetAudioFeatures()
+        lines.append('Tempo BPM=%.1f (%.2f), Beats=%d, Onsets=%d' % (
+            features[AUDIO_FEATURE_BPM],
+            features[AUDIO_FEATURE_BPM_CONFIDENCE],
+            features[AUDIO_FEATURE_BEAT_COUNT],
+            features[AUDIO_FEATURE_ONSET_COUNT]))
+        switches = self._visualizer.GetAndClearPresetSwitchStats()
+        lines.append((
+            'Presets switches=%d (%d late), swap=%d/%dus, '
+            'load=%d/%dms') % (
+            switches[0], switches[9], switches[4], switches[5],
+            switches[7], switches[8]))
         # TODO(igorc): Show CPU, virtual and resident memory sizes
         # resource.getrusage(resource.RUSAGE_SELF)
         return lines
@@ -20,6 +20,7 @@
 #include "effects/rainbow.h"
 #include "effects/wearable.h"
 #include "tcl/tcl_manager.h"
+#include "util/frame_trace.h"
 #include "util/logging.h"
 #include "util/time.h"
 
@@ -79,6 +80,25 @@ void TclRenderer::LockControllers() {
   tcl_manager_->LockControllers();
 }
 
+void TclRenderer::SetFrameMailboxMode(bool enable) {
+  tcl_manager_->SetFrameMailboxMode(enable);
+}
+
+void TclRenderer::SetSenderPriority(int controller_id, int priority) {
+  tcl_manager_->SetSenderPriority(controller_id, priority);
+}
+
+void TclRenderer::SetControllerAddress(
+    int controller_id, const std::string& host, int port) {
+  tcl_manager_->SetControllerAddress(controller_id, host, port);
+}
+
+void TclRenderer::SetPacketPacing(
+    int controller_id, int start_gap_us, int data_gap_us, int spin_us) {
+  tcl_manager_->SetPacketPacing(
+      controller_id, start_gap_us, data_gap_us, spin_us);
+}
+
 void TclRenderer::StartMessageLoop(int fps, bool enable_net) {
   tcl_manager_->StartMessageLoop(fps, enable_net);
 }
@@ -107,6 +127,14 @@ void TclRenderer::SetAutoResetAfterNoDataMs(int value) {
   tcl_manager_->SetAutoResetAfterNoDataMs(value);
 }
 
+void TclRenderer::SetSkipUnchangedFrames(bool enable, int keepalive_ms) {
+  tcl_manager_->SetSkipUnchangedFrames(enable, keepalive_ms);
+}
+
+int TclRenderer::GetAndClearSkippedFrameCount() {
+  return tcl_manager_->GetAndClearSkippedFrameCount();
+}
+
 std::string TclRenderer::GetInitStatus() {
   return tcl_manager_->GetInitStatus();
 }
@@ -115,6 +143,21 @@ std::vector<int> TclRenderer::GetAndClearFrameDelays() {
   return tcl_manager_->GetAndClearFrameDelays();
 }
 
+std::vector<int> TclRenderer::GetAndClearPacketGapHistogram(int controller_id) {
+  return tcl_manager_->GetAndClearPacketGapHistogram(controller_id);
+}
+
+std::vector<int> TclRenderer::GetAndClearFrameStageHistograms(
+    int controller_id) {
+  return tcl_manager_->GetAndClearFrameStageHistograms(controller_id);
+}
+
+// static
+std::string TclRenderer::FormatFrameStageHistograms(
+    const std::vector<int>& histograms) {
+  return FrameTraceStats::FormatCounts(histograms);
+}
+
 int TclRenderer::GetFrameSendDuration() {
   return TclManager::GetFrameSendDurationMs();
 }
@@ -145,6 +188,16 @@ void TclRenderer::ScheduleImageAt(
     return;
   }
 
+  RgbaImage image(bytes->GetData(), w, h);
+  ScheduleImageAt(
+      controller_id, image, mode, crop_x, crop_y, crop_w, crop_h,
+      rotation_angle, flip_mode, id, time, wakeup);
+}
+
+void TclRenderer::ScheduleImageAt(
+    int controller_id, const RgbaImage& image, EffectMode mode,
+    int crop_x, int crop_y, int crop_w, int crop_h, int rotation_angle,
+    int flip_mode, int id, const AdjustableTime& time, bool wakeup) {
   if (is_text_mode_ && controller_id == 3) {
     return;
   }
@@ -161,84 +214,97 @@ void TclRenderer::ScheduleImageAt(
   // but given internal optimizations in that method, it's OK to call often.
   UpdateWearableEffects();
 
-  uint8_t* cropped_img = bytes->GetData();
-  if (flip_mode == 1) {
-    cropped_img = FlipImage(cropped_img, w, h, true);
-  } else if (flip_mode == 2) {
-    cropped_img = FlipImage(cropped_img, w, h, false);
+  int w = image.width();
+  int h = image.height();
+  RgbaImage flipped_img;
+  if (flip_mode == 1 || flip_mode == 2) {
+    flipped_img.ResizeStorage(w, h);
+    FlipImage(image.data(), w, h, flip_mode == 1, flipped_img.mutable_data());
   }
 
-  if (crop_x != 0 || crop_y != 0 || crop_w != w || crop_h != h) {
-    uint8_t* old_img = cropped_img;
-    cropped_img = CropImage(
-        cropped_img, w, h, crop_x, crop_y, crop_w, crop_h);
-    if (old_img != bytes->GetData())
-      delete[] old_img;
-  } else {
-    crop_w = w;
-    crop_h = h;
+  if (crop_x < 0 || crop_y < 0 || crop_w <= 0 || crop_h <= 0 ||
+      crop_x + crop_w > w || crop_y + crop_h > h) {
+    fprintf(stderr, "Invalid crop rect in TCL renderer: %d,%d %dx%d\n",
+            crop_x, crop_y, crop_w, crop_h);
+    return;
   }
 
-  RgbaImage input_img(cropped_img, crop_w, crop_h);
   std::unique_ptr<RgbaImage> render_img(BuildImageLocked(
-      input_img, mode, rotation_angle, controller_w, controller_h));
+      flipped_img.empty() ? image : flipped_img,
+      crop_x, crop_y, crop_w, crop_h, mode, rotation_angle,
+      controller_w, controller_h));
+  if (!render_img)
+    return;
 
   tcl_manager_->ScheduleImageAt(
       controller_id, *render_img.get(), id, time.time_, wakeup);
-
-  if (cropped_img != bytes->GetData())
-    delete[] cropped_img;
 }
 
 std::unique_ptr<RgbaImage> TclRenderer::BuildImageLocked(
-    const RgbaImage& input_img, EffectMode mode,
-    int rotation_angle, int dst_w, int dst_h) {
+    const RgbaImage& input_img, int crop_x, int crop_y, int crop_w,
+    int crop_h, EffectMode mode, int rotation_angle, int dst_w, int dst_h) {
   if (input_img.empty())
     return std::unique_ptr<RgbaImage>();
 
-  const uint8_t* src_img = input_img.data();
-  int src_w = input_img.width();
-  int src_h = input_img.height();
-  if (rotation_angle != 0)
-    src_img = RotateImage(src_img, src_w, src_h, src_h, src_w, rotation_angle);
+  // Cropping is done by resizing a region of the input image in place,
+  // unless the rotation needs a separate image.
+  const uint8_t* src_img = input_img.data() +
+      RGBA_LEN(input_img.width(), crop_y) + RGBA_LEN(crop_x, 1);
+  int src_stride = input_img.width();
+  int src_w = crop_w;
+  int src_h = crop_h;
+  uint8_t* rotated_img = nullptr;
+  if (rotation_angle != 0) {
+    uint8_t* cropped_img = CropImage(
+        input_img.data(), input_img.width(), input_img.height(),
+        crop_x, crop_y, crop_w, crop_h);
+    rotated_img = RotateImage(
+        cropped_img, src_w, src_h, src_h, src_w, rotation_angle);
+    delete[] cropped_img;
+    src_img = rotated_img;
+    src_stride = src_w;
+  }
 
   // We expect all incoming images to use linearized RGB gamma.
   std::unique_ptr<RgbaImage> dst(new RgbaImage());
   dst->ResizeStorage(dst_w, dst_h);
+  uint8_t* dst_data = dst->mutable_data();
   if (mode == EFFECT_OVERLAY) {
-    ResizeImage(src_img, src_w, src_h, dst->data(), dst_w, dst_h);
+    ResizeImage(src_img, src_w, src_h, src_stride, dst_data, dst_w, dst_h);
   } else if (mode == EFFECT_DUPLICATE) {
-    uint8_t* img1 = ResizeImage(src_img, src_w, src_h, dst_w / 2, dst_h);
+    uint8_t* img1 = new uint8_t[RGBA_LEN(dst_w / 2, dst_h)];
+    ResizeImage(src_img, src_w, src_h, src_stride, img1, dst_w / 2, dst_h);
     PasteSubImage(
         img1, dst_w / 2, dst_h,
-        dst->data(), 0, 0, dst_w, dst_h, false, true);
+        dst_data, 0, 0, dst_w, dst_h, false, true);
     if (is_text_mode_) {
       PasteSubImage(
           img1, dst_w / 2, dst_h,
-          dst->data(), dst_w / 2 + 45, 0, dst_w, dst_h, false, true);
+          dst_data, dst_w / 2 + 45, 0, dst_w, dst_h, false, true);
     } else {
       PasteSubImage(
           img1, dst_w / 2, dst_h,
-          dst->data(), dst_w / 2, 0, dst_w, dst_h, false, true);
+          dst_data, dst_w / 2, 0, dst_w, dst_h, false, true);
     }
     delete[] img1;
   } else {  // EFFECT_MIRROR
-    uint8_t* img1 = ResizeImage(
-        src_img, src_w, src_h, dst_w / 2, dst_h);
+    uint8_t* img1 = new uint8_t[RGBA_LEN(dst_w / 2, dst_h)];
+    ResizeImage(src_img, src_w, src_h, src_stride, img1, dst_w / 2, dst_h);
     uint8_t* img2 = FlipImage(img1, dst_w / 2, dst_h, true);
     PasteSubImage(
         img1, dst_w / 2, dst_h,
-        dst->data(), 0, 0, dst_w, dst_h, false, true);
+        dst_data, 0, 0, dst_w, dst_h, false, true);
     PasteSubImage(
         img2, dst_w / 2, dst_h,
-        dst->data(), dst_w / 2, 0, dst_w, dst_h, false, true);
+        dst_data, dst_w / 2, 0, dst_w, dst_h, false, true);
     delete[] img1;
     delete[] img2;
   }
 
-  if (src_img != input_img.data())
-    delete[] src_img;
+  delete[] rotated_img;
 
+  *dst->mutable_trace() = input_img.trace();
+  dst->mutable_trace()->Mark(FRAME_STAGE_IMAGE_BUILT);
   return dst;
 }
 
@@ -269,7 +335,8 @@ void TclRenderer::SetEffectImage(
 
   int rotation_angle = 0;
   std::unique_ptr<RgbaImage> render_img(BuildImageLocked(
-      input_img, mode, rotation_angle, controller.width, controller.height));
+      input_img, 0, 0, w, h, mode, rotation_angle,
+      controller.width, controller.height));
   controller.passthrough_effect->SetImage(*render_img.get());
 }
 
@@ -66,6 +66,25 @@ class TclRenderer {
       const LedLayout& layout, double gamma);
   void LockControllers();
 
+  // Keeps only the newest frame per controller, see TclManager.
+  // Call before LockControllers().
+  void SetFrameMailboxMode(bool enable);
+
+  // Sets SCHED_RR priority of the controller's sender thread,
+  // or 0 for the default policy. Call before StartMessageLoop().
+  void SetSenderPriority(int controller_id, int priority);
+
+  // Overrides controller's address, e.g. to use an emulator.
+  // Call before StartMessageLoop().
+  void SetControllerAddress(
+      int controller_id, const std::string& host, int port);
+
+  // Sets delays after the start packet and after each data packet,
+  // and the duration to busy-spin at the end of each delay.
+  // Call before StartMessageLoop().
+  void SetPacketPacing(
+      int controller_id, int start_gap_us, int data_gap_us, int spin_us);
+
   static TclRenderer* GetInstance() { return instance_; }
 
   void StartMessageLoop(int fps, bool enable_net);
@@ -82,6 +101,13 @@ class TclRenderer {
       int controller_id, Bytes* bytes, int w, int h, EffectMode mode,
       int crop_x, int crop_y, int crop_w, int crop_h, int rotation_angle,
       int flip_mode, int id, const AdjustableTime& time, bool wakeup);
+#ifndef SWIG
+  // Same as above, but shares pixels of |image| instead of copying them.
+  void ScheduleImageAt(
+      int controller_id, const RgbaImage& image, EffectMode mode,
+      int crop_x, int crop_y, int crop_w, int crop_h, int rotation_angle,
+      int flip_mode, int id, const AdjustableTime& time, bool wakeup);
+#endif
   void Wakeup();
 
   void SetEffectImage(
@@ -116,9 +142,23 @@ class TclRenderer {
 
   std::vector<int> GetAndClearFrameDelays();
 
+  // Returns counts of achieved gaps between packets, in 50us buckets.
+  std::vector<int> GetAndClearPacketGapHistogram(int controller_id);
+
+  // Returns latency histograms of frame pipeline stages, one row of 2000
+  // 50us buckets per stage, followed by a row of total latency.
+  // FormatFrameStageHistograms() summarizes them as text.
+  std::vector<int> GetAndClearFrameStageHistograms(int controller_id);
+  static std::string FormatFrameStageHistograms(
+      const std::vector<int>& histograms);
+
   // Reset controller if no reply data in ms. Default is 5000.
   void SetAutoResetAfterNoDataMs(int value);
 
+  // Skips sending frames that did not change, except for keepalives.
+  void SetSkipUnchangedFrames(bool enable, int keepalive_ms);
+  int GetAndClearSkippedFrameCount();
+
   void SetHdrMode(HdrMode mode);
 
   // Returns the number of currently queued frames.
@@ -148,8 +188,8 @@ class TclRenderer {
   typedef std::map<int, ControllerInfo> ControllerInfoMap;
 
   std::unique_ptr<RgbaImage> BuildImageLocked(
-      const RgbaImage& input_img, EffectMode mode,
-      int rotation_angle, int dst_w, int dst_h);
+      const RgbaImage& input_img, int crop_x, int crop_y, int crop_w,
+      int crop_h, EffectMode mode, int rotation_angle, int dst_w, int dst_h);
   void SetGenericEffect(int controller_id, Effect* effect, int priority);
   void UpdateWearableEffects();
 
@@ -34,6 +34,9 @@ class TclRenderer(object):
     self._renderer.AddController(controller_id, width, height, layout, gamma)
 
   def lock_controllers(self):
+    # Frames come from the visualizer thread only, and are scheduled
+    # when due, so keeping only the newest frame per controller is enough.
+    self._renderer.SetFrameMailboxMode(True)
     self._renderer.LockControllers()
     self._frame_send_duration = self._renderer.GetFrameSendDuration()
     self._renderer.SetHdrMode(self._hdr_mode)
@@ -129,6 +132,10 @@ class TclRenderer(object):
     self._frame_delays_clear_time = get_time_millis()
     return (duration, result)
 
+  def get_and_clear_frame_stage_report(self, controller):
+    histograms = self._renderer.GetAndClearFrameStageHistograms(controller)
+    return self._renderer.FormatFrameStageHistograms(histograms)
+
   def _populate_frame_delays(self):
     for d in self._renderer.GetAndClearFrameDelays():
       self._frame_delays.append(d)
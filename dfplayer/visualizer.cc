@@ -20,28 +20,47 @@
 
 #include "model/projectm_source.h"
 #include "tcl_renderer.h"
+#include "util/frame_trace.h"
 #include "util/lock.h"
 #include "util/logging.h"
 #include "util/time.h"
 
+class Visualizer::FrameSubscriber : public ImageSource::Subscriber {
+ public:
+  explicit FrameSubscriber(Visualizer* visualizer)
+      : visualizer_(visualizer) {}
+
+  void OnImage(const RgbaImage& image) override {
+    visualizer_->OnImage(image);
+  }
+
+ private:
+  Visualizer* visualizer_;
+};
+
 Visualizer::Visualizer(
     int width, int height, int tex_size, int fps,
     const std::string& preset_dir, const std::string& textures_dir,
-    int preset_duration)
-    : width_(width), height_(height), lock_(PTHREAD_MUTEX_INITIALIZER) {
-  last_render_time_ = GetCurrentMillis();
-  ms_per_frame_ = (uint32_t) (1000.0 / fps);
+    int preset_duration, bool headless)
+    : width_(width), height_(height),
+      frame_subscriber_(new FrameSubscriber(this)),
+      lock_(PTHREAD_MUTEX_INITIALIZER) {
+  pthread_cond_init(&cond_, NULL);
 
   projectm_source_ = new ProjectmSource(
-      width, height, tex_size, fps, preset_dir, textures_dir, preset_duration);
+      width, height, tex_size, fps, preset_dir, textures_dir, preset_duration,
+      headless ? RENDER_BACKEND_EGL : RENDER_BACKEND_GLX);
   tex_size_ = projectm_source_->tex_size();
 }
 
 Visualizer::~Visualizer() {
+  projectm_source_->RemoveSubscriber(frame_subscriber_.get());
+
   if (has_started_thread_) {
     {
       Autolock l(lock_);
       is_shutting_down_ = true;
+      pthread_cond_broadcast(&cond_);
     }
 
     pthread_join(thread_, NULL);
@@ -49,27 +68,37 @@ Visualizer::~Visualizer() {
 
   delete projectm_source_;
 
+  pthread_cond_destroy(&cond_);
   pthread_mutex_destroy(&lock_);
 }
 
 void Visualizer::StartMessageLoop() {
-  projectm_source_->StartMessageLoop();
-
-  Autolock l(lock_);
-  if (has_started_thread_)
-    return;
-  has_started_thread_ = true;
-  int err = pthread_create(&thread_, NULL, &ThreadEntry, this);
-  if (err != 0) {
-    fprintf(stderr, "pthread_create failed with %d\n", err);
-    CHECK(false);
+  {
+    Autolock l(lock_);
+    if (has_started_thread_)
+      return;
+    has_started_thread_ = true;
+    int err = pthread_create(&thread_, NULL, &ThreadEntry, this);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create failed with %d\n", err);
+      CHECK(false);
+    }
   }
+
+  projectm_source_->AddSubscriber(frame_subscriber_.get());
+  projectm_source_->StartMessageLoop();
 }
 
 void Visualizer::UseAlsa(const std::string& spec) {
   projectm_source_->UseAlsa(spec);
 }
 
+void Visualizer::SetAudioCaptureOptions(
+    int period_us, int period_count, bool use_mmap) {
+  projectm_source_->SetAudioCaptureOptions(
+      period_us, period_count, use_mmap);
+}
+
 void Visualizer::AddTargetController(
     int id, int effect_mode, int rotation_angle, int flip_mode) {
   Autolock l(lock_);
@@ -101,10 +130,25 @@ int Visualizer::GetAndClearOverrunCount() {
   return projectm_source_->GetAndClearOverrunCount();
 }
 
+std::vector<int> Visualizer::GetAndClearAudioLatencyStats() {
+  return projectm_source_->GetAndClearAudioLatencyStats();
+}
+
 std::vector<int> Visualizer::GetAndClearFramePeriods() {
   return projectm_source_->GetAndClearFramePeriods();
 }
 
+std::vector<int> Visualizer::GetAndClearPresetSwitchStats() {
+  return projectm_source_->GetAndClearPresetSwitchStats();
+}
+
+int Visualizer::GetAndClearDroppedFrameCount() {
+  Autolock l(lock_);
+  int result = dropped_frame_count_;
+  dropped_frame_count_ = 0;
+  return result;
+}
+
 Bytes* Visualizer::GetAndClearLastImageForTest() {
   if (!projectm_source_->GetAndClearHasNewImage())
     return NULL;
@@ -143,7 +187,46 @@ std::vector<double> Visualizer::GetLastBassInfo() {
   return projectm_source_->GetLastBassInfo();
 }
 
-void Visualizer::PostTclFrameLocked() {
+static double GetAgeMs(uint64_t time_us, uint64_t now) {
+  if (!time_us)
+    return -1;
+  return (now > time_us ? (now - time_us) / 1000.0 : 0);
+}
+
+std::vector<double> Visualizer::GetAudioFeatures() {
+  static_assert(AUDIO_FEATURE_FLUX - AUDIO_FEATURE_BAND_0 ==
+                AudioFeatures::kBandCount, "Band count mismatch");
+  AudioFeatures features;
+  projectm_source_->GetAudioFeatures(&features);
+  uint64_t now = GetCurrentMicros();
+  std::vector<double> result;
+  result.push_back(GetAgeMs(features.time_us, now));
+  result.push_back(features.rms);
+  for (int i = 0; i < AudioFeatures::kBandCount; ++i)
+    result.push_back(features.bands[i]);
+  result.push_back(features.flux);
+  result.push_back(features.onset_count);
+  result.push_back(GetAgeMs(features.last_onset_time_us, now));
+  result.push_back(features.beat_count);
+  result.push_back(GetAgeMs(features.last_beat_time_us, now));
+  result.push_back(features.bpm);
+  result.push_back(features.bpm_confidence);
+  CHECK(result.size() == AUDIO_FEATURE_COUNT);
+  return result;
+}
+
+void Visualizer::OnImage(const RgbaImage& image) {
+  Autolock l(lock_);
+  if (has_pending_image_)
+    dropped_frame_count_++;
+  // Shares pixels with the source, and is not copied.
+  pending_image_ = image;
+  has_pending_image_ = true;
+  pthread_cond_signal(&cond_);
+}
+
+void Visualizer::PostTclFrame(
+    RgbaImage* image, const std::vector<ControllerInfo>& controllers) {
   static const int kCropWidth = 4;
 
   TclRenderer* tcl = TclRenderer::GetInstance();
@@ -153,13 +236,11 @@ void Visualizer::PostTclFrameLocked() {
   }
 
   AdjustableTime now;
-  // TODO(igorc): Reduce data copies.
-  std::unique_ptr<RgbaImage> image = projectm_source_->GetImage(-1);
-  Bytes* bytes = new Bytes(image->data(), image->data_size());
-  for (size_t i = 0; i < target_controllers_.size(); ++i) {
-    const ControllerInfo& controller = target_controllers_[i];
+  image->mutable_trace()->Mark(FRAME_STAGE_POSTED);
+  for (size_t i = 0; i < controllers.size(); ++i) {
+    const ControllerInfo& controller = controllers[i];
     tcl->ScheduleImageAt(
-        controller.id_, bytes, tex_size_, tex_size_,
+        controller.id_, *image,
         (EffectMode) controller.effect_mode_,
         kCropWidth, kCropWidth,
 	tex_size_ - kCropWidth * 2, tex_size_ - kCropWidth * 2,
@@ -168,7 +249,6 @@ void Visualizer::PostTclFrameLocked() {
   }
   // Wakeup only once to avoid concurrent locking.
   tcl->Wakeup();
-  delete bytes;
 }
 
 // static
@@ -179,33 +259,23 @@ void* Visualizer::ThreadEntry(void* arg) {
 }
 
 void Visualizer::Run() {
-  uint64_t next_render_time = GetCurrentMillis() + ms_per_frame_;
-  uint32_t frame_num = 0;
   while (true) {
-    uint32_t remaining_time = 0;
+    RgbaImage image;
+    std::vector<ControllerInfo> controllers;
     {
       Autolock l(lock_);
+      while (!is_shutting_down_ && !has_pending_image_)
+        pthread_cond_wait(&cond_, &lock_);
       if (is_shutting_down_)
         break;
-      uint64_t now = GetCurrentMillis();
-      if (next_render_time > now)
-        remaining_time = next_render_time - now;
-    }
-
-    if (remaining_time > 0) {
-      Sleep(((double) remaining_time) / 1000.0);
-      continue;
-    }
-
-    {
-      Autolock l(lock_);
-      if (is_shutting_down_)
-        break;
-
-      PostTclFrameLocked();
-      next_render_time += ms_per_frame_;
+      image = pending_image_;
+      pending_image_.Clear();
+      has_pending_image_ = false;
+      controllers = target_controllers_;
     }
 
-    frame_num++;
+    // Posts without the lock, so that the render thread never waits
+    // for TCL processing.
+    PostTclFrame(&image, controllers);
   }
 }
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -17,17 +18,41 @@
 
 class ProjectmSource;
 
+// Indices of values returned by Visualizer::GetAudioFeatures().
+enum AudioFeatureIndex {
+  AUDIO_FEATURE_AGE_MS,
+  AUDIO_FEATURE_RMS,
+  AUDIO_FEATURE_BAND_0,
+  AUDIO_FEATURE_FLUX = AUDIO_FEATURE_BAND_0 + 8,
+  AUDIO_FEATURE_ONSET_COUNT,
+  AUDIO_FEATURE_ONSET_AGE_MS,
+  AUDIO_FEATURE_BEAT_COUNT,
+  AUDIO_FEATURE_BEAT_AGE_MS,
+  AUDIO_FEATURE_BPM,
+  AUDIO_FEATURE_BPM_CONFIDENCE,
+  AUDIO_FEATURE_COUNT,
+};
+
+// Posts each frame rendered by ProjectmSource to TCL controllers as
+// soon as it is rendered. Frames are handed off to the Visualizer
+// thread, which does the TCL processing off the render thread.
 class Visualizer {
  public:
+  // When |headless| is set, renders through EGL without an X display.
   Visualizer(
       int width, int height, int tex_size, int fps,
       const std::string& preset_dir, const std::string& textures_dir,
-      int preset_duration);
+      int preset_duration, bool headless);
   ~Visualizer();
 
   void StartMessageLoop();
 
+  // Captures from an ALSA device, or from a generator or file,
+  // such as "gen:clicks,bpm=120". See PcmSource::Create().
   void UseAlsa(const std::string& spec);
+  // Call before UseAlsa(). Defaults are 5000us, 20 periods, no MMAP.
+  void SetAudioCaptureOptions(
+      int period_us, int period_count, bool use_mmap);
   void AddTargetController(
       int id, int effect_mode, int rotation_angle, int flip_mode);
 
@@ -51,8 +76,19 @@ class Visualizer {
   // Returns [bass, bass_att, mid, mid_att, treb, treb_att].
   std::vector<double> GetLastBassInfo();
 
+  // Returns AUDIO_FEATURE_COUNT values, ordered as AudioFeatureIndex,
+  // without blocking. Ages are -1 for events that did not happen.
+  // See AudioFeatures for the meaning of values.
+  std::vector<double> GetAudioFeatures();
+
   int GetAndClearOverrunCount();
+  std::vector<int> GetAndClearAudioLatencyStats();
   std::vector<int> GetAndClearFramePeriods();
+  // See ProjectmSource::GetAndClearPresetSwitchStats().
+  std::vector<int> GetAndClearPresetSwitchStats();
+  // Returns the number of rendered frames that were replaced by newer
+  // ones before they were posted to TCL.
+  int GetAndClearDroppedFrameCount();
 
  private:
   Visualizer(const Visualizer& src);
@@ -69,21 +105,30 @@ class Visualizer {
     int flip_mode_;
   };
 
+  class FrameSubscriber;
+
   void Run();
   static void* ThreadEntry(void* arg);
 
-  void PostTclFrameLocked();
+  // Called on the render thread.
+  void OnImage(const RgbaImage& image);
+
+  void PostTclFrame(
+      RgbaImage* image, const std::vector<ControllerInfo>& controllers);
 
   int width_;
   int height_;
   int tex_size_;
   ProjectmSource* projectm_source_;
+  std::unique_ptr<FrameSubscriber> frame_subscriber_;
   std::vector<ControllerInfo> target_controllers_;
-  uint64_t last_render_time_;
-  uint32_t ms_per_frame_;
+  RgbaImage pending_image_;
+  bool has_pending_image_ = false;
+  int dropped_frame_count_ = 0;
   bool is_shutting_down_ = false;
   bool has_started_thread_ = false;
   pthread_mutex_t lock_;
+  pthread_cond_t cond_;
   pthread_t thread_;
 };
 
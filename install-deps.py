@@ -57,6 +57,7 @@ _KINECT_DEPS = [
 _EXTERNAL_DEPS = [
     'cmake',
     'libasound2-dev',
+    'libegl1-mesa-dev',
     'libglew-dev',
     'libftgl-dev',
     ]
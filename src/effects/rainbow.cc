@@ -65,7 +65,7 @@ void RainbowEffect::ApplyOnImage(RgbaImage* dst, bool* is_done) {
   int rainbow_width = rainbow_height_ / 3;
   rainbow_width = std::min(std::max(rainbow_width, 1), width());
   int start_x = std::max(rainbow_effective_x_ - rainbow_width / 2, 0);
-  uint32_t* data = reinterpret_cast<uint32_t*>(dst->data());
+  uint32_t* data = reinterpret_cast<uint32_t*>(dst->mutable_data());
   for (int y = 0; y < rainbow_height_; ++y) {
     int rainbow_pos =
 	static_cast<int>(static_cast<double>(y) / height() * kRainbowSize);
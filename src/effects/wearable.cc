@@ -2,6 +2,9 @@
 
 #include "effects/wearable.h"
 
+#include <utility>
+#include <vector>
+
 #include "util/lock.h"
 #include "util/logging.h"
 #include "util/led_layout.h"
@@ -9,35 +12,51 @@
 
 static dfsparks::UdpSocketNetwork network;
 
-// TODO: We can get a big performance boost by switching to LED-based effects as most
-// pixels in a matrix are not actually used, so there's no need to calculate (and then
-// interpolate) them
-struct FishPixels : public dfsparks::Pixels {
-  // The effects look better when they fit completely on one side of the fish.
-  // Since we have 500x50 image covering both sides, we'll just mirror the effect
-  // folding at 250px
+// Exposes LED's of the layout as dfsparks pixels. The effects look better
+// when they fit completely on one side of the fish. Since we have 500x50
+// image covering both sides, the effect is mirrored by folding at 250px.
+struct WearableEffect::LedPixels : public dfsparks::Pixels {
   static constexpr int sizeMax = 250;
 
-  FishPixels(RgbaImage &img) : img(img) {}
-  int getNumberOfPixels() const final { return width()*height(); };
-  int getWidth() const final { return img.width() < sizeMax ? img.width() : sizeMax; }
-  int getHeight() const final { return img.height() < sizeMax ? img.height() : sizeMax; }
-  void getCoords(int i, int *x, int *y) const final { *y = i / width(); *x = i % width(); }
-  void doSetColor(int index, dfsparks::RgbaColor color) final {
-      int x,y;
-      getCoords(index, &x, &y);
-      for(int i = 0; i < img.width()/width(); ++i ) {
-        for(int j = 0; j < img.height()/height(); ++j) {
-          uint8_t *d = img.data() + 4*(img.width()*(y + 250*j) + x + 250*i);
-          d[0] = color.red;
-          d[1] = color.green;
-          d[2] = color.blue;
-          d[3] = color.alpha;          }
+  LedPixels(const LedLayout& layout, int img_width, int img_height)
+      : width_(img_width < sizeMax ? img_width : sizeMax),
+        height_(img_height < sizeMax ? img_height : sizeMax) {
+    for (int strand_id = 0; strand_id < layout.GetStrandCount(); ++strand_id) {
+      for (int led_id = 0; led_id < layout.GetLedCount(strand_id); ++led_id) {
+        LedCoord coord;
+        int x = 0, y = 0;
+        if (layout.GetLedCoord(strand_id, led_id, &coord)) {
+          x = ((coord.x % width_) + width_) % width_;
+          y = ((coord.y % height_) + height_) % height_;
+        }
+        coords_.push_back(std::make_pair(x, y));
       }
+    }
   }
-  RgbaImage &img;
-};
 
+  int getNumberOfPixels() const final { return coords_.size(); }
+  int getWidth() const final { return width_; }
+  int getHeight() const final { return height_; }
+
+  void getCoords(int i, int *x, int *y) const final {
+    *x = coords_[i].first;
+    *y = coords_[i].second;
+  }
+
+  void doSetColor(int index, dfsparks::RgbaColor color) final {
+    uint8_t* d = strands->GetAllColorData() + index * 4;
+    d[0] = color.red;
+    d[1] = color.green;
+    d[2] = color.blue;
+    d[3] = 255;
+  }
+
+  int width_;
+  int height_;
+  // Effect coordinates of each LED, in the order of LedStrands colors.
+  std::vector<std::pair<int, int>> coords_;
+  LedStrands* strands = nullptr;
+};
 
 WearableEffect::WearableEffect() {
 }
@@ -62,7 +81,7 @@ void WearableEffect::SetEffect(int id) {
   started_playing_ = false;
 }
 
-void WearableEffect::ApplyOnImage(RgbaImage* dst, bool* is_done) {
+void WearableEffect::ApplyOnLeds(LedStrands* strands, bool* is_done) {
   (void) is_done;
 
   Autolock l(lock_);
@@ -70,7 +89,7 @@ void WearableEffect::ApplyOnImage(RgbaImage* dst, bool* is_done) {
     return;
 
   if (!player_) {
-    pixels_ = new FishPixels(*dst);
+    pixels_ = new LedPixels(layout(), width(), height());
     player_ = new dfsparks::NetworkPlayer(*pixels_, network);
     player_->shuffleAll();
     static bool haveServer = false;
@@ -85,6 +104,11 @@ void WearableEffect::ApplyOnImage(RgbaImage* dst, bool* is_done) {
     player_->play(effect_id_, dfsparks::Player::HIGH_PRIORITY);
   }
 
-  network.poll(); 
+  // Incoming colors may be in HSL, while the effect writes RGB.
+  strands->ConvertTo(LedStrands::TYPE_RGB);
+  CHECK(strands->GetTotalLedCount() == pixels_->getNumberOfPixels());
+  pixels_->strands = strands;
+  network.poll();
   player_->render();
+  pixels_->strands = nullptr;
 }
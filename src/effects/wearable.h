@@ -17,10 +17,10 @@ class WearableEffect : public Effect {
   // presets from ProjectM.
   void SetEffect(int id);
 
-  void ApplyOnImage(RgbaImage* dst, bool* is_done) final;
+  // Renders the effect directly into LED colors, so that it is
+  // only computed for pixels that are lit by LED's.
+  void ApplyOnLeds(LedStrands* strands, bool* is_done) final;
 
-  //void ApplyOnLeds(LedStrands* strands, bool* is_done) final;
- 
   void Destroy() final;
 
  protected:
@@ -30,7 +30,9 @@ class WearableEffect : public Effect {
   WearableEffect(const WearableEffect& src);
   WearableEffect& operator=(const WearableEffect& rhs);
 
-  dfsparks::Pixels* pixels_ = nullptr;
+  struct LedPixels;
+
+  LedPixels* pixels_ = nullptr;
   dfsparks::NetworkPlayer* player_ = nullptr;
   int effect_id_ = -1;
   bool started_playing_ = false;
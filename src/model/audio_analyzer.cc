@@ -0,0 +1,248 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/audio_analyzer.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/logging.h"
+
+namespace {
+
+const float kBandEdgesHz[AudioFeatures::kBandCount + 1] = {
+    20, 60, 150, 400, 1000, 2500, 6000, 12000, 20000};
+
+// Kick drums are mostly below this frequency.
+const float kBassEndHz = 150;
+
+// Band averages follow changes of loudness within a few seconds.
+const float kBandAverageSec = 3;
+
+// Spectrum is compressed as log(1 + kLogCompression * power), so that
+// quiet passages produce comparable flux.
+const float kLogCompression = 1000;
+
+// Peaks must exceed mean + kPeakSigmas * stddev of the last second.
+const float kPeakSigmas = 1.5;
+const float kMinPeakFlux = 0.1;
+const float kPeakHistorySec = 1;
+const uint64_t kMinOnsetIntervalUs = 100000;
+// Limits beats to 200 BPM.
+const uint64_t kMinBeatIntervalUs = 300000;
+
+// Tempo is searched between these limits, preferring values near
+// kPreferredBpm to resolve ambiguity between multiples of the tempo.
+const float kTempoHistorySec = 6;
+const float kTempoIntervalSec = 0.5;
+const float kMinBpm = 60;
+const float kMaxBpm = 200;
+const float kPreferredBpm = 120;
+const float kPreferredBpmOctaves = 1;
+
+}  // namespace
+
+AudioAnalyzer::PeakDetector::PeakDetector(
+    int history_size, uint64_t min_interval_us)
+    : history_(history_size), min_interval_us_(min_interval_us) {}
+
+bool AudioAnalyzer::PeakDetector::Add(float value, uint64_t time_us) {
+  int n = history_count_;
+  float sum = 0;
+  float sum_sq = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += history_[i];
+    sum_sq += history_[i] * history_[i];
+  }
+  int size = history_.size();
+  history_[history_pos_] = value;
+  history_pos_ = (history_pos_ + 1) % size;
+  history_count_ = std::min(history_count_ + 1, size);
+  // Not enough history to judge.
+  if (n < size / 2)
+    return false;
+
+  float mean = sum / n;
+  float stddev = sqrtf(std::max(0.0f, sum_sq / n - mean * mean));
+  if (value < mean + kPeakSigmas * stddev || value < kMinPeakFlux)
+    return false;
+  if (last_peak_time_us_ && time_us - last_peak_time_us_ < min_interval_us_)
+    return false;
+  last_peak_time_us_ = time_us;
+  return true;
+}
+
+AudioAnalyzer::AudioAnalyzer(int rate)
+    : rate_(rate), frames_per_sec_(static_cast<float>(rate) / kHopSize),
+      spectrum_(kFftSize), samples_(kFftSize), block_(kFftSize),
+      power_(kFftSize / 2 + 1), log_power_(kFftSize / 2 + 1),
+      onset_detector_(frames_per_sec_ * kPeakHistorySec, kMinOnsetIntervalUs),
+      beat_detector_(frames_per_sec_ * kPeakHistorySec, kMinBeatIntervalUs),
+      envelope_(frames_per_sec_ * kTempoHistorySec) {
+  int max_bin = kFftSize / 2;
+  for (int i = 0; i <= AudioFeatures::kBandCount; ++i) {
+    int bin = static_cast<int>(kBandEdgesHz[i] * kFftSize / rate + 0.5);
+    band_bins_[i] = std::min(std::max(bin, 1), max_bin + 1);
+  }
+  for (int i = 0; i < AudioFeatures::kBandCount; ++i) {
+    band_averages_[i] = 0;
+    // Lowest bands are narrower than one bin at this FFT size.
+    if (band_bins_[i + 1] <= band_bins_[i])
+      band_bins_[i + 1] = std::min(band_bins_[i] + 1, max_bin + 1);
+  }
+  bass_end_bin_ = static_cast<int>(kBassEndHz * kFftSize / rate + 0.5);
+  tempo_work_.resize(envelope_.size());
+}
+
+bool AudioAnalyzer::Process(
+    const int16_t* frames, int count, uint64_t time_us) {
+  bool updated = false;
+  for (int i = 0; i < count; ++i) {
+    samples_[sample_pos_] =
+        (frames[i * 2] + frames[i * 2 + 1]) * (0.5f / 32768.0f);
+    sample_pos_ = (sample_pos_ + 1) & (kFftSize - 1);
+    if (++hop_fill_ < kHopSize)
+      continue;
+    hop_fill_ = 0;
+    uint64_t age_us =
+        static_cast<uint64_t>(count - 1 - i) * 1000000 / rate_;
+    Analyze(time_us > age_us ? time_us - age_us : 0);
+    updated = true;
+  }
+  return updated;
+}
+
+void AudioAnalyzer::Analyze(uint64_t time_us) {
+  // Oldest sample is at |sample_pos_|.
+  int tail = kFftSize - sample_pos_;
+  memcpy(&block_[0], &samples_[sample_pos_], tail * sizeof(float));
+  memcpy(&block_[tail], &samples_[0], sample_pos_ * sizeof(float));
+
+  float sum_sq = 0;
+  for (int i = 0; i < kFftSize; ++i)
+    sum_sq += block_[i] * block_[i];
+  features_.rms = sqrtf(sum_sq / kFftSize);
+
+  spectrum_.Compute(&block_[0], &power_[0]);
+
+  // Scales powers so that a full-scale sine produces 1 in its bin.
+  const float scale = 16.0f / (kFftSize * kFftSize);
+  float flux = 0;
+  float bass_flux = 0;
+  for (int i = 1; i <= kFftSize / 2; ++i) {
+    float log_power = log1pf(kLogCompression * power_[i] * scale);
+    float diff = log_power - log_power_[i];
+    log_power_[i] = log_power;
+    if (diff <= 0)
+      continue;
+    flux += diff;
+    if (i < bass_end_bin_)
+      bass_flux += diff;
+  }
+  // The first frame compares to silence.
+  if (!features_.frame_count) {
+    flux = 0;
+    bass_flux = 0;
+  }
+
+  float alpha = 1.0f / (frames_per_sec_ * kBandAverageSec);
+  for (int b = 0; b < AudioFeatures::kBandCount; ++b) {
+    float energy = 0;
+    for (int i = band_bins_[b]; i < band_bins_[b + 1]; ++i)
+      energy += power_[i];
+    energy *= scale / (band_bins_[b + 1] - band_bins_[b]);
+    if (!features_.frame_count) {
+      band_averages_[b] = energy;
+    } else {
+      band_averages_[b] += (energy - band_averages_[b]) * alpha;
+    }
+    features_.bands[b] = (band_averages_[b] > 1e-9f ?
+        energy / band_averages_[b] : 0);
+  }
+
+  features_.time_us = time_us;
+  features_.flux = flux;
+  if (onset_detector_.Add(flux, time_us)) {
+    ++features_.onset_count;
+    features_.last_onset_time_us = time_us;
+  }
+  if (beat_detector_.Add(bass_flux, time_us)) {
+    ++features_.beat_count;
+    features_.last_beat_time_us = time_us;
+  }
+
+  envelope_[envelope_pos_] = flux;
+  envelope_pos_ = (envelope_pos_ + 1) % envelope_.size();
+  ++features_.frame_count;
+  int tempo_interval = static_cast<int>(frames_per_sec_ * kTempoIntervalSec);
+  if (features_.frame_count >= envelope_.size() &&
+      features_.frame_count % tempo_interval == 0) {
+    EstimateTempo();
+  }
+}
+
+void AudioAnalyzer::EstimateTempo() {
+  // Unrolls the envelope oldest first, and removes its mean.
+  int n = envelope_.size();
+  float mean = 0;
+  for (int i = 0; i < n; ++i) {
+    tempo_work_[i] = envelope_[(envelope_pos_ + i) % n];
+    mean += tempo_work_[i];
+  }
+  mean /= n;
+  for (int i = 0; i < n; ++i)
+    tempo_work_[i] -= mean;
+
+  float energy = 0;
+  for (int i = 0; i < n; ++i)
+    energy += tempo_work_[i] * tempo_work_[i];
+  if (energy <= 1e-6f) {
+    features_.bpm = 0;
+    features_.bpm_confidence = 0;
+    return;
+  }
+
+  int min_lag = static_cast<int>(frames_per_sec_ * 60 / kMaxBpm);
+  int max_lag = static_cast<int>(frames_per_sec_ * 60 / kMinBpm + 1);
+  max_lag = std::min(max_lag, n / 2);
+  int best_lag = 0;
+  float best_score = 0;
+  float best_corr = 0;
+  float prev_corr = 0;
+  float best_prev_corr = 0;
+  float best_next_corr = 0;
+  for (int lag = min_lag - 1; lag <= max_lag + 1; ++lag) {
+    float corr = 0;
+    for (int i = lag; i < n; ++i)
+      corr += tempo_work_[i] * tempo_work_[i - lag];
+    corr /= (n - lag);
+    if (lag == best_lag + 1)
+      best_next_corr = corr;
+    if (lag >= min_lag && lag <= max_lag && corr > 0) {
+      float octaves = log2f(frames_per_sec_ * 60 / lag / kPreferredBpm) /
+          kPreferredBpmOctaves;
+      float score = corr * expf(-0.5f * octaves * octaves);
+      if (score > best_score) {
+        best_score = score;
+        best_lag = lag;
+        best_corr = corr;
+        best_prev_corr = prev_corr;
+      }
+    }
+    prev_corr = corr;
+  }
+  if (!best_lag) {
+    features_.bpm = 0;
+    features_.bpm_confidence = 0;
+    return;
+  }
+
+  // Refines the lag with a parabola through the neighbouring values.
+  float lag = best_lag;
+  float denom = best_prev_corr - 2 * best_corr + best_next_corr;
+  if (denom < 0)
+    lag += 0.5f * (best_prev_corr - best_next_corr) / denom;
+  features_.bpm = frames_per_sec_ * 60 / lag;
+  features_.bpm_confidence = std::min(1.0f, best_corr / (energy / n));
+}
@@ -0,0 +1,101 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_AUDIO_ANALYZER_H_
+#define MODEL_AUDIO_ANALYZER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "util/fft.h"
+
+// Features of the most recently analyzed audio. Times are in
+// GetCurrentMicros() domain, and are zero until the first event.
+struct AudioFeatures {
+  static const int kBandCount = 8;
+
+  // Capture time of the newest analyzed frame.
+  uint64_t time_us = 0;
+  // Number of analysis frames so far.
+  uint32_t frame_count = 0;
+  float rms = 0;
+  // Energies of log-spaced bands from 20Hz to 20kHz, relative to their
+  // averages over the last few seconds, so that 1.0 is typical.
+  float bands[kBandCount] = {};
+  // Increase of log spectrum since the previous analysis frame.
+  float flux = 0;
+  // Onsets are detected on the whole spectrum, and beats on bass only.
+  uint32_t onset_count = 0;
+  uint64_t last_onset_time_us = 0;
+  uint32_t beat_count = 0;
+  uint64_t last_beat_time_us = 0;
+  // Tempo estimate, zero if unknown. Confidence is in [0, 1] range.
+  float bpm = 0;
+  float bpm_confidence = 0;
+};
+
+// Extracts AudioFeatures from a stream of S16 stereo frames. Every
+// kHopSize frames, a Hann-windowed FFT of the last kFftSize frames is
+// split into bands. Onsets are peaks of spectral flux above an adaptive
+// threshold. Tempo is the strongest periodicity of the flux over the
+// last few seconds. Allocates nothing after construction. Not thread-safe.
+class AudioAnalyzer {
+ public:
+  static const int kFftSize = 1024;
+  static const int kHopSize = 256;
+
+  explicit AudioAnalyzer(int rate);
+
+  // Appends |count| frames, the last of which was captured at |time_us|.
+  // Returns true if features were updated.
+  bool Process(const int16_t* frames, int count, uint64_t time_us);
+
+  const AudioFeatures& features() const { return features_; }
+
+ private:
+  AudioAnalyzer(const AudioAnalyzer& src);
+  AudioAnalyzer& operator=(const AudioAnalyzer& rhs);
+
+  // Detects values that stand out from the recent history of values.
+  class PeakDetector {
+   public:
+    PeakDetector(int history_size, uint64_t min_interval_us);
+
+    // Returns true if |value| is a new peak.
+    bool Add(float value, uint64_t time_us);
+
+   private:
+    std::vector<float> history_;
+    int history_pos_ = 0;
+    int history_count_ = 0;
+    uint64_t min_interval_us_;
+    uint64_t last_peak_time_us_ = 0;
+  };
+
+  void Analyze(uint64_t time_us);
+  void EstimateTempo();
+
+  const int rate_;
+  const float frames_per_sec_;
+  PowerSpectrum spectrum_;
+  // Mono samples in a circular buffer of kFftSize.
+  std::vector<float> samples_;
+  int sample_pos_ = 0;
+  int hop_fill_ = 0;
+  std::vector<float> block_;
+  std::vector<float> power_;
+  std::vector<float> log_power_;
+  // First bin of each band, and the end of the last band.
+  int band_bins_[AudioFeatures::kBandCount + 1];
+  float band_averages_[AudioFeatures::kBandCount];
+  int bass_end_bin_;
+  PeakDetector onset_detector_;
+  PeakDetector beat_detector_;
+  // Flux of the last few seconds in a circular buffer, for tempo.
+  std::vector<float> envelope_;
+  int envelope_pos_ = 0;
+  std::vector<float> tempo_work_;
+  AudioFeatures features_;
+};
+
+#endif  // MODEL_AUDIO_ANALYZER_H_
@@ -0,0 +1,175 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/audio_capture.h"
+
+#include <sched.h>
+#include <stdio.h>
+
+#include <memory>
+
+#include "model/pcm_source.h"
+#include "util/logging.h"
+#include "util/time.h"
+
+namespace {
+
+// Keeps about a second of audio for analysis of past frames.
+const int kRingDurationMs = 1000;
+
+// Bounds the time to notice shutdown while the device is silent.
+const int kWaitTimeoutMs = 100;
+
+const int kReopenDelayMs = 1000;
+
+}  // namespace
+
+void AudioCapture::LatencyCounter::Add(int value_us) {
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum_us.fetch_add(value_us, std::memory_order_relaxed);
+  int prev_max = max_us.load(std::memory_order_relaxed);
+  while (value_us > prev_max &&
+         !max_us.compare_exchange_weak(prev_max, value_us,
+                                       std::memory_order_relaxed)) {}
+}
+
+void AudioCapture::LatencyCounter::GetAndClear(std::vector<int>* dst) {
+  int n = count.exchange(0, std::memory_order_relaxed);
+  int64_t sum = sum_us.exchange(0, std::memory_order_relaxed);
+  dst->push_back(n);
+  dst->push_back(n ? sum / n : 0);
+  dst->push_back(max_us.exchange(0, std::memory_order_relaxed));
+}
+
+AudioCapture::AudioCapture(
+    const std::string& spec, int rate, const Options& options,
+    Seqlock<AudioFeatures>* features)
+    : spec_(spec), rate_(rate), options_(options), features_(features),
+      ring_(rate * kRingDurationMs / 1000),
+      is_shutting_down_(false), overrun_count_(0) {}
+
+AudioCapture::~AudioCapture() {
+  if (has_started_thread_) {
+    is_shutting_down_ = true;
+    pthread_join(thread_, nullptr);
+  }
+}
+
+void AudioCapture::Start() {
+  if (has_started_thread_)
+    return;
+  has_started_thread_ = true;
+
+  int err = pthread_create(&thread_, nullptr, &ThreadEntry, this);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create failed with %d\n", err);
+    CHECK(false);
+  }
+}
+
+int AudioCapture::ReadNewest(
+    int16_t* dst, int max_count, uint64_t* read_pos) {
+  int count = ring_.ReadNewest(dst, max_count, read_pos);
+  if (count > 0) {
+    uint64_t write_time = ring_.last_write_time_us();
+    read_age_.Add(GetCurrentMicros() - write_time);
+  }
+  return count;
+}
+
+int AudioCapture::GetAndClearOverrunCount() {
+  return overrun_count_.exchange(0);
+}
+
+std::vector<int> AudioCapture::GetAndClearLatencyStats() {
+  std::vector<int> result;
+  capture_delay_.GetAndClear(&result);
+  read_age_.GetAndClear(&result);
+  return result;
+}
+
+// static
+void* AudioCapture::ThreadEntry(void* arg) {
+  AudioCapture* self = reinterpret_cast<AudioCapture*>(arg);
+  self->Run();
+  return nullptr;
+}
+
+void AudioCapture::Run() {
+  if (options_.priority > 0) {
+    int policy = SCHED_RR;
+    struct sched_param param;
+    param.sched_priority = options_.priority;
+    fprintf(stderr, "Requesting policy=%d, priority=%d for audio capture\n",
+            policy, param.sched_priority);
+    int err = pthread_setschedparam(pthread_self(), policy, &param);
+    if (err != 0)
+      fprintf(stderr, "pthread_setschedparam failed with %d\n", err);
+  }
+
+  std::unique_ptr<PcmSource> source(PcmSource::Create(
+      spec_, rate_, options_.period_us, options_.period_count,
+      options_.use_mmap));
+  if (!source) {
+    fprintf(stderr, "Invalid audio input '%s'\n", spec_.c_str());
+    return;
+  }
+
+  AudioAnalyzer analyzer(rate_);
+  std::vector<int16_t> buffer;
+  int period_size = 0;
+  bool is_open = false;
+  while (!is_shutting_down_) {
+    if (!is_open) {
+      fprintf(stderr, "Opening audio input %s\n", spec_.c_str());
+      if (!source->Open()) {
+        fprintf(stderr, "Failed to open audio input\n");
+        SleepUnlessShuttingDown(kReopenDelayMs);
+        continue;
+      }
+      is_open = true;
+      period_size = source->period_size();
+      buffer.resize(period_size * 2);
+      fprintf(stderr, "Capturing audio input with period of %d frames\n",
+              period_size);
+    }
+
+    int overrun_count = 0;
+    int ready = source->Wait(kWaitTimeoutMs, &overrun_count);
+    overrun_count_ += overrun_count;
+    if (ready == 0)
+      continue;
+
+    int delay = (ready > 0 ? source->GetDelay() : -1);
+    bool has_failed = (ready < 0);
+    // Drains up to a full buffer. Sources that are not paced by a clock
+    // always have more frames.
+    for (int i = 0; i < options_.period_count && !has_failed; ++i) {
+      int count = source->Read(&buffer[0], period_size, &overrun_count);
+      overrun_count_ += overrun_count;
+      if (count < 0)
+        has_failed = true;
+      if (count <= 0)
+        break;
+      uint64_t now = GetCurrentMicros();
+      ring_.Write(&buffer[0], count, now);
+      if (features_ && analyzer.Process(&buffer[0], count, now))
+        features_->Write(analyzer.features());
+    }
+    if (delay >= 0)
+      capture_delay_.Add(delay * 1000000LL / rate_);
+
+    if (has_failed) {
+      fprintf(stderr, "Reopening audio input after a failure\n");
+      source->Close();
+      is_open = false;
+      SleepUnlessShuttingDown(kReopenDelayMs);
+    }
+  }
+
+  source->Close();
+}
+
+void AudioCapture::SleepUnlessShuttingDown(int ms) {
+  for (int i = 0; i < ms / kWaitTimeoutMs && !is_shutting_down_; ++i)
+    SleepUs(kWaitTimeoutMs * 1000);
+}
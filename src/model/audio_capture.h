@@ -0,0 +1,87 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_AUDIO_CAPTURE_H_
+#define MODEL_AUDIO_CAPTURE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "model/audio_analyzer.h"
+#include "util/pcm_ring.h"
+#include "util/seqlock.h"
+
+// Captures stereo S16 audio from a PcmSource on a dedicated thread.
+// The thread sleeps until a period is captured, and appends it to
+// a lock-free ring, from which the renderer reads the newest frames.
+// The same thread analyzes each period, and publishes AudioFeatures.
+// The source is reopened if it fails.
+class AudioCapture {
+ public:
+  struct Options {
+    int period_us = 5000;
+    // Periods are read as soon as they are captured, so a longer buffer
+    // does not add latency. It only tolerates longer scheduling stalls.
+    int period_count = 20;
+    bool use_mmap = false;
+    // SCHED_RR priority of the capture thread, or 0 to use the default
+    // scheduling policy. Above TCL senders, as the thread is short.
+    int priority = 20;
+  };
+
+  // See PcmSource::Create() for the |spec| format. |features| may be
+  // null, and must outlive this object.
+  AudioCapture(const std::string& spec, int rate, const Options& options,
+               Seqlock<AudioFeatures>* features);
+  ~AudioCapture();
+
+  void Start();
+
+  int rate() const { return rate_; }
+
+  // Called by one reader thread. See PcmRing::ReadNewest().
+  int ReadNewest(int16_t* dst, int max_count, uint64_t* read_pos);
+
+  int GetAndClearOverrunCount();
+
+  // Returns [periods, avg_capture_delay_us, max_capture_delay_us,
+  // reads, avg_read_age_us, max_read_age_us]. Capture delay is the age
+  // of the oldest frame when it is added to the ring. Read age is
+  // the age of the newest frame when it is read.
+  std::vector<int> GetAndClearLatencyStats();
+
+ private:
+  AudioCapture(const AudioCapture& src);
+  AudioCapture& operator=(const AudioCapture& rhs);
+
+  // Counts samples of one latency, updated without locks.
+  struct LatencyCounter {
+    void Add(int value_us);
+    void GetAndClear(std::vector<int>* dst);
+
+    std::atomic<int> count{0};
+    std::atomic<int64_t> sum_us{0};
+    std::atomic<int> max_us{0};
+  };
+
+  static void* ThreadEntry(void* arg);
+  void Run();
+  void SleepUnlessShuttingDown(int ms);
+
+  const std::string spec_;
+  const int rate_;
+  const Options options_;
+  Seqlock<AudioFeatures>* features_;
+  PcmRing ring_;
+  pthread_t thread_;
+  bool has_started_thread_ = false;
+  std::atomic<bool> is_shutting_down_;
+  std::atomic<int> overrun_count_;
+  LatencyCounter capture_delay_;
+  LatencyCounter read_age_;
+};
+
+#endif  // MODEL_AUDIO_CAPTURE_H_
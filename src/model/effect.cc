@@ -38,6 +38,6 @@ void Effect::MergeImage(RgbaImage* dst, const RgbaImage& src) {
     return;
 
   PasteSubImage(
-      src.data(), width_, height_, dst->data(), 0, 0, width_, height_,
+      src.data(), width_, height_, dst->mutable_data(), 0, 0, width_, height_,
       true, true);
 }
@@ -2,5 +2,39 @@
 
 #include "model/image_source.h"
 
+#include <algorithm>
+
+#include "util/lock.h"
+
 ImageSource::ImageSource(int width, int height, int fps)
-    : width_(width), height_(height), fps_(fps) {}
+    : width_(width), height_(height), fps_(fps),
+      subscribers_lock_(PTHREAD_MUTEX_INITIALIZER) {}
+
+ImageSource::~ImageSource() {
+  pthread_mutex_destroy(&subscribers_lock_);
+}
+
+void ImageSource::AddSubscriber(Subscriber* subscriber) {
+  Autolock l(subscribers_lock_);
+  subscribers_.push_back(subscriber);
+}
+
+void ImageSource::RemoveSubscriber(Subscriber* subscriber) {
+  Autolock l(subscribers_lock_);
+  subscribers_.erase(
+      std::remove(subscribers_.begin(), subscribers_.end(), subscriber),
+      subscribers_.end());
+}
+
+bool ImageSource::HasSubscribers() {
+  Autolock l(subscribers_lock_);
+  return !subscribers_.empty();
+}
+
+void ImageSource::PublishImage(const RgbaImage& image) {
+  // Holding the lock during calls lets RemoveSubscriber() guarantee
+  // that the subscriber is no longer used.
+  Autolock l(subscribers_lock_);
+  for (Subscriber* subscriber : subscribers_)
+    subscriber->OnImage(image);
+}
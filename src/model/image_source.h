@@ -3,22 +3,47 @@
 #ifndef MODEL_IMAGE_SOURCE_H_
 #define MODEL_IMAGE_SOURCE_H_
 
+#include <pthread.h>
+
 #include <memory>
+#include <vector>
 
 #include "util/pixels.h"
 
 class ImageSource {
  public:
+  // Receives every new image on the thread that produced it, so
+  // implementations should only hand the image off to another thread.
+  // The image shares pixels with the source and other subscribers,
+  // which are never modified after the image is published.
+  class Subscriber {
+   public:
+    virtual ~Subscriber() = default;
+    virtual void OnImage(const RgbaImage& image) = 0;
+  };
+
   ImageSource(int width, int height, int fps);
-  virtual ~ImageSource() = default;
+  virtual ~ImageSource();
 
   virtual std::unique_ptr<RgbaImage> GetImage(int frame_id) = 0;
 
+  // |subscriber| is not owned. No calls are made to it after
+  // RemoveSubscriber() returns. Neither method can be called from
+  // OnImage().
+  void AddSubscriber(Subscriber* subscriber);
+  void RemoveSubscriber(Subscriber* subscriber);
+
  protected:
   int width() const { return width_; }
   int height() const { return height_; }
   int fps() const { return fps_; }
 
+  bool HasSubscribers();
+
+  // Hands |image| to all subscribers. Call without holding locks that
+  // subscribers may need.
+  void PublishImage(const RgbaImage& image);
+
  private:
   ImageSource(const ImageSource& src);
   ImageSource& operator=(const ImageSource& rhs);
@@ -26,6 +51,8 @@ class ImageSource {
   const int width_;
   const int height_;
   const int fps_;
+  pthread_mutex_t subscribers_lock_;
+  std::vector<Subscriber*> subscribers_;
 };
 
 #endif  // MODEL_IMAGE_SOURCE_H_
@@ -0,0 +1,439 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/pcm_source.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "util/input_alsa.h"
+#include "util/logging.h"
+#include "util/time.h"
+
+namespace {
+
+typedef std::map<std::string, std::string> ParamMap;
+
+double GetParam(
+    const ParamMap& params, const std::string& name, double default_value) {
+  ParamMap::const_iterator it = params.find(name);
+  return (it != params.end() ? atof(it->second.c_str()) : default_value);
+}
+
+class AlsaPcmSource : public PcmSource {
+ public:
+  AlsaPcmSource(const std::string& device, int rate,
+                int period_us, int period_count, bool use_mmap)
+      : device_(device), rate_(rate), period_us_(period_us),
+        period_count_(period_count), use_mmap_(use_mmap) {}
+  ~AlsaPcmSource() override { Close(); }
+
+  bool Open() override {
+    handle_ = inp_alsa_init(
+        device_.c_str(), rate_, period_us_, period_count_, use_mmap_);
+    return (handle_ != nullptr);
+  }
+
+  void Close() override {
+    if (handle_)
+      inp_alsa_cleanup(handle_);
+    handle_ = nullptr;
+  }
+
+  int period_size() const override {
+    return inp_alsa_get_period_size(handle_);
+  }
+
+  int Wait(int timeout_ms, int* overrun_count) override {
+    return inp_alsa_wait(handle_, timeout_ms, overrun_count);
+  }
+
+  int GetDelay() override {
+    return inp_alsa_get_delay(handle_);
+  }
+
+  int Read(int16_t* frames, int max_count, int* overrun_count) override {
+    return inp_alsa_read(handle_, frames, max_count, overrun_count);
+  }
+
+ private:
+  const std::string device_;
+  const int rate_;
+  const int period_us_;
+  const int period_count_;
+  const bool use_mmap_;
+  AlsaInputHandle* handle_ = nullptr;
+};
+
+// Produces frames on a clock, like a sound card would. Frames are
+// a function of their position in the stream, which makes the output
+// deterministic, and allows to skip frames on overruns.
+class PacedPcmSource : public PcmSource {
+ public:
+  PacedPcmSource(int rate, int period_us, int period_count, double speed)
+      : rate_(rate),
+        period_size_(std::max(1, (int) ((int64_t) rate * period_us / 1000000))),
+        // Accelerated sources buffer the same duration of real time.
+        buffer_size_(period_size_ * period_count * std::max(1.0, speed)),
+        speed_(speed) {}
+
+  bool Open() override {
+    start_time_us_ = GetCurrentMicros();
+    position_ = 0;
+    return true;
+  }
+
+  void Close() override {}
+
+  int period_size() const override { return period_size_; }
+
+  int Wait(int timeout_ms, int* overrun_count) override {
+    *overrun_count = 0;
+    if (GetDelay() >= period_size_)
+      return 1;
+    uint64_t ready_time_us = GetFrameTimeUs(position_ + period_size_);
+    uint64_t timeout_time_us = GetCurrentMicros() + timeout_ms * 1000;
+    SleepUntilMicros(std::min(ready_time_us, timeout_time_us));
+    return (ready_time_us <= timeout_time_us ? 1 : 0);
+  }
+
+  int GetDelay() override {
+    if (speed_ <= 0)
+      return buffer_size_;
+    uint64_t elapsed_us = GetCurrentMicros() - start_time_us_;
+    uint64_t end = (uint64_t) (elapsed_us * speed_ * rate_ / 1000000);
+    return (int) std::min<uint64_t>(end - position_, INT32_MAX);
+  }
+
+  int Read(int16_t* frames, int max_count, int* overrun_count) override {
+    *overrun_count = 0;
+    int available = GetDelay();
+    if (available > buffer_size_) {
+      // The reader fell behind, drop frames that would not fit.
+      *overrun_count = 1;
+      position_ += available - buffer_size_;
+      available = buffer_size_;
+    }
+    int count = std::min(available, max_count);
+    Generate(position_, frames, count);
+    position_ += count;
+    return count;
+  }
+
+ protected:
+  // Produces |count| frames starting at |position|.
+  virtual void Generate(uint64_t position, int16_t* frames, int count) = 0;
+
+  const int rate_;
+
+ private:
+  uint64_t GetFrameTimeUs(uint64_t position) const {
+    if (speed_ <= 0)
+      return 0;
+    return start_time_us_ + (uint64_t) (position * 1000000 / (speed_ * rate_));
+  }
+
+  const int period_size_;
+  const int buffer_size_;
+  const double speed_;
+  uint64_t start_time_us_ = 0;
+  uint64_t position_ = 0;
+};
+
+enum Waveform {
+  WAVEFORM_SILENCE,
+  WAVEFORM_SINE,
+  WAVEFORM_SWEEP,
+  WAVEFORM_NOISE,
+  WAVEFORM_CLICKS,
+};
+
+// Kick-like click, a decaying bass tone with a short noise burst,
+// so that both beat and onset detection respond to it.
+const double kClickDurationSec = 0.15;
+const double kClickToneHz = 60;
+const double kClickDecayPerSec = 30;
+const double kClickNoiseSec = 0.005;
+
+// Returns true if the sweep and click periods span at least one frame,
+// and the sweep frequencies are positive. Values that fail
+// the comparisons include NaN.
+bool ValidateGeneratorParams(const ParamMap& params, int rate) {
+  static const double kMaxPeriodFrames = 1e15;
+  double sweep_frames = GetParam(params, "sec", 10) * rate;
+  double bpm = GetParam(params, "bpm", 120);
+  double click_frames = (bpm > 0 ? 60.0 / bpm * rate : 0);
+  const char* invalid_name = nullptr;
+  if (!(sweep_frames >= 1 && sweep_frames < kMaxPeriodFrames)) {
+    invalid_name = "sec";
+  } else if (!(click_frames >= 1 && click_frames < kMaxPeriodFrames)) {
+    invalid_name = "bpm";
+  } else if (!(GetParam(params, "from", 20) > 0)) {
+    invalid_name = "from";
+  } else if (!(GetParam(params, "to", 20000) > 0)) {
+    invalid_name = "to";
+  }
+  if (invalid_name) {
+    fprintf(stderr, "Invalid generator parameter '%s'\n", invalid_name);
+    return false;
+  }
+  return true;
+}
+
+class GeneratorPcmSource : public PacedPcmSource {
+ public:
+  GeneratorPcmSource(Waveform waveform, const ParamMap& params, int rate,
+                     int period_us, int period_count, double speed)
+      : PacedPcmSource(rate, period_us, period_count, speed),
+        waveform_(waveform),
+        level_(GetParam(params, "level", 0.5) * 32767),
+        freq_(GetParam(params, "freq", 440)),
+        sweep_from_(GetParam(params, "from", 20)),
+        sweep_to_(GetParam(params, "to", 20000)),
+        sweep_sec_(GetParam(params, "sec", 10)),
+        click_period_sec_(60.0 / GetParam(params, "bpm", 120)) {}
+
+ protected:
+  void Generate(uint64_t position, int16_t* frames, int count) override {
+    for (int i = 0; i < count; ++i) {
+      double value = GetSample(position + i);
+      int16_t sample = (int16_t) std::max(-32768.0, std::min(32767.0, value));
+      frames[i * 2] = sample;
+      frames[i * 2 + 1] = sample;
+    }
+  }
+
+ private:
+  double GetSample(uint64_t position) const {
+    switch (waveform_) {
+      case WAVEFORM_SILENCE:
+        return 0;
+      case WAVEFORM_SINE: {
+        double cycles = fmod((double) position * freq_ / rate_, 1.0);
+        return level_ * sin(2 * M_PI * cycles);
+      }
+      case WAVEFORM_SWEEP: {
+        // Exponential sweep, restarted every |sweep_sec_|.
+        uint64_t sweep_frames = (uint64_t) (sweep_sec_ * rate_);
+        double t = (double) (position % sweep_frames) / rate_;
+        double k = log(sweep_to_ / sweep_from_);
+        double cycles = sweep_from_ * sweep_sec_ / k *
+            (exp(t / sweep_sec_ * k) - 1);
+        return level_ * sin(2 * M_PI * fmod(cycles, 1.0));
+      }
+      case WAVEFORM_NOISE:
+        return level_ * GetNoise(position);
+      case WAVEFORM_CLICKS: {
+        uint64_t period_frames = (uint64_t) (click_period_sec_ * rate_);
+        double t = (double) (position % period_frames) / rate_;
+        if (t >= kClickDurationSec)
+          return 0;
+        double value = sin(2 * M_PI * kClickToneHz * t);
+        if (t < kClickNoiseSec)
+          value += GetNoise(position);
+        return level_ * exp(-t * kClickDecayPerSec) * value;
+      }
+    }
+    return 0;
+  }
+
+  // Returns uniform noise in [-1, 1) range, as a hash of |position|.
+  static double GetNoise(uint64_t position) {
+    uint64_t x = position * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    return (double) (x >> 11) / (1ULL << 52) - 1.0;
+  }
+
+  const Waveform waveform_;
+  const double level_;
+  const double freq_;
+  const double sweep_from_;
+  const double sweep_to_;
+  const double sweep_sec_;
+  const double click_period_sec_;
+};
+
+class FilePcmSource : public PacedPcmSource {
+ public:
+  FilePcmSource(const std::string& path, int rate,
+                int period_us, int period_count, double speed)
+      : PacedPcmSource(rate, period_us, period_count, speed), path_(path) {}
+
+  bool Open() override {
+    if (frames_.empty() && !Load())
+      return false;
+    return PacedPcmSource::Open();
+  }
+
+ protected:
+  void Generate(uint64_t position, int16_t* frames, int count) override {
+    uint64_t frame_count = frames_.size() / 2;
+    for (int i = 0; i < count; ++i) {
+      uint64_t src = (position + i) % frame_count;
+      frames[i * 2] = frames_[src * 2];
+      frames[i * 2 + 1] = frames_[src * 2 + 1];
+    }
+  }
+
+ private:
+  bool Load();
+  bool ParseWav(const std::vector<uint8_t>& data);
+
+  const std::string path_;
+  // Interleaved stereo frames of the whole file.
+  std::vector<int16_t> frames_;
+};
+
+uint32_t ReadLe32(const uint8_t* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+}
+
+uint16_t ReadLe16(const uint8_t* data) {
+  return data[0] | (data[1] << 8);
+}
+
+bool FilePcmSource::Load() {
+  FILE* file = fopen(path_.c_str(), "rb");
+  if (!file) {
+    fprintf(stderr, "Unable to open audio file '%s'\n", path_.c_str());
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buf[64 * 1024];
+  size_t size;
+  while ((size = fread(buf, 1, sizeof(buf), file)) > 0)
+    data.insert(data.end(), buf, buf + size);
+  fclose(file);
+
+  if (data.size() >= 12 && !memcmp(&data[0], "RIFF", 4) &&
+      !memcmp(&data[8], "WAVE", 4)) {
+    if (!ParseWav(data))
+      return false;
+  } else {
+    // Raw files are expected to match the capture format.
+    frames_.resize(data.size() / 4 * 2);
+    for (size_t i = 0; i < frames_.size(); ++i)
+      frames_[i] = (int16_t) ReadLe16(&data[i * 2]);
+  }
+
+  if (frames_.empty()) {
+    fprintf(stderr, "No audio in '%s'\n", path_.c_str());
+    return false;
+  }
+  fprintf(stderr, "Loaded %d frames from '%s'\n",
+          (int) (frames_.size() / 2), path_.c_str());
+  return true;
+}
+
+bool FilePcmSource::ParseWav(const std::vector<uint8_t>& data) {
+  int channels = 0;
+  int bits = 0;
+  size_t pos = 12;
+  while (pos + 8 <= data.size()) {
+    const uint8_t* chunk = &data[pos];
+    size_t size = std::min<size_t>(ReadLe32(chunk + 4), data.size() - pos - 8);
+    if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+      int format = ReadLe16(chunk + 8);
+      channels = ReadLe16(chunk + 10);
+      int rate = ReadLe32(chunk + 12);
+      bits = ReadLe16(chunk + 22);
+      // Extensible format is accepted for its PCM sub-format.
+      if ((format != 1 && format != 0xFFFE) || bits != 16 ||
+          channels < 1 || channels > 2) {
+        fprintf(stderr, "Only 16-bit mono or stereo PCM is supported in '%s'\n",
+                path_.c_str());
+        return false;
+      }
+      if (rate != rate_) {
+        fprintf(stderr, "Playing '%s' at %d Hz instead of %d Hz\n",
+                path_.c_str(), rate_, rate);
+      }
+    } else if (!memcmp(chunk, "data", 4)) {
+      if (!channels) {
+        fprintf(stderr, "No format chunk before data in '%s'\n",
+                path_.c_str());
+        return false;
+      }
+      const uint8_t* samples = chunk + 8;
+      size_t frame_count = size / (2 * channels);
+      frames_.resize(frame_count * 2);
+      for (size_t i = 0; i < frame_count; ++i) {
+        int16_t left = (int16_t) ReadLe16(samples + i * 2 * channels);
+        int16_t right = (channels == 2 ?
+            (int16_t) ReadLe16(samples + i * 4 + 2) : left);
+        frames_[i * 2] = left;
+        frames_[i * 2 + 1] = right;
+      }
+      return true;
+    }
+    // Chunks are padded to even sizes.
+    pos += 8 + size + (size & 1);
+  }
+  fprintf(stderr, "No data chunk in '%s'\n", path_.c_str());
+  return false;
+}
+
+// Splits "NAME,key=value,..." into name and parameters.
+std::string ParseParams(const std::string& spec, ParamMap* params) {
+  size_t pos = spec.find(',');
+  std::string name = spec.substr(0, pos);
+  while (pos != std::string::npos) {
+    size_t next = spec.find(',', pos + 1);
+    std::string param = spec.substr(pos + 1, next - pos - 1);
+    size_t eq = param.find('=');
+    (*params)[param.substr(0, eq)] =
+        (eq != std::string::npos ? param.substr(eq + 1) : "");
+    pos = next;
+  }
+  return name;
+}
+
+}  // namespace
+
+// static
+PcmSource* PcmSource::Create(
+    const std::string& spec, int rate,
+    int period_us, int period_count, bool use_mmap) {
+  static const char kGeneratorPrefix[] = "gen:";
+  static const char kFilePrefix[] = "file:";
+  ParamMap params;
+  if (spec.compare(0, strlen(kGeneratorPrefix), kGeneratorPrefix) == 0) {
+    std::string type = ParseParams(
+        spec.substr(strlen(kGeneratorPrefix)), &params);
+    double speed = GetParam(params, "speed", 1);
+    Waveform waveform;
+    if (type == "silence") {
+      waveform = WAVEFORM_SILENCE;
+    } else if (type == "sine") {
+      waveform = WAVEFORM_SINE;
+    } else if (type == "sweep") {
+      waveform = WAVEFORM_SWEEP;
+    } else if (type == "noise") {
+      waveform = WAVEFORM_NOISE;
+    } else if (type == "clicks") {
+      waveform = WAVEFORM_CLICKS;
+    } else {
+      fprintf(stderr, "Unknown generator '%s'\n", type.c_str());
+      return nullptr;
+    }
+    if (!ValidateGeneratorParams(params, rate))
+      return nullptr;
+    return new GeneratorPcmSource(
+        waveform, params, rate, period_us, period_count, speed);
+  }
+  if (spec.compare(0, strlen(kFilePrefix), kFilePrefix) == 0) {
+    std::string path = ParseParams(spec.substr(strlen(kFilePrefix)), &params);
+    double speed = GetParam(params, "speed", 1);
+    return new FilePcmSource(path, rate, period_us, period_count, speed);
+  }
+  if (spec.empty())
+    return nullptr;
+  return new AlsaPcmSource(spec, rate, period_us, period_count, use_mmap);
+}
@@ -0,0 +1,56 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_PCM_SOURCE_H_
+#define MODEL_PCM_SOURCE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+// Source of interleaved S16 stereo frames, delivered in periods.
+// Besides live ALSA input, frames can be synthesized or read from
+// files, so that audio processing can be reproduced without a sound
+// card. Used by a single capture thread.
+class PcmSource {
+ public:
+  // Creates a source from |spec|, or returns nullptr if it is invalid:
+  //   gen:TYPE[,key=value...] - signal generator, where TYPE is one of
+  //       silence, sine (freq=440), sweep (from=20, to=20000, sec=10),
+  //       noise, or clicks (bpm=120). All accept level=0.5 and speed=1.
+  //   file:PATH[,speed=1] - WAV or raw S16 stereo file, played in a loop.
+  //   anything else - ALSA device name, such as "hw:1,0".
+  // With speed of 2, frames are produced twice faster than in real time.
+  // With speed of 0, frames are produced as fast as they are read.
+  static PcmSource* Create(
+      const std::string& spec, int rate,
+      int period_us, int period_count, bool use_mmap);
+
+  virtual ~PcmSource() = default;
+
+  // Returns false on errors.
+  virtual bool Open() = 0;
+  virtual void Close() = 0;
+
+  // Returns the period size in frames.
+  virtual int period_size() const = 0;
+
+  // Waits until a period is available. Returns 1 when ready, 0 on
+  // timeout, or -1 on errors. Overruns are recovered from and counted.
+  virtual int Wait(int timeout_ms, int* overrun_count) = 0;
+
+  // Returns the number of available frames not yet read, or -1.
+  virtual int GetDelay() = 0;
+
+  // Reads up to |max_count| frames without blocking. Returns 0 if no
+  // frames are available, or -1 on errors.
+  virtual int Read(int16_t* frames, int max_count, int* overrun_count) = 0;
+
+ protected:
+  PcmSource() {}
+
+ private:
+  PcmSource(const PcmSource& src);
+  PcmSource& operator=(const PcmSource& rhs);
+};
+
+#endif  // MODEL_PCM_SOURCE_H_
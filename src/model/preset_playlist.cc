@@ -0,0 +1,76 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/preset_playlist.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "util/logging.h"
+
+namespace {
+
+// Bounds memory of long sessions.
+const size_t kMaxHistorySize = 100;
+
+}  // namespace
+
+PresetPlaylist::PresetPlaylist(int size, bool shuffle)
+    : size_(size), shuffle_(shuffle) {
+  CHECK(size > 0);
+}
+
+int PresetPlaylist::GetUpcoming(int position) {
+  while (static_cast<int>(upcoming_.size()) <= position)
+    AddUpcoming();
+  return upcoming_[position];
+}
+
+void PresetPlaylist::AddUpcoming() {
+  int last = (upcoming_.empty() ? current_ : upcoming_.back());
+  if (!shuffle_ || size_ == 1) {
+    upcoming_.push_back((last + 1) % size_);
+    return;
+  }
+
+  // Appends a whole round of presets, none of which repeats the last.
+  std::vector<int> round;
+  for (int i = 0; i < size_; ++i)
+    round.push_back(i);
+  for (int i = size_ - 1; i > 0; --i)
+    std::swap(round[i], round[rand() % (i + 1)]);
+  if (round[0] == last)
+    std::swap(round[0], round[size_ - 1]);
+  upcoming_.insert(upcoming_.end(), round.begin(), round.end());
+}
+
+void PresetPlaylist::GoBack() {
+  // Repeated calls go further back from the pending preset.
+  int from = current_;
+  if (is_going_back_) {
+    from = upcoming_.front();
+    upcoming_.pop_front();
+  }
+  int previous;
+  if (!history_.empty()) {
+    previous = history_.back();
+    history_.pop_back();
+  } else {
+    previous = (from > 0 ? from - 1 : size_ - 1);
+  }
+  upcoming_.push_front(from);
+  upcoming_.push_front(previous);
+  is_going_back_ = true;
+}
+
+void PresetPlaylist::Advance() {
+  int next = GetUpcoming(0);
+  upcoming_.pop_front();
+  if (!is_going_back_) {
+    history_.push_back(current_);
+    if (history_.size() > kMaxHistorySize)
+      history_.erase(history_.begin());
+  }
+  is_going_back_ = false;
+  current_ = next;
+}
@@ -0,0 +1,44 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_PRESET_PLAYLIST_H_
+#define MODEL_PRESET_PLAYLIST_H_
+
+#include <deque>
+#include <vector>
+
+// Decides the order of presets in advance, so that upcoming presets
+// can be loaded before they are needed. Presets are played in order,
+// or shuffled without repeats until all of them were played.
+// Not thread-safe.
+class PresetPlaylist {
+ public:
+  PresetPlaylist(int size, bool shuffle);
+
+  int current() const { return current_; }
+
+  // Returns the preset that will be played after |position| others.
+  int GetUpcoming(int position);
+
+  // Makes the preset played before the current one upcoming, followed
+  // by the current one.
+  void GoBack();
+
+  // Makes the first upcoming preset current.
+  void Advance();
+
+ private:
+  PresetPlaylist(const PresetPlaylist& src);
+  PresetPlaylist& operator=(const PresetPlaylist& rhs);
+
+  void AddUpcoming();
+
+  const int size_;
+  const bool shuffle_;
+  int current_ = 0;
+  std::deque<int> upcoming_;
+  std::vector<int> history_;
+  // Set by GoBack(), so that Advance() does not record history.
+  bool is_going_back_ = false;
+};
+
+#endif  // MODEL_PRESET_PLAYLIST_H_
@@ -3,20 +3,30 @@
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
+// Buffer and sync object functions are declared by glext.h.
+#define GL_GLEXT_PROTOTYPES
+
 #include "model/projectm_source.h"
 
 #include <GL/gl.h>
 #include <GL/glext.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
+#include "util/frame_trace.h"
 #include "util/lock.h"
 #include "util/logging.h"
+#include "util/pcm.h"
 #include "util/time.h"
 #include "../projectm/src/libprojectM/projectM.hpp"
 
 namespace {
 
-const int kProjectmFps = 30;
+// Bounds the render rate, which follows the rate of consumers.
+const int kMaxRenderFps = 30;
 
 // MilkDrop and ProjectM expect 44.1kHz sampling rate. We will discard
 // all samples that fall out of MilkDrop's sample window of 512. We request
@@ -24,42 +34,23 @@ const int kProjectmFps = 30;
 const int kPcmSampleRate = 44100;
 const int kPcmMaxSamples = 512;
 
-void AdjustVolume(
-    float* pcm_buffer, int sample_count, float volume_multiplier) {
-  if (volume_multiplier == 1.0)
-    return;
-  for (int i = 0; i < sample_count; i++) {
-    float s_l = pcm_buffer[i * 2] * volume_multiplier;
-    float s_r = pcm_buffer[i * 2 + 1] * volume_multiplier;
-    if (s_l > 1.0) {
-      s_l = 1.0;
-    } else if (s_l < -1.0) {
-      s_l = -1.0;
-    }
-    if (s_r > 1.0) {
-      s_r = 1.0;
-    } else if (s_r < -1.0) {
-      s_r = -1.0;
-    }
-    pcm_buffer[i * 2] = s_l;
-    pcm_buffer[i * 2 + 1] = s_r;
-  }
-}
+// Readback is normally complete after the next frame is rendered,
+// this only guards against a stuck GPU.
+const GLuint64 kReadbackTimeoutNs = 100 * 1000000ULL;
 
-float CalcVolumeRms(float* pcm_buffer, int sample_count) {
-  if (sample_count == 0)
-    return 0;
-  float sum_l = 0;
-  float sum_r = 0;
-  for (int i = 0; i < sample_count; i++) {
-    float s_l = pcm_buffer[i * 2];
-    float s_r = pcm_buffer[i * 2 + 1];
-    sum_l += s_l * s_l;
-    sum_r += s_r * s_r;
-  }
-  sum_l = sqrt(sum_l / sample_count);
-  sum_r = sqrt(sum_r / sample_count);
-  return (sum_l + sum_r) / 2.0;
+// Presets are switched by ProjectmSource, so that they can be loaded
+// in advance. This only keeps projectM from switching on its own.
+const int kProjectmPresetDurationSec = 24 * 3600;
+
+// Sigma of the normally distributed preset duration, same as
+// projectM used with easterEgg of 1.
+const double kPresetDurationSigmaMs = 1000;
+
+// Returns a normally distributed value, using the Box-Muller transform.
+double GetGaussian(double mean, double sigma) {
+  double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return mean + sigma * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
 }
 
 }  // namespace
@@ -67,20 +58,22 @@ float CalcVolumeRms(float* pcm_buffer, int sample_count) {
 ProjectmSource::ProjectmSource(
     int width, int height, int tex_size, int fps,
     const std::string& preset_dir, const std::string& textures_dir,
-    int preset_duration)
+    int preset_duration, RenderBackend render_backend)
     : ImageSource(width, height, fps), lock_(PTHREAD_MUTEX_INITIALIZER),
+      governor_(std::min(fps, kMaxRenderFps), fps),
       tex_size_(tex_size), preset_dir_(preset_dir), textures_dir_(textures_dir),
-      preset_duration_(preset_duration) {
-  last_render_time_ = GetCurrentMillis();
-  ms_per_frame_ = static_cast<uint32_t>(1000.0 / kProjectmFps);
-
-  image_buffer_size_ = RGBA_LEN(tex_size_, tex_size_);
-  image_buffer_ = new uint8_t[image_buffer_size_];
-  memset(image_buffer_, 0, image_buffer_size_);
+      preset_duration_(preset_duration), render_backend_(render_backend) {
+  last_image_.ResizeStorage(tex_size_, tex_size_);
 
   for (int i = 0; i < 6; ++i) {
     last_bass_info_.push_back(0);
   }
+
+  int err = pthread_cond_init(&loader_cond_, nullptr);
+  if (err != 0) {
+    fprintf(stderr, "pthread_cond_init failed with %d\n", err);
+    CHECK(false);
+  }
 }
 
 ProjectmSource::~ProjectmSource() {
@@ -95,15 +88,8 @@ ProjectmSource::~ProjectmSource() {
 
   CloseInputLocked();
 
-  while (!work_items_.empty()) {
-    WorkItem* item = work_items_.front();
-    work_items_.pop_front();
-    delete item;
-  }
-
+  pthread_cond_destroy(&loader_cond_);
   pthread_mutex_destroy(&lock_);
-
-  delete[] image_buffer_;
 }
 
 std::unique_ptr<RgbaImage> ProjectmSource::GetImage(int frame_id) {
@@ -111,8 +97,8 @@ std::unique_ptr<RgbaImage> ProjectmSource::GetImage(int frame_id) {
   (void) frame_id;
 
   Autolock l(lock_);
-  return std::unique_ptr<RgbaImage>(
-      new RgbaImage(image_buffer_, tex_size_, tex_size_));
+  governor_.AddPull(GetCurrentMillis());
+  return std::unique_ptr<RgbaImage>(new RgbaImage(last_image_));
 }
 
 std::vector<int> ProjectmSource::GetAndClearFramePeriods() {
@@ -129,6 +115,30 @@ bool ProjectmSource::GetAndClearHasNewImage() {
   return result;
 }
 
+void ProjectmSource::DurationStats::Add(int value) {
+  ++count;
+  sum += value;
+  max = std::max(max, value);
+}
+
+void ProjectmSource::DurationStats::GetAndClear(std::vector<int>* dst) {
+  dst->push_back(count);
+  dst->push_back(count ? sum / count : 0);
+  dst->push_back(max);
+  *this = DurationStats();
+}
+
+std::vector<int> ProjectmSource::GetAndClearPresetSwitchStats() {
+  Autolock l(lock_);
+  std::vector<int> result;
+  switch_periods_.GetAndClear(&result);
+  swap_durations_.GetAndClear(&result);
+  load_durations_.GetAndClear(&result);
+  result.push_back(late_switch_count_);
+  late_switch_count_ = 0;
+  return result;
+}
+
 std::string ProjectmSource::GetCurrentPresetName() {
   Autolock l(lock_);
   return current_preset_;
@@ -152,18 +162,16 @@ std::vector<std::string> ProjectmSource::GetPresetNames() {
 
 void ProjectmSource::SelectNextPreset() {
   Autolock l(lock_);
-  ScheduleWorkItemLocked(new NextPresetWorkItem(true));
+  is_switch_requested_ = true;
 }
 
 void ProjectmSource::SelectPreviousPreset() {
   Autolock l(lock_);
-  ScheduleWorkItemLocked(new NextPresetWorkItem(false));
-}
-
-void ProjectmSource::ScheduleWorkItemLocked(WorkItem* item) {
-  if (is_shutting_down_)
+  if (!playlist_)
     return;
-  work_items_.push_back(item);
+  playlist_->GoBack();
+  is_switch_requested_ = true;
+  pthread_cond_signal(&loader_cond_);
 }
 
 void ProjectmSource::SetVolumeMultiplier(double value) {
@@ -181,24 +189,45 @@ std::vector<double> ProjectmSource::GetLastBassInfo() {
   return last_bass_info_;
 }
 
+void ProjectmSource::GetAudioFeatures(AudioFeatures* dst) const {
+  audio_features_.Read(dst);
+}
+
 void ProjectmSource::UseAlsa(const std::string& spec) {
   Autolock l(lock_);
   CloseInputLocked();
-  alsa_device_ = spec;
+  audio_input_ = spec;
+  if (audio_input_.empty())
+    return;
+  audio_capture_.reset(
+      new AudioCapture(audio_input_, kPcmSampleRate, capture_options_,
+                       &audio_features_));
+  audio_capture_->Start();
+}
+
+void ProjectmSource::SetAudioCaptureOptions(
+    int period_us, int period_count, bool use_mmap) {
+  Autolock l(lock_);
+  capture_options_.period_us = period_us;
+  capture_options_.period_count = period_count;
+  capture_options_.use_mmap = use_mmap;
 }
 
 void ProjectmSource::CloseInputLocked() {
-  if (alsa_handle_) {
-    inp_alsa_cleanup(alsa_handle_);
-    alsa_handle_ = NULL;
-  }
+  // The capture thread does not use lock_, and is joined here.
+  audio_capture_.reset();
+  pcm_read_pos_ = 0;
 }
 
 int ProjectmSource::GetAndClearOverrunCount() {
   Autolock l(lock_);
-  int result = total_overrun_count_;
-  total_overrun_count_ = 0;
-  return result;
+  return (audio_capture_ ? audio_capture_->GetAndClearOverrunCount() : 0);
+}
+
+std::vector<int> ProjectmSource::GetAndClearAudioLatencyStats() {
+  Autolock l(lock_);
+  return (audio_capture_ ? audio_capture_->GetAndClearLatencyStats()
+          : std::vector<int>());
 }
 
 /*static std::string GetPcmDump(float* pcm_buffer, int sample_count) {
@@ -212,209 +241,285 @@ int ProjectmSource::GetAndClearOverrunCount() {
 }*/
 
 bool ProjectmSource::TransferPcmDataLocked() {
-  if (alsa_device_.empty()) {
-    //fprintf(stderr, "ALSA input is disabled\n");
+  if (audio_input_.empty()) {
+    //fprintf(stderr, "Audio input is disabled\n");
     return false;
   }
 
-  int sample_count;
-  float pcm_buffer[kPcmMaxSamples * 2];
-  if (alsa_device_ == "_fake_") {
-    sample_count = kPcmMaxSamples;
-    for (int i = 0; i < sample_count; ++i) {
-      // TODO(igorc): Generate some sine wave.
-      pcm_buffer[i * 2] = 0;
-      pcm_buffer[i * 2 + 1] = pcm_buffer[i * 2];
-    }
-  } else {
-    sample_count = ReadFromAlsa(pcm_buffer);
-  }
-
-  AdjustVolume(pcm_buffer, sample_count, volume_multiplier_);
+  int16_t read_buf[kPcmMaxSamples * 2];
+  int sample_count = ReadCapturedPcm(read_buf);
 
-  last_volume_rms_ = CalcVolumeRms(pcm_buffer, sample_count);
+  float pcm_buffer[kPcmMaxSamples * 2];
+  PcmLevels levels;
+  ConvertPcmS16ToFloat(
+      read_buf, sample_count, volume_multiplier_, pcm_buffer, &levels);
+  last_volume_rms_ = levels.rms;
 
-  //fprintf(stderr, "Adding %d samples, discarded=%d, overrun=%d, RMS=%.3f\n",
-  //    sample_count, discard_count, total_overrun_count_, last_volume_rms_);
-  //fprintf(stderr, "Adding %d samples, discarded=%d, overrun=%d, data=%s\n",
-  //        sample_count, discard_count, total_overrun_count_,
-  //        GetPcmDump(pcm_buffer, sample_count).c_str());
+  //fprintf(stderr, "Adding %d samples, RMS=%.3f\n",
+  //    sample_count, last_volume_rms_);
+  //fprintf(stderr, "Adding %d samples, data=%s\n",
+  //        sample_count, GetPcmDump(pcm_buffer, sample_count).c_str());
 
-  bool has_real_data = false;
-  for (int i = 0; i < sample_count * 2; i++) {
-    if (fabsf(pcm_buffer[i]) > 0.001) {
-      has_real_data = true;
-      break;
-    }
-  }
+  bool has_real_data = (levels.peak > 0.001);
   if (!sample_count) {
-    //fprintf(stderr, "ALSA produced no samples, discarded=%d, overrun=%d\n",
-    //        discard_count, total_overrun_count_);
+    //fprintf(stderr, "Audio input produced no samples\n");
   } else if (!has_real_data) {
-    //fprintf(stderr, "ALSA produced %d samples with empy data\n", sample_count);
+    //fprintf(stderr, "Audio input produced %d samples with empy data\n",
+    //        sample_count);
   }
 
-  PCM* pcm = projectm_->pcm();
-  pcm->setPCM(pcm_buffer, sample_count);
+  // Instances that are ready to be switched to get the same audio, so
+  // that their BeatDetect starts from the current PCM window. Loading
+  // instances get it from |last_pcm_| before their warm-up frame.
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    Instance* instance = instances_[i].get();
+    if (instance == active_ || instance->state == INSTANCE_READY)
+      instance->projectm->pcm()->setPCM(pcm_buffer, sample_count);
+  }
+  last_pcm_.assign(pcm_buffer, pcm_buffer + sample_count * 2);
 
   return true;
 }
 
-int ProjectmSource::ReadFromAlsa(float* pcm_buffer) {
-  if (!alsa_handle_) {
-    fprintf(stderr, "Connecting to ALSA input %s\n", alsa_device_.c_str());
-    alsa_handle_ = inp_alsa_init(alsa_device_.c_str(), kPcmSampleRate);
-    if (!alsa_handle_) {
-      fprintf(stderr, "Failed to open ALSA input\n");
-      return false;
-    }
-  }
-
-  int sample_count = 0;
-  while (sample_count < kPcmMaxSamples) {
-    int16_t read_buf[kPcmMaxSamples * 2];
-    int overrun_count = 0;
-    int samples = inp_alsa_read(
-        alsa_handle_, read_buf, kPcmMaxSamples - sample_count, &overrun_count);
-    total_overrun_count_ += overrun_count;
-    if (samples <= 0)
-      break;
-    for (int i = 0; i < samples; i++) {
-      float s_l = read_buf[i * 2];
-      float s_r = read_buf[i * 2 + 1];
-      pcm_buffer[sample_count * 2] = s_l / 32768.0;
-      pcm_buffer[sample_count * 2 + 1] = s_r / 32768.0;
-      sample_count++;
-    }
-  }
-
-  // Disacrd all remaining samples, so on next frame we can get fresh data.
-  int discard_count = 0;
-  while (true) {
-    int16_t discard_buf[kPcmMaxSamples * 2];
-    int overrun_count = 0;
-    int samples = inp_alsa_read(
-        alsa_handle_, discard_buf, kPcmMaxSamples, &overrun_count);
-    total_overrun_count_ += overrun_count;
-    if (samples <= 0)
-      break;
-    discard_count += samples;
-  }
-
-  return sample_count;
+// Takes the newest frames captured since the previous call. Older
+// frames that do not fit remain in the ring.
+int ProjectmSource::ReadCapturedPcm(int16_t* read_buf) {
+  if (!audio_capture_)
+    return 0;
+  return audio_capture_->ReadNewest(read_buf, kPcmMaxSamples, &pcm_read_pos_);
 }
 
-void ProjectmSource::CreateRenderContext() {
-  display_ = XOpenDisplay(NULL);
-  if (!display_) {
-    fprintf(stderr, "Unable to open display\n");
-    CHECK(false);
-  }
-
-  static int kVisualAttribs[] = {
-      GLX_RENDER_TYPE, GLX_RGBA_BIT,
-      GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
-      GLX_RED_SIZE, 8,
-      GLX_GREEN_SIZE, 8,
-      GLX_BLUE_SIZE, 8,
-      GLX_ALPHA_SIZE, 8,
-      GLX_DEPTH_SIZE, 8,
-      None
-  };
-  int fb_config_count = 0;
-  GLXFBConfig* fb_configs = glXChooseFBConfig(
-      display_, DefaultScreen(display_), kVisualAttribs, &fb_config_count);
-  if (!fb_configs || fb_config_count == 0) {
-    fprintf(stderr, "Unable to find FB config\n");
-    CHECK(false);
-  }
-
-  /*static int kContextAttribs[] = {
-      GLX_CONTEXT_MAJOR_VERSION_ARB,  4,
-      GLX_CONTEXT_MINOR_VERSION_ARB,  2,
-      GLX_CONTEXT_FLAGS_ARB,          GLX_CONTEXT_DEBUG_BIT_ARB,
-      GLX_CONTEXT_PROFILE_MASK_ARB,   GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
-      None
-  };
-  gl_context_ = glXCreateContextAttribsARB(
-      display_, fb_configs[0], 0, true, kContextAttribs);*/
-  gl_context_ = glXCreateNewContext(
-      display_, fb_configs[0], GLX_RGBA_TYPE, NULL, true);
-  if (!gl_context_) {
-    fprintf(stderr, "Unable to create GL context\n");
-    CHECK(false);
+// Creates the instances one by one, leaving each of them current
+// while projectM is initialized.
+void ProjectmSource::CreateInstances() {
+  for (int i = 0; i <= kPreparedPresetCount; ++i) {
+    Instance* instance = CreateInstance();
+    instance->render_context->ReleaseCurrent();
+    instances_.push_back(std::unique_ptr<Instance>(instance));
   }
 
-  int pbuffer_attribs[] = {
-      GLX_PBUFFER_WIDTH,  tex_size_,
-      GLX_PBUFFER_HEIGHT, tex_size_,
-      None
-  };
-  pbuffer_ = glXCreatePbuffer(display_, fb_configs[0], pbuffer_attribs);
-  if (!pbuffer_) {
-    fprintf(stderr, "Unable to create Pbuffer\n");
-    CHECK(false);
+  {
+    Autolock l(lock_);
+    projectM* projectm = instances_[0]->projectm;
+    for (unsigned int i = 0; i < projectm->getPlaylistSize(); i++) {
+      all_presets_.push_back(projectm->getPresetName(i));
+    }
+    if (!all_presets_.empty()) {
+      playlist_.reset(new PresetPlaylist(
+          all_presets_.size(), preset_duration_ < 600));
+    }
+    active_ = instances_[0].get();
+    active_->state = INSTANCE_ACTIVE;
+    active_->preset_index = 0;
+    UpdateCurrentPresetLocked();
+    next_preset_time_ = GetCurrentMillis() + GetPresetDurationMs();
   }
 
-  XFree(fb_configs);
-  XSync(display_, false);
-
-  if (!glXMakeContextCurrent(display_, pbuffer_, pbuffer_, gl_context_)) {
-    fprintf(stderr, "Unable to set GL context and pbuffer as current\n");
-    CHECK(false);
-  }
+  active_->render_context->MakeCurrent();
+  active_->projectm->selectPreset(0);
 }
 
-void ProjectmSource::DestroyRenderContext() {
-  glXMakeContextCurrent(display_, None, None, NULL);
-  glXDestroyContext(display_, gl_context_);
-  glXDestroyPbuffer(display_, pbuffer_);
-  XCloseDisplay(display_);
+void ProjectmSource::DestroyInstances() {
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    Instance* instance = instances_[i].get();
+    instance->render_context->MakeCurrent();
+    DestroyReadbackBuffers(instance);
+    delete instance->projectm;
+    instance->render_context.reset();
+  }
+  instances_.clear();
+  active_ = nullptr;
 }
 
-void ProjectmSource::CreateProjectM() {
+ProjectmSource::Instance* ProjectmSource::CreateInstance() {
   //raise(SIGINT);
 
+  Instance* instance = new Instance();
+  instance->render_context.reset(
+      RenderContext::Create(render_backend_, tex_size_, tex_size_));
+
   // TODO(igorc): Consider disabling threads in CMakeCache.txt.
   //              Threads are used for evaluating the second preset.
   projectM::Settings settings;
   settings.windowWidth = tex_size_;
   settings.windowHeight = tex_size_ / (width() / height());
-  settings.fps = kProjectmFps;
+  // Frames are always rendered at this rate, see RenderGovernor.
+  settings.fps = governor_.render_fps();
   settings.textureSize = tex_size_;
   settings.meshX = 32;
   settings.meshY = 24;
   settings.presetURL = preset_dir_;
   settings.titleFontURL = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf";
   settings.menuFontURL = "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf";
+  // Effectively disables hard cuts on loud beats.
   settings.beatSensitivity = 10;
   settings.aspectCorrection = 1;
-  // Preset duration is based on gaussian distribution
-  // with mean of |presetDuration| and sigma of |easterEgg|.
-  settings.presetDuration = preset_duration_;
+  settings.presetDuration = kProjectmPresetDurationSec;
   settings.easterEgg = 1;
   // Transition period for switching between presets.
   // Shows white screen with some presets.
   settings.smoothPresetDuration = 0;
-  settings.shuffleEnabled = (preset_duration_ < 600 ? 1 : 0);
+  settings.shuffleEnabled = 0;
   settings.softCutRatingsEnabled = 0;
-  projectm_ = new projectM(
+  instance->projectm = new projectM(
       settings, "dfplayer/shaders", textures_dir_, projectM::FLAG_NONE);
 
-  projectm_tex_ = projectm_->initRenderToTexture();
-  if (projectm_tex_ == -1 || projectm_tex_ == 0) {
+  instance->texture = instance->projectm->initRenderToTexture();
+  if (instance->texture == -1 || instance->texture == 0) {
     fprintf(stderr, "Unable to init ProjectM texture rendering");
     CHECK(false);
   }
 
-  {
-    Autolock l(lock_);
-    for (unsigned int i = 0; i < projectm_->getPlaylistSize(); i++) {
-      all_presets_.push_back(projectm_->getPresetName(i));
+  CreateReadbackBuffers(instance);
+  return instance;
+}
+
+uint64_t ProjectmSource::GetPresetDurationMs() const {
+  double duration_ms = GetGaussian(
+      preset_duration_ * 1000.0, kPresetDurationSigmaMs);
+  return std::max(1000.0, duration_ms);
+}
+
+void ProjectmSource::UpdateCurrentPresetLocked() {
+  current_preset_index_ = active_->preset_index;
+  if (current_preset_index_ < all_presets_.size()) {
+    current_preset_ = all_presets_[current_preset_index_];
+  } else {
+    current_preset_index_ = -1;
+    current_preset_ = "";
+  }
+}
+
+ProjectmSource::Instance* ProjectmSource::TakeNextInstanceLocked() {
+  if (!playlist_)
+    return nullptr;
+  if (!is_switch_requested_ && GetCurrentMillis() < next_preset_time_)
+    return nullptr;
+
+  int preset_index = playlist_->GetUpcoming(0);
+  Instance* next = nullptr;
+  for (size_t i = 0; i < instances_.size(); ++i) {
+    Instance* instance = instances_[i].get();
+    if (instance->state == INSTANCE_READY &&
+        instance->preset_index == preset_index) {
+      next = instance;
+      break;
     }
   }
+  if (!next) {
+    // Keeps the current preset until the next one is loaded.
+    if (!is_switch_late_)
+      ++late_switch_count_;
+    is_switch_late_ = true;
+    return nullptr;
+  }
+
+  next->state = INSTANCE_ACTIVE;
+  playlist_->Advance();
+  is_switch_requested_ = false;
+  is_switch_late_ = false;
+  next_preset_time_ = GetCurrentMillis() + GetPresetDurationMs();
+  return next;
+}
+
+bool ProjectmSource::SwitchToInstance(Instance* next) {
+  uint64_t start_time = GetCurrentMicros();
+  // Publishes frames that are still being read back.
+  bool has_new_image = FinishReadbacks(active_, nullptr);
+  active_->render_context->ReleaseCurrent();
+  next->render_context->MakeCurrent();
+
+  Autolock l(lock_);
+  active_->state = INSTANCE_IDLE;
+  active_ = next;
+  UpdateCurrentPresetLocked();
+  swap_durations_.Add(GetCurrentMicros() - start_time);
+  // The previous instance can now load an upcoming preset.
+  pthread_cond_signal(&loader_cond_);
+  return has_new_image;
+}
+
+// Assigns upcoming presets to instances that are already loading them
+// or have them loaded, and returns the first instance that is free
+// to load one of the remaining presets.
+ProjectmSource::Instance* ProjectmSource::FindInstanceToLoadLocked(
+    int* preset_index) {
+  if (!playlist_)
+    return nullptr;
+  std::vector<bool> is_assigned(instances_.size());
+  for (int i = 0; i < kPreparedPresetCount; ++i) {
+    int upcoming = playlist_->GetUpcoming(i);
+    bool is_loaded = false;
+    for (size_t j = 0; j < instances_.size() && !is_loaded; ++j) {
+      const Instance* instance = instances_[j].get();
+      if (!is_assigned[j] && instance->preset_index == upcoming &&
+          (instance->state == INSTANCE_LOADING ||
+           instance->state == INSTANCE_READY)) {
+        is_assigned[j] = true;
+        is_loaded = true;
+      }
+    }
+    if (is_loaded)
+      continue;
+    for (size_t j = 0; j < instances_.size(); ++j) {
+      Instance* instance = instances_[j].get();
+      if (!is_assigned[j] && (instance->state == INSTANCE_IDLE ||
+                              instance->state == INSTANCE_READY)) {
+        *preset_index = upcoming;
+        return instance;
+      }
+    }
+    // Waits for an instance to become free.
+    return nullptr;
+  }
+  return nullptr;
+}
+
+// static
+void* ProjectmSource::LoaderThreadEntry(void* arg) {
+  ProjectmSource* self = reinterpret_cast<ProjectmSource*>(arg);
+  self->RunLoader();
+  return NULL;
+}
+
+// Loads presets, and renders one frame with each of them to compile
+// their shaders, so that the worker thread never has to.
+void ProjectmSource::RunLoader() {
+  while (true) {
+    Instance* instance = nullptr;
+    int preset_index = -1;
+    {
+      Autolock l(lock_);
+      while (!is_shutting_down_ &&
+             !(instance = FindInstanceToLoadLocked(&preset_index))) {
+        pthread_cond_wait(&loader_cond_, &lock_);
+      }
+      if (is_shutting_down_)
+        break;
+      instance->state = INSTANCE_LOADING;
+      instance->preset_index = preset_index;
+    }
 
-  projectm_->selectPreset(0);
+    uint64_t start_time = GetCurrentMillis();
+    instance->render_context->MakeCurrent();
+    instance->projectm->selectPreset(preset_index);
+    std::vector<float> pcm;
+    {
+      Autolock l(lock_);
+      pcm = last_pcm_;
+    }
+    if (!pcm.empty())
+      instance->projectm->pcm()->setPCM(&pcm[0], pcm.size() / 2);
+    instance->projectm->renderFrame();
+    glFinish();
+    instance->render_context->ReleaseCurrent();
+
+    {
+      Autolock l(lock_);
+      instance->state = INSTANCE_READY;
+      load_durations_.Add(GetCurrentMillis() - start_time);
+    }
+  }
 }
 
 // dfplayer/presets/Geiss and Rovastar - The Chaos Of Colours (sprouting dimentia mix).milk
@@ -426,26 +531,32 @@ void ProjectmSource::CreateProjectM() {
 
 
 bool ProjectmSource::RenderFrame(bool need_image) {
-  projectm_->renderFrame();
+  FrameTrace trace;
+  trace.Mark(FRAME_STAGE_RENDER_START);
+  active_->projectm->renderFrame();
+  trace.Mark(FRAME_STAGE_RENDER_END);
 
-  Autolock l(lock_);
-  if (is_shutting_down_)
-    return false;
+  {
+    Autolock l(lock_);
+    if (is_shutting_down_)
+      return false;
 
-  double bass = 0;
-  double bass_att = 0;
-  double mid = 0;
-  double mid_att = 0;
-  double treb = 0;
-  double treb_att = 0;
-  projectm_->getBassData(&bass, &bass_att, &mid, &mid_att, &treb, &treb_att);
-  last_bass_info_.clear();
-  last_bass_info_.push_back(bass);
-  last_bass_info_.push_back(bass_att);
-  last_bass_info_.push_back(mid);
-  last_bass_info_.push_back(mid_att);
-  last_bass_info_.push_back(treb);
-  last_bass_info_.push_back(treb_att);
+    double bass = 0;
+    double bass_att = 0;
+    double mid = 0;
+    double mid_att = 0;
+    double treb = 0;
+    double treb_att = 0;
+    active_->projectm->getBassData(
+        &bass, &bass_att, &mid, &mid_att, &treb, &treb_att);
+    last_bass_info_.clear();
+    last_bass_info_.push_back(bass);
+    last_bass_info_.push_back(bass_att);
+    last_bass_info_.push_back(mid);
+    last_bass_info_.push_back(mid_att);
+    last_bass_info_.push_back(treb);
+    last_bass_info_.push_back(treb_att);
+  }
 
   GLenum err = glGetError();
   if (err != GL_NO_ERROR) {
@@ -453,15 +564,38 @@ bool ProjectmSource::RenderFrame(bool need_image) {
     return true;
   }
 
-  if (!need_image)
-    return false;
+  // The new readback is queued before waiting for the previous one,
+  // so that the GPU never idles while this thread maps pixels.
+  Readback* started = (need_image ? StartReadback(trace) : nullptr);
+  return FinishReadbacks(active_, started);
+}
 
+// RenderTarget constructor stores:
+//  - FB in fbuffer[0]
+//  - Depth RB in depthb[0]
+//  - FB-bound texture in textureID[0] square size of tex_size, RGB
+//  - Another texture in textureID[1] square size of tex_size, RGB
+//
+// RenderTarget::lock() binds fbuffer[0]
+// RenderTarget::lock() copies FB into textureID[1] and unbinds FB,
+//   tex remains bound
+//
+// initRenderToTexture() stores:
+//  - FB in fbuffer[1]
+//  - Depth RB in depthb[1]
+//  - FB-bound texture in textureID[2], RGB
+//  - renderToTexture is set to 1
+
+// Queues a copy of the texture into the next pixel buffer object.
+// Returns nullptr if the copy could not be started.
+ProjectmSource::Readback* ProjectmSource::StartReadback(
+    const FrameTrace& trace) {
   //glFlush();
-  glXSwapBuffers(display_, pbuffer_);
+  active_->render_context->SwapBuffers();
 
   //glReadBuffer(GL_BACK);
   glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, projectm_tex_);
+  glBindTexture(GL_TEXTURE_2D, active_->texture);
 
   int w = 0;
   int h = 0;
@@ -481,66 +615,119 @@ bool ProjectmSource::RenderFrame(bool need_image) {
     fprintf(stderr, "Unexpected texture size of %d x %d, instead of %d\n",
             w, h, tex_size_);
     glBindTexture(GL_TEXTURE_2D, 0);
-    return false;
+    return nullptr;
   }
   if (red_size != 8 || green_size != 8 || blue_size != 8 ||
       alpha_size != 0 || internal_format != GL_RGB) {
     fprintf(stderr, "Unexpected color sizes of %d %d %d %d fmt=0x%x\n",
             red_size, green_size, blue_size, alpha_size, internal_format);
     glBindTexture(GL_TEXTURE_2D, 0);
-    return false;
+    return nullptr;
   }
 
-  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  // With a pack buffer bound, glGetTexImage() returns without waiting
+  // for rendering to complete, and the pointer is a buffer offset.
+  Readback* readback = &active_->readbacks[active_->next_readback];
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
   glPixelStorei(GL_PACK_ALIGNMENT, 1);
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_buffer_);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 
-  err = glGetError();
+  GLenum err = glGetError();
   glBindTexture(GL_TEXTURE_2D, 0);
   glDisable(GL_TEXTURE_2D);
   if (err != GL_NO_ERROR) {
-    GLenum status = 0; //glCheckFramebufferStatus(GL_FRAMEBUFFER);
-    fprintf(stderr, "Unable to read pixels, err=0x%x, fb_status=0x%x\n",
-            err, status);
-    return false;
+    fprintf(stderr, "Unable to read pixels, err=0x%x\n", err);
+    return nullptr;
   }
 
-  const uint8_t* img2 = FlipImage(image_buffer_, tex_size_, tex_size_, false);
-  memcpy(image_buffer_, img2, image_buffer_size_);
-  delete[] img2;
-
-  // RenderTarget constructor stores:
-  //  - FB in fbuffer[0]
-  //  - Depth RB in depthb[0]
-  //  - FB-bound texture in textureID[0] square size of tex_size, RGB
-  //  - Another texture in textureID[1] square size of tex_size, RGB
-  //
-  // RenderTarget::lock() binds fbuffer[0]
-  // RenderTarget::lock() copies FB into textureID[1] and unbinds FB,
-  //   tex remains bound
-  //
-  // initRenderToTexture() stores:
-  //  - FB in fbuffer[1]
-  //  - Depth RB in depthb[1]
-  //  - FB-bound texture in textureID[2], RGB
-  //  - renderToTexture is set to 1
+  readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  if (!readback->fence) {
+    fprintf(stderr, "Unable to create readback fence, err=0x%x\n",
+            glGetError());
+    return nullptr;
+  }
+  readback->trace = trace;
+  active_->next_readback = (active_->next_readback + 1) % kReadbackCount;
+  return readback;
+}
 
-  return true;
+// Maps all started readbacks except |skip|, oldest first, and publishes
+// them as |last_image_| and to subscribers. Returns true if a new image
+// was published.
+bool ProjectmSource::FinishReadbacks(
+    Instance* instance, const Readback* skip) {
+  bool has_new_image = false;
+  for (int i = 0; i < kReadbackCount; ++i) {
+    Readback* readback = &instance->readbacks[
+        (instance->next_readback + i) % kReadbackCount];
+    if (!readback->fence || readback == skip)
+      continue;
+
+    GLenum status = glClientWaitSync(
+        readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, kReadbackTimeoutNs);
+    glDeleteSync(readback->fence);
+    readback->fence = nullptr;
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+      fprintf(stderr, "Readback did not complete, status=0x%x\n", status);
+      continue;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->buffer);
+    const uint8_t* pixels = reinterpret_cast<const uint8_t*>(
+        glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+    if (pixels) {
+      RgbaImage image;
+      {
+        Autolock l(lock_);
+        // ResizeStorage() allocates a new buffer if consumers still hold
+        // the previous frame, so their images are never modified.
+        // GL rows go bottom-up, and are flipped while copying out
+        // of the mapped buffer.
+        last_image_.ResizeStorage(tex_size_, tex_size_);
+        FlipImage(pixels, tex_size_, tex_size_, false,
+                  last_image_.mutable_data());
+        readback->trace.frame_id = ++last_frame_id_;
+        readback->trace.Mark(FRAME_STAGE_READBACK);
+        *last_image_.mutable_trace() = readback->trace;
+        image = last_image_;
+      }
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      has_new_image = true;
+      PublishImage(image);
+    } else {
+      fprintf(stderr, "Unable to map readback buffer, err=0x%x\n",
+              glGetError());
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+  return has_new_image;
 }
 
-void ProjectmSource::NextPresetWorkItem::Run(ProjectmSource* self) {
-  unsigned int idx = -1;
-  if (!self->projectm_->selectedPresetIndex(idx)) {
-    self->projectm_->selectPreset(0);
-    return;
+void ProjectmSource::CreateReadbackBuffers(Instance* instance) {
+  for (int i = 0; i < kReadbackCount; ++i) {
+    glGenBuffers(1, &instance->readbacks[i].buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, instance->readbacks[i].buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, RGBA_LEN(tex_size_, tex_size_),
+                 nullptr, GL_STREAM_READ);
   }
-  unsigned int size = self->projectm_->getPlaylistSize();
-  if (is_next_) {
-    idx = (idx < size - 1 ? idx + 1 : 0);
-  } else {
-    idx = (idx > 0 ? idx - 1 : size - 1);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  GLenum err = glGetError();
+  if (err != GL_NO_ERROR) {
+    fprintf(stderr, "Unable to create readback buffers, err=0x%x\n", err);
+    CHECK(false);
+  }
+}
+
+void ProjectmSource::DestroyReadbackBuffers(Instance* instance) {
+  for (int i = 0; i < kReadbackCount; ++i) {
+    if (instance->readbacks[i].fence) {
+      glDeleteSync(instance->readbacks[i].fence);
+      instance->readbacks[i].fence = nullptr;
+    }
+    glDeleteBuffers(1, &instance->readbacks[i].buffer);
+    instance->readbacks[i].buffer = 0;
   }
-  self->projectm_->selectPreset(idx);
 }
 
 void ProjectmSource::StartMessageLoop() {
@@ -563,13 +750,21 @@ void* ProjectmSource::ThreadEntry(void* arg) {
 }
 
 void ProjectmSource::Run() {
-  CreateRenderContext();
-  CreateProjectM();
+  CreateInstances();
+  int err = pthread_create(
+      &loader_thread_, NULL, &LoaderThreadEntry, this);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create failed with %d\n", err);
+    CHECK(false);
+  }
 
   bool should_sleep = false;
-  uint64_t next_render_time = GetCurrentMillis() + ms_per_frame_;
+  // Frames are scheduled at exact multiples of the frame period after
+  // |schedule_start_time|.
+  uint64_t schedule_start_time = GetCurrentMillis();
+  uint64_t scheduled_frame_count = 0;
+  uint64_t next_render_time = schedule_start_time;
   uint64_t prev_frame_time = 0;
-  uint32_t frame_num = 0;
   while (true) {
     if (should_sleep) {
       should_sleep = false;
@@ -587,33 +782,46 @@ void ProjectmSource::Run() {
     }
 
     if (remaining_time > 0) {
+      // Maps the last readback while waiting for the next frame, so that
+      // images are not delayed by a whole frame period.
+      if (FinishReadbacks(active_, nullptr)) {
+        Autolock l(lock_);
+        has_new_image_ = true;
+        continue;
+      }
       Sleep(((double) remaining_time) / 1000.0);
       continue;
     }
 
+    Instance* next_instance = nullptr;
+    bool has_subscribers = HasSubscribers();
+    bool need_image = false;
     {
       Autolock l(lock_);
       if (is_shutting_down_)
         break;
+      next_instance = TakeNextInstanceLocked();
+      need_image = governor_.NeedsImage(GetCurrentMillis(), has_subscribers);
+    }
 
-      while (!work_items_.empty()) {
-        WorkItem* item = work_items_.front();
-        work_items_.pop_front();
-        item->Run(this);
-        delete item;
-      }
+    bool has_new_image = false;
+    if (next_instance)
+      has_new_image = SwitchToInstance(next_instance);
+
+    {
+      Autolock l(lock_);
+      if (is_shutting_down_)
+        break;
 
+      has_new_image_ |= has_new_image;
       if (!TransferPcmDataLocked()) {
-        //fprintf(stderr, "No ALSA data\n");
+        //fprintf(stderr, "No audio data\n");
         should_sleep = true;
         continue;
       }
     }
 
-    // We run at 2x the max rendering FPS to make it 30FPS,
-    // so deliver every other frame.
-    bool need_image = (frame_num & 1) == 0;
-    bool has_new_image = RenderFrame(need_image);
+    has_new_image = RenderFrame(need_image);
     //fprintf(stderr, "Rendered frame = %d\n", (int)has_new_image);
 
     {
@@ -621,25 +829,32 @@ void ProjectmSource::Run() {
       if (is_shutting_down_)
         break;
 
-      if (projectm_->selectedPresetIndex(current_preset_index_)) {
-        current_preset_ = projectm_->getPresetName(current_preset_index_);
-      } else {
-        current_preset_index_ = -1;
-        current_preset_ = "";
-      }
-
       has_new_image_ |= has_new_image;
 
       uint64_t now = GetCurrentMillis();
-      if (prev_frame_time)
+      if (prev_frame_time) {
         frame_periods_.push_back(now - prev_frame_time);
+        if (next_instance)
+          switch_periods_.Add(now - prev_frame_time);
+      }
       prev_frame_time = now;
-      next_render_time += ms_per_frame_;
+      scheduled_frame_count++;
+      next_render_time = schedule_start_time +
+          scheduled_frame_count * 1000 / governor_.render_fps();
+      // Frames that were missed are not rendered in a burst.
+      if (next_render_time < now) {
+        schedule_start_time = now;
+        scheduled_frame_count = 0;
+        next_render_time = now;
+      }
     }
-
-    frame_num++;
   }
 
-  delete projectm_;
-  DestroyRenderContext();
+  {
+    Autolock l(lock_);
+    is_shutting_down_ = true;
+    pthread_cond_broadcast(&loader_cond_);
+  }
+  pthread_join(loader_thread_, NULL);
+  DestroyInstances();
 }
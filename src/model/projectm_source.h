@@ -3,31 +3,50 @@
 #ifndef MODEL_PROJECTM_SOURCE_H_
 #define MODEL_PROJECTM_SOURCE_H_
 
-#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
 
-#include <GL/glx.h>
+#include <GL/gl.h>
 #include <pthread.h>
 
+#include "model/audio_analyzer.h"
+#include "model/audio_capture.h"
 #include "model/image_source.h"
-#include "util/input_alsa.h"
+#include "model/preset_playlist.h"
+#include "model/render_context.h"
+#include "model/render_governor.h"
+#include "util/frame_trace.h"
 #include "util/pixels.h"
+#include "util/seqlock.h"
 
 class projectM;
 
+// Renders projectM visualizations on a worker thread. Upcoming presets
+// are loaded by a separate loader thread into standby projectM
+// instances, each with its own GL context, so that switching presets
+// only requires changing the rendered instance. Each rendered frame is
+// published to subscribers as soon as its readback completes. Frames
+// are read back only as often as consumers need them, see RenderGovernor.
 class ProjectmSource : public ImageSource {
  public:
+  // |fps| is the rate at which subscribers consume images. Frames are
+  // rendered at this rate, up to 30 fps.
   ProjectmSource(int width, int height, int tex_size, int fps,
       const std::string& preset_dir, const std::string& textures_dir,
-      int preset_duration);
+      int preset_duration, RenderBackend render_backend);
   ~ProjectmSource() override;
 
   void StartMessageLoop();
 
+  // Captures audio from |spec|, which is an ALSA device name, or
+  // a generator or file as described in PcmSource::Create().
   void UseAlsa(const std::string& spec);
 
+  // Configures audio capture, takes effect on the next UseAlsa().
+  void SetAudioCaptureOptions(
+      int period_us, int period_count, bool use_mmap);
+
   std::string GetCurrentPresetName();
   std::string GetCurrentPresetNameProgress();
 
@@ -42,10 +61,24 @@ class ProjectmSource : public ImageSource {
   // Returns [bass, bass_att, mid, mid_att, treb, treb_att].
   std::vector<double> GetLastBassInfo();
 
+  // Copies features of the newest captured audio. Can be called
+  // by any thread, and never waits for capture or rendering.
+  void GetAudioFeatures(AudioFeatures* dst) const;
+
   int GetAndClearOverrunCount();
+
+  // See AudioCapture::GetAndClearLatencyStats().
+  std::vector<int> GetAndClearAudioLatencyStats();
   std::vector<int> GetAndClearFramePeriods();
   bool GetAndClearHasNewImage();
 
+  // Returns [switches, avg_switch_period_ms, max_switch_period_ms,
+  // swaps, avg_swap_us, max_swap_us, loads, avg_load_ms, max_load_ms,
+  // late_switches]. Switch period is the frame period that includes
+  // a preset switch. Swap is the time to change the rendered instance.
+  // Late switches had to wait for their preset to load.
+  std::vector<int> GetAndClearPresetSwitchStats();
+
   int tex_size() const { return tex_size_; }
 
   std::unique_ptr<RgbaImage> GetImage(int frame_id) override;
@@ -54,56 +87,113 @@ class ProjectmSource : public ImageSource {
   ProjectmSource(const ProjectmSource& src);
   ProjectmSource& operator=(const ProjectmSource& rhs);
 
-  class WorkItem {
-   public:
-    WorkItem() {}
-    virtual ~WorkItem() = default;
-    virtual void Run(ProjectmSource* self) = 0;
+  // Accumulates durations under |lock_|.
+  struct DurationStats {
+    void Add(int value);
+    void GetAndClear(std::vector<int>* dst);
+
+    int count = 0;
+    int64_t sum = 0;
+    int max = 0;
+  };
+
+  // Texture is read back into a pixel buffer object asynchronously,
+  // and the pixels are mapped after the next frame is rendered.
+  struct Readback {
+    GLuint buffer = 0;
+    GLsync fence = nullptr;
+    FrameTrace trace;
+  };
+  static const int kReadbackCount = 2;
+
+  enum InstanceState {
+    // Rendered by the worker thread.
+    INSTANCE_ACTIVE,
+    // Not used by any thread.
+    INSTANCE_IDLE,
+    // Used by the loader thread.
+    INSTANCE_LOADING,
+    // Has |preset_index| loaded. Only receives PCM from the worker
+    // thread under |lock_|.
+    INSTANCE_READY,
   };
 
-  class NextPresetWorkItem : public WorkItem {
-   public:
-    NextPresetWorkItem(bool is_next) : is_next_(is_next) {}
-    void Run(ProjectmSource* self) override;
-   private:
-    const bool is_next_;
+  // projectM with its own GL context. Only the thread that owns
+  // the instance according to its |state| may use it.
+  struct Instance {
+    std::unique_ptr<RenderContext> render_context;
+    projectM* projectm = nullptr;
+    int texture = 0;
+    // Readbacks in flight. The next one to start is also the oldest
+    // one to finish.
+    Readback readbacks[kReadbackCount];
+    int next_readback = 0;
+    // Protected by |lock_|.
+    InstanceState state = INSTANCE_IDLE;
+    int preset_index = -1;
   };
 
+  // Number of upcoming presets loaded in advance.
+  static const int kPreparedPresetCount = 2;
+
   static void* ThreadEntry(void* arg);
+  static void* LoaderThreadEntry(void* arg);
 
   void Run();
-  void CreateRenderContext();
-  void DestroyRenderContext();
-  void CreateProjectM();
+  void RunLoader();
+  void CreateInstances();
+  void DestroyInstances();
+  Instance* CreateInstance();
   bool RenderFrame(bool need_image);
+  void CreateReadbackBuffers(Instance* instance);
+  void DestroyReadbackBuffers(Instance* instance);
   void CloseInputLocked();
   bool TransferPcmDataLocked();
-  int ReadFromAlsa(float* pcm_buffer);
-
-  void ScheduleWorkItemLocked(WorkItem* item);
+  int ReadCapturedPcm(int16_t* read_buf);
+
+  Readback* StartReadback(const FrameTrace& trace);
+  bool FinishReadbacks(Instance* instance, const Readback* skip);
+
+  // Returns a loaded instance if it is time to switch presets, and
+  // makes it active. Returns nullptr otherwise.
+  Instance* TakeNextInstanceLocked();
+  // Starts rendering |next| instead of the active instance. Returns
+  // true if readbacks of the previous instance produced a new image.
+  bool SwitchToInstance(Instance* next);
+  // Returns an instance that should load |*preset_index|, or nullptr.
+  Instance* FindInstanceToLoadLocked(int* preset_index);
+  void UpdateCurrentPresetLocked();
+  uint64_t GetPresetDurationMs() const;
 
   pthread_mutex_t lock_;
   pthread_t thread_;
+  pthread_t loader_thread_;
+  // Wakes up the loader thread.
+  pthread_cond_t loader_cond_;
   bool is_shutting_down_ = false;
   bool has_started_thread_ = false;
-  uint64_t last_render_time_;
-  uint32_t ms_per_frame_;
-  std::deque<WorkItem*> work_items_;
+  RenderGovernor governor_;
   std::vector<int> frame_periods_;
   bool has_new_image_ = false;
 
-  std::string alsa_device_;
-  AlsaInputHandle* alsa_handle_ = nullptr;
-  int total_overrun_count_ = 0;
+  std::string audio_input_;
+  AudioCapture::Options capture_options_;
+  std::unique_ptr<AudioCapture> audio_capture_;
+  // Position of the last frame read from |audio_capture_|.
+  uint64_t pcm_read_pos_ = 0;
+  // Written by the capture thread, outlives |audio_capture_|.
+  Seqlock<AudioFeatures> audio_features_;
   double volume_multiplier_ = 1;
   double last_volume_rms_ = 0;
+  // Newest PCM window given to the active instance, for warming up
+  // loaded instances.
+  std::vector<float> last_pcm_;
 
   int tex_size_;
-  uint8_t* image_buffer_;
-  uint32_t image_buffer_size_;
+  // Last flipped frame. Handed out to consumers without copying.
+  RgbaImage last_image_;
+  uint32_t last_frame_id_ = 0;
 
-  projectM* projectm_ = nullptr;
-  int projectm_tex_ = 0;
   std::string preset_dir_;
   std::string textures_dir_;
   int preset_duration_;
@@ -111,13 +201,20 @@ class ProjectmSource : public ImageSource {
   unsigned int current_preset_index_ = -1;
   std::vector<std::string> all_presets_;
   std::vector<double> last_bass_info_;
-
-  // GLX data, used by the worker thread only.
-  Display* display_;
-  GLXContext gl_context_;
-  GLXPbuffer pbuffer_;
-
-  friend class NextPresetWorkItem;
+  std::unique_ptr<PresetPlaylist> playlist_;
+  uint64_t next_preset_time_ = 0;
+  bool is_switch_requested_ = false;
+  bool is_switch_late_ = false;
+  DurationStats switch_periods_;
+  DurationStats swap_durations_;
+  DurationStats load_durations_;
+  int late_switch_count_ = 0;
+
+  // Created and destroyed by the worker thread.
+  std::vector<std::unique_ptr<Instance>> instances_;
+  // Used by the worker thread only.
+  const RenderBackend render_backend_;
+  Instance* active_ = nullptr;
 };
 
 #endif  // MODEL_PROJECTM_SOURCE_H_
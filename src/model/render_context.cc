@@ -0,0 +1,240 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/render_context.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/glx.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/logging.h"
+
+namespace {
+
+class GlxRenderContext : public RenderContext {
+ public:
+  GlxRenderContext(int width, int height);
+  ~GlxRenderContext() override;
+
+  void SwapBuffers() override;
+  void MakeCurrent() override;
+  void ReleaseCurrent() override;
+
+ private:
+  Display* display_;
+  GLXContext gl_context_;
+  GLXPbuffer pbuffer_;
+};
+
+GlxRenderContext::GlxRenderContext(int width, int height) {
+  display_ = XOpenDisplay(NULL);
+  if (!display_) {
+    fprintf(stderr, "Unable to open display\n");
+    CHECK(false);
+  }
+
+  static int kVisualAttribs[] = {
+      GLX_RENDER_TYPE, GLX_RGBA_BIT,
+      GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
+      GLX_RED_SIZE, 8,
+      GLX_GREEN_SIZE, 8,
+      GLX_BLUE_SIZE, 8,
+      GLX_ALPHA_SIZE, 8,
+      GLX_DEPTH_SIZE, 8,
+      None
+  };
+  int fb_config_count = 0;
+  GLXFBConfig* fb_configs = glXChooseFBConfig(
+      display_, DefaultScreen(display_), kVisualAttribs, &fb_config_count);
+  if (!fb_configs || fb_config_count == 0) {
+    fprintf(stderr, "Unable to find FB config\n");
+    CHECK(false);
+  }
+
+  /*static int kContextAttribs[] = {
+      GLX_CONTEXT_MAJOR_VERSION_ARB,  4,
+      GLX_CONTEXT_MINOR_VERSION_ARB,  2,
+      GLX_CONTEXT_FLAGS_ARB,          GLX_CONTEXT_DEBUG_BIT_ARB,
+      GLX_CONTEXT_PROFILE_MASK_ARB,   GLX_CONTEXT_CORE_PROFILE_BIT_ARB,
+      None
+  };
+  gl_context_ = glXCreateContextAttribsARB(
+      display_, fb_configs[0], 0, true, kContextAttribs);*/
+  gl_context_ = glXCreateNewContext(
+      display_, fb_configs[0], GLX_RGBA_TYPE, NULL, true);
+  if (!gl_context_) {
+    fprintf(stderr, "Unable to create GL context\n");
+    CHECK(false);
+  }
+
+  int pbuffer_attribs[] = {
+      GLX_PBUFFER_WIDTH,  width,
+      GLX_PBUFFER_HEIGHT, height,
+      None
+  };
+  pbuffer_ = glXCreatePbuffer(display_, fb_configs[0], pbuffer_attribs);
+  if (!pbuffer_) {
+    fprintf(stderr, "Unable to create Pbuffer\n");
+    CHECK(false);
+  }
+
+  XFree(fb_configs);
+  XSync(display_, false);
+
+  MakeCurrent();
+}
+
+GlxRenderContext::~GlxRenderContext() {
+  glXMakeContextCurrent(display_, None, None, NULL);
+  glXDestroyContext(display_, gl_context_);
+  glXDestroyPbuffer(display_, pbuffer_);
+  XCloseDisplay(display_);
+}
+
+void GlxRenderContext::SwapBuffers() {
+  glXSwapBuffers(display_, pbuffer_);
+}
+
+void GlxRenderContext::MakeCurrent() {
+  if (!glXMakeContextCurrent(display_, pbuffer_, pbuffer_, gl_context_)) {
+    fprintf(stderr, "Unable to set GL context and pbuffer as current\n");
+    CHECK(false);
+  }
+}
+
+void GlxRenderContext::ReleaseCurrent() {
+  glXMakeContextCurrent(display_, None, None, NULL);
+}
+
+class EglRenderContext : public RenderContext {
+ public:
+  EglRenderContext(int width, int height);
+  ~EglRenderContext() override;
+
+  void SwapBuffers() override;
+  void MakeCurrent() override;
+  void ReleaseCurrent() override;
+
+ private:
+  EGLDisplay display_;
+  EGLContext context_;
+  EGLSurface surface_;
+};
+
+// Prefers Mesa's surfaceless platform, which needs neither X nor DRM
+// master, and falls back to the default display.
+EGLDisplay GetEglDisplay() {
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (get_platform_display) {
+      EGLDisplay display = get_platform_display(
+          EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+      if (display != EGL_NO_DISPLAY)
+        return display;
+    }
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+EglRenderContext::EglRenderContext(int width, int height) {
+  display_ = GetEglDisplay();
+  EGLint major = 0;
+  EGLint minor = 0;
+  if (display_ == EGL_NO_DISPLAY ||
+      !eglInitialize(display_, &major, &minor)) {
+    fprintf(stderr, "Unable to initialize EGL display, err=0x%x\n",
+            eglGetError());
+    CHECK(false);
+  }
+  fprintf(stderr, "Initialized EGL %d.%d, vendor=%s\n",
+          major, minor, eglQueryString(display_, EGL_VENDOR));
+
+  // ProjectM uses the compatibility profile of desktop GL.
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    fprintf(stderr, "Unable to bind OpenGL API, err=0x%x\n", eglGetError());
+    CHECK(false);
+  }
+
+  static const EGLint kConfigAttribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 8,
+      EGL_GREEN_SIZE, 8,
+      EGL_BLUE_SIZE, 8,
+      EGL_ALPHA_SIZE, 8,
+      EGL_DEPTH_SIZE, 8,
+      EGL_NONE
+  };
+  EGLConfig config;
+  EGLint config_count = 0;
+  if (!eglChooseConfig(display_, kConfigAttribs, &config, 1, &config_count) ||
+      config_count == 0) {
+    fprintf(stderr, "Unable to find EGL config, err=0x%x\n", eglGetError());
+    CHECK(false);
+  }
+
+  context_ = eglCreateContext(display_, config, EGL_NO_CONTEXT, nullptr);
+  if (context_ == EGL_NO_CONTEXT) {
+    fprintf(stderr, "Unable to create EGL context, err=0x%x\n",
+            eglGetError());
+    CHECK(false);
+  }
+
+  const EGLint surface_attribs[] = {
+      EGL_WIDTH, width,
+      EGL_HEIGHT, height,
+      EGL_NONE
+  };
+  surface_ = eglCreatePbufferSurface(display_, config, surface_attribs);
+  if (surface_ == EGL_NO_SURFACE) {
+    fprintf(stderr, "Unable to create EGL pbuffer, err=0x%x\n",
+            eglGetError());
+    CHECK(false);
+  }
+
+  MakeCurrent();
+}
+
+// The display is shared by all contexts, and is not terminated.
+EglRenderContext::~EglRenderContext() {
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroySurface(display_, surface_);
+  eglDestroyContext(display_, context_);
+}
+
+void EglRenderContext::SwapBuffers() {
+  eglSwapBuffers(display_, surface_);
+}
+
+void EglRenderContext::MakeCurrent() {
+  if (!eglMakeCurrent(display_, surface_, surface_, context_)) {
+    fprintf(stderr, "Unable to set EGL context as current, err=0x%x\n",
+            eglGetError());
+    CHECK(false);
+  }
+}
+
+void EglRenderContext::ReleaseCurrent() {
+  eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+}  // namespace
+
+// static
+RenderContext* RenderContext::Create(
+    RenderBackend backend, int width, int height) {
+  switch (backend) {
+    case RENDER_BACKEND_GLX:
+      return new GlxRenderContext(width, height);
+    case RENDER_BACKEND_EGL:
+      return new EglRenderContext(width, height);
+    default:
+      fprintf(stderr, "Unknown render backend %d\n", backend);
+      CHECK(false);
+      return nullptr;
+  }
+}
@@ -0,0 +1,40 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_RENDER_CONTEXT_H_
+#define MODEL_RENDER_CONTEXT_H_
+
+enum RenderBackend {
+  // GLX pbuffer, requires an X display.
+  RENDER_BACKEND_GLX = 0,
+  // EGL pbuffer on a surfaceless display, works on headless hosts
+  // and falls back to software rendering when there is no GPU.
+  RENDER_BACKEND_EGL = 1,
+};
+
+// Offscreen OpenGL context with a drawable of the given size. Contexts
+// do not share objects. A context can be used by one thread at a time,
+// and is moved between threads with ReleaseCurrent() and MakeCurrent().
+class RenderContext {
+ public:
+  // Creates the context and makes it current. CHECK-fails on errors.
+  static RenderContext* Create(RenderBackend backend, int width, int height);
+
+  virtual ~RenderContext() = default;
+
+  virtual void SwapBuffers() = 0;
+
+  // Binds the context to the calling thread. CHECK-fails on errors.
+  virtual void MakeCurrent() = 0;
+
+  // Unbinds the context from the calling thread.
+  virtual void ReleaseCurrent() = 0;
+
+ protected:
+  RenderContext() {}
+
+ private:
+  RenderContext(const RenderContext& src);
+  RenderContext& operator=(const RenderContext& rhs);
+};
+
+#endif  // MODEL_RENDER_CONTEXT_H_
@@ -0,0 +1,43 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "model/render_governor.h"
+
+#include <algorithm>
+
+namespace {
+
+// Poll rate is measured over windows of this duration.
+const int kPullWindowMs = 1000;
+
+}  // namespace
+
+RenderGovernor::RenderGovernor(int render_fps, int subscriber_fps)
+    : render_fps_(render_fps), subscriber_fps_(subscriber_fps) {}
+
+void RenderGovernor::AddPull(uint64_t now_ms) {
+  if (!pull_window_start_ms_)
+    pull_window_start_ms_ = now_ms;
+  pull_count_++;
+}
+
+bool RenderGovernor::NeedsImage(uint64_t now_ms, bool has_subscribers) {
+  if (pull_window_start_ms_ &&
+      now_ms >= pull_window_start_ms_ + kPullWindowMs) {
+    int elapsed_ms = now_ms - pull_window_start_ms_;
+    // Rounds up, so that a consumer polling at N fps gets N fps.
+    pull_fps_ = (pull_count_ * 1000 + elapsed_ms - 1) / elapsed_ms;
+    pull_count_ = 0;
+    pull_window_start_ms_ = (pull_fps_ ? now_ms : 0);
+  }
+
+  int demand_fps = std::max(has_subscribers ? subscriber_fps_ : 0, pull_fps_);
+  if (demand_fps <= 0) {
+    image_credit_ = 0;
+    return false;
+  }
+  image_credit_ += std::min(demand_fps, render_fps_);
+  if (image_credit_ < render_fps_)
+    return false;
+  image_credit_ -= render_fps_;
+  return true;
+}
@@ -0,0 +1,42 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef MODEL_RENDER_GOVERNOR_H_
+#define MODEL_RENDER_GOVERNOR_H_
+
+#include <stdint.h>
+
+// Decides which rendered frames are read back into images. projectM
+// advances preset motion and beat detection once per rendered frame,
+// at the rate given in its settings, so frames are always rendered at
+// |render_fps|. Only readbacks follow the demand of consumers: every
+// frame while subscribers are present, as many as polling consumers
+// take, and none without consumers. Not thread-safe.
+class RenderGovernor {
+ public:
+  // |subscriber_fps| is the rate at which subscribers consume images.
+  RenderGovernor(int render_fps, int subscriber_fps);
+
+  int render_fps() const { return render_fps_; }
+
+  // Records an image taken by a consumer that polls for images.
+  void AddPull(uint64_t now_ms);
+
+  // Returns true if the next rendered frame should be read back.
+  bool NeedsImage(uint64_t now_ms, bool has_subscribers);
+
+ private:
+  RenderGovernor(const RenderGovernor& src);
+  RenderGovernor& operator=(const RenderGovernor& rhs);
+
+  const int render_fps_;
+  const int subscriber_fps_;
+  // Polls counted since |pull_window_start_ms_|.
+  int pull_count_ = 0;
+  uint64_t pull_window_start_ms_ = 0;
+  int pull_fps_ = 0;
+  // Spreads readbacks evenly when fewer images are needed than
+  // rendered. An image is due when it reaches |render_fps_|.
+  int image_credit_ = 0;
+};
+
+#endif  // MODEL_RENDER_GOVERNOR_H_
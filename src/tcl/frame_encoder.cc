@@ -0,0 +1,153 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "tcl/frame_encoder.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+
+namespace {
+
+const uint8_t kBlackOffset = 0x2C;
+
+#ifndef __SSE2__
+
+// Transposes 8x8 bit matrix, where byte N is row N and bit M is column M.
+// See "Hacker's Delight", section 7-3.
+inline uint64_t TransposeBits8x8(uint64_t x) {
+  uint64_t t;
+  t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+  x = x ^ t ^ (t << 28);
+  return x;
+}
+
+// Writes one color component of 8 strands, given as bytes of |plane|.
+inline void EncodeComponent(uint64_t plane, uint8_t* dst) {
+  uint64_t bits = TransposeBits8x8(plane);
+  // Byte N of |bits| now holds bit N of every strand, while the frame
+  // starts with the most significant bit.
+  for (int i = 0; i < 8; ++i)
+    dst[i] = static_cast<uint8_t>((bits >> ((7 - i) * 8)) + kBlackOffset);
+}
+
+#endif  // !__SSE2__
+
+}  // namespace
+
+FrameEncoder::FrameEncoder(int strand_length)
+    : strand_length_(strand_length) {
+  colors_.resize(strand_length_ * kStrandCount);
+}
+
+void FrameEncoder::GatherColors(
+    const LedStrands& strands, const RgbGamma* gamma) {
+  memset(colors_.data(), 0, colors_.size() * sizeof(uint32_t));
+  int strand_count = std::min(strands.GetStrandCount(), kStrandCount);
+  for (int strand_id = 0; strand_id < strand_count; ++strand_id) {
+    int led_count = std::min(strands.GetLedCount(strand_id), strand_length_);
+    const uint32_t* src =
+        reinterpret_cast<const uint32_t*>(strands.GetColorData(strand_id));
+    uint32_t* dst = colors_.data() + strand_id;
+    if (gamma) {
+      for (int led_id = 0; led_id < led_count; ++led_id)
+        dst[led_id * kStrandCount] = gamma->Apply(src[led_id]);
+    } else {
+      for (int led_id = 0; led_id < led_count; ++led_id)
+        dst[led_id * kStrandCount] = src[led_id];
+    }
+  }
+}
+
+void FrameEncoder::Encode(
+    const LedStrands& strands, const RgbGamma* gamma, uint8_t* dst) {
+  GatherColors(strands, gamma);
+  const uint32_t* colors = colors_.data();
+
+#ifdef __SSE2__
+  const __m128i offset = _mm_set1_epi8(kBlackOffset);
+  for (int led_id = 0; led_id < strand_length_; ++led_id) {
+    // Transpose 8 RGBA colors into R0..R7 G0..G7 and B0..B7 A0..A7.
+    __m128i a = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(colors + led_id * kStrandCount));
+    __m128i b = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(colors + led_id * kStrandCount + 4));
+    __m128i t0 = _mm_unpacklo_epi8(a, b);
+    __m128i t1 = _mm_unpackhi_epi8(a, b);
+    __m128i u0 = _mm_unpacklo_epi8(t0, t1);
+    __m128i u1 = _mm_unpackhi_epi8(t0, t1);
+    __m128i rg = _mm_unpacklo_epi8(u0, u1);
+    __m128i ba = _mm_unpackhi_epi8(u0, u1);
+
+    // Collect one bit-plane per step, from the most significant bit.
+    uint8_t planes[3][8];
+    for (int bit = 0; bit < 8; ++bit) {
+      int rg_mask = _mm_movemask_epi8(rg);
+      int ba_mask = _mm_movemask_epi8(ba);
+      planes[0][bit] = static_cast<uint8_t>(ba_mask);
+      planes[1][bit] = static_cast<uint8_t>(rg_mask >> 8);
+      planes[2][bit] = static_cast<uint8_t>(rg_mask);
+      rg = _mm_add_epi8(rg, rg);
+      ba = _mm_add_epi8(ba, ba);
+    }
+
+    uint8_t* led_dst = dst + led_id * kStrandCount * 3;
+    __m128i bg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes[0]));
+    __m128i r = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(planes[2]));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(led_dst),
+                     _mm_add_epi8(bg, offset));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(led_dst + 16),
+                     _mm_add_epi8(r, offset));
+  }
+#else
+  for (int led_id = 0; led_id < strand_length_; ++led_id) {
+    const uint32_t* led_colors = colors + led_id * kStrandCount;
+    uint64_t planes[3] = {0, 0, 0};
+    for (int strand_id = 0; strand_id < kStrandCount; ++strand_id) {
+      uint32_t color = led_colors[strand_id];
+      int shift = strand_id * 8;
+      planes[0] |= static_cast<uint64_t>((color >> 16) & 0xFF) << shift;
+      planes[1] |= static_cast<uint64_t>((color >> 8) & 0xFF) << shift;
+      planes[2] |= static_cast<uint64_t>(color & 0xFF) << shift;
+    }
+    uint8_t* led_dst = dst + led_id * kStrandCount * 3;
+    EncodeComponent(planes[0], led_dst);
+    EncodeComponent(planes[1], led_dst + 8);
+    EncodeComponent(planes[2], led_dst + 16);
+  }
+#endif
+}
+
+// static
+void FrameEncoder::Decode(
+    const uint8_t* src, int strand_length, uint32_t* colors) {
+  for (int led_id = 0; led_id < strand_length; ++led_id) {
+    const uint8_t* led_src = src + led_id * kStrandCount * 3;
+    // Components in the order of B, G, R.
+    uint8_t values[3][kStrandCount];
+    memset(values, 0, sizeof(values));
+    for (int component = 0; component < 3; ++component) {
+      for (int bit = 0; bit < 8; ++bit) {
+        uint8_t strand_bits =
+            static_cast<uint8_t>(led_src[component * 8 + bit] - kBlackOffset);
+        for (int strand_id = 0; strand_id < kStrandCount; ++strand_id) {
+          if (strand_bits & (1 << strand_id))
+            values[component][strand_id] |= (0x80 >> bit);
+        }
+      }
+    }
+    for (int strand_id = 0; strand_id < kStrandCount; ++strand_id) {
+      uint32_t r = values[2][strand_id];
+      uint32_t g = values[1][strand_id];
+      uint32_t b = values[0][strand_id];
+      colors[strand_id * strand_length + led_id] = PACK_COLOR32(r, g, b, 255u);
+    }
+  }
+}
@@ -0,0 +1,45 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef TCL_FRAME_ENCODER_H_
+#define TCL_FRAME_ENCODER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "util/led_layout.h"
+#include "util/pixels.h"
+
+// Converts LED colors into the bit-plane format expected by TCL controller.
+// Every LED index produces 24 bytes: 8 bytes for blue, then green and red.
+// Each byte holds one bit of the color component, most significant first,
+// with bit N representing strand N. Black color is offset by 0x2C.
+class FrameEncoder {
+ public:
+  static const int kStrandCount = 8;
+
+  FrameEncoder(int strand_length);
+
+  int frame_length() const { return strand_length_ * kStrandCount * 3; }
+
+  // Writes frame_length() bytes into |dst|. Strands beyond kStrandCount
+  // and LED's beyond |strand_length| are ignored, missing ones are black.
+  // If |gamma| is not null, it is applied to colors as they are read.
+  void Encode(const LedStrands& strands, const RgbGamma* gamma, uint8_t* dst);
+
+  // Reverses Encode(), writing kStrandCount * strand_length RGBA colors
+  // in strand-major order into |colors|. Used by the TCL emulator.
+  static void Decode(const uint8_t* src, int strand_length, uint32_t* colors);
+
+ private:
+  FrameEncoder(const FrameEncoder& src);
+  FrameEncoder& operator=(const FrameEncoder& rhs);
+
+  void GatherColors(const LedStrands& strands, const RgbGamma* gamma);
+
+  int strand_length_;
+  // RGBA colors in LED-major order, kStrandCount entries per LED.
+  std::vector<uint32_t> colors_;
+};
+
+#endif  // TCL_FRAME_ENCODER_H_
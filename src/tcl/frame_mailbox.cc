@@ -0,0 +1,41 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "tcl/frame_mailbox.h"
+
+FrameMailbox::FrameMailbox() : middle_(1), generation_(0) {}
+
+void FrameMailbox::Post(const RgbaImage& image, int id, uint64_t time) {
+  Frame* frame = &slots_[write_index_];
+  // Shares pixels with |image|. Pixels of the frame previously held
+  // in this slot are released here.
+  frame->image = image;
+  frame->id = id;
+  frame->time = time;
+  frame->generation = generation_.load(std::memory_order_acquire);
+
+  // Release publishes the slot contents, acquire obtains the slot
+  // that the consumer has returned.
+  int prev = middle_.exchange(
+      write_index_ | kFreshBit, std::memory_order_acq_rel);
+  write_index_ = prev & kIndexMask;
+}
+
+FrameMailbox::Frame* FrameMailbox::Take() {
+  if (!(middle_.load(std::memory_order_relaxed) & kFreshBit))
+    return nullptr;
+  int prev = middle_.exchange(read_index_, std::memory_order_acq_rel);
+  read_index_ = prev & kIndexMask;
+  return &slots_[read_index_];
+}
+
+void FrameMailbox::Clear() {
+  generation_.fetch_add(1, std::memory_order_acq_rel);
+}
+
+bool FrameMailbox::IsStale(const Frame* frame) const {
+  return frame->generation != generation_.load(std::memory_order_acquire);
+}
+
+bool FrameMailbox::has_frame() const {
+  return (middle_.load(std::memory_order_relaxed) & kFreshBit) != 0;
+}
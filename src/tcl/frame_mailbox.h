@@ -0,0 +1,62 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef TCL_FRAME_MAILBOX_H_
+#define TCL_FRAME_MAILBOX_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "util/pixels.h"
+
+// Holds only the newest frame scheduled for one controller.
+// Frames are triple-buffered: the producer fills its own slot and
+// exchanges it with the shared middle slot, and the consumer exchanges
+// the middle slot with its own slot when a newer frame is there.
+// Neither side ever blocks, and at most three frames are retained.
+// Supports one producer thread and one consumer thread. Clear() and
+// has_frame() can be called from any thread.
+class FrameMailbox {
+ public:
+  struct Frame {
+    RgbaImage image;
+    int id = 0;
+    uint64_t time = 0;
+    uint32_t generation = 0;
+  };
+
+  FrameMailbox();
+
+  // Producer side. Replaces the frame that was not taken yet, if any.
+  void Post(const RgbaImage& image, int id, uint64_t time);
+
+  // Consumer side. Returns the newest frame posted since the last call,
+  // or nullptr. The frame can be modified, and stays valid until
+  // the next call. Check IsStale() before using it.
+  Frame* Take();
+
+  // Makes all frames posted so far stale.
+  void Clear();
+
+  // Returns true if the frame was posted before the last Clear().
+  bool IsStale(const Frame* frame) const;
+
+  // Returns true if a posted frame was not taken yet.
+  bool has_frame() const;
+
+ private:
+  FrameMailbox(const FrameMailbox& src);
+  FrameMailbox& operator=(const FrameMailbox& rhs);
+
+  // Set in |middle_| when its slot holds a frame that was not taken.
+  static const int kFreshBit = 4;
+  static const int kIndexMask = 3;
+
+  Frame slots_[3];
+  std::atomic<int> middle_;
+  std::atomic<uint32_t> generation_;
+  int write_index_ = 0;  // Owned by the producer.
+  int read_index_ = 2;  // Owned by the consumer.
+};
+
+#endif  // TCL_FRAME_MAILBOX_H_
@@ -0,0 +1,161 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "tcl/hdr_filter.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/logging.h"
+
+namespace {
+
+// Size of the grid cell in image pixels.
+const int kCellSize = 4;
+
+struct MinOp {
+  inline uint8_t operator()(uint8_t a, uint8_t b) const {
+    return (a < b ? a : b);
+  }
+};
+
+struct MaxOp {
+  inline uint8_t operator()(uint8_t a, uint8_t b) const {
+    return (a > b ? a : b);
+  }
+};
+
+// Extrapolates value to a range from 0 to 255.
+#define EXTEND256(value, min, max)   \
+  ((max) == (min) ? (max) :          \
+      ((255 * ((value) - (min)) / ((max) - (min))) & 0xFF))
+
+}  // namespace
+
+HdrFilter::HdrFilter(const std::vector<LedCoord>& coords, int distance) {
+  radius_ = (distance + kCellSize / 2) / kCellSize;
+  if (coords.empty())
+    return;
+
+  int min_x = coords[0].x, max_x = coords[0].x;
+  int min_y = coords[0].y, max_y = coords[0].y;
+  for (size_t i = 1; i < coords.size(); ++i) {
+    min_x = std::min(min_x, coords[i].x);
+    max_x = std::max(max_x, coords[i].x);
+    min_y = std::min(min_y, coords[i].y);
+    max_y = std::max(max_y, coords[i].y);
+  }
+  grid_w_ = (max_x - min_x) / kCellSize + 1;
+  grid_h_ = (max_y - min_y) / kCellSize + 1;
+
+  led_cells_.resize(coords.size());
+  for (size_t i = 0; i < coords.size(); ++i) {
+    int cell_x = (coords[i].x - min_x) / kCellSize;
+    int cell_y = (coords[i].y - min_y) / kCellSize;
+    led_cells_[i] = cell_y * grid_w_ + cell_x;
+  }
+
+  int grid_size = grid_w_ * grid_h_;
+  l_min_.resize(grid_size);
+  l_max_.resize(grid_size);
+  s_min_.resize(grid_size);
+  s_max_.resize(grid_size);
+
+  // Lines are padded by |radius_| on both sides, and rounded up
+  // to the whole number of windows.
+  int window = radius_ * 2 + 1;
+  int max_line = std::max(grid_w_, grid_h_) + radius_ * 2;
+  int line_size = (max_line + window - 1) / window * window;
+  line_.resize(line_size);
+  prefix_.resize(line_size);
+  suffix_.resize(line_size);
+}
+
+void HdrFilter::Apply(LedStrands* strands, HdrMode mode) {
+  if (mode == HDR_MODE_NONE)
+    return;
+
+  CHECK(static_cast<size_t>(strands->GetTotalLedCount()) ==
+        led_cells_.size());
+  if (led_cells_.empty())
+    return;
+
+  bool use_lum = (mode == HDR_MODE_LUM || mode == HDR_MODE_LUM_SAT);
+  bool use_sat = (mode == HDR_MODE_SAT || mode == HDR_MODE_LUM_SAT);
+  uint8_t* colors = strands->GetAllColorData();
+  int led_count = led_cells_.size();
+
+  // Empty cells must not affect the result, so they start as neutral.
+  memset(l_min_.data(), 255, l_min_.size());
+  memset(l_max_.data(), 0, l_max_.size());
+  memset(s_min_.data(), 255, s_min_.size());
+  memset(s_max_.data(), 0, s_max_.size());
+  for (int i = 0; i < led_count; ++i) {
+    const uint8_t* hls = colors + i * 4;
+    uint32_t cell = led_cells_[i];
+    l_min_[cell] = MinOp()(l_min_[cell], hls[1]);
+    l_max_[cell] = MaxOp()(l_max_[cell], hls[1]);
+    s_min_[cell] = MinOp()(s_min_[cell], hls[2]);
+    s_max_[cell] = MaxOp()(s_max_[cell], hls[2]);
+  }
+
+  if (use_lum) {
+    FilterPlane(&l_min_, 255, MinOp());
+    FilterPlane(&l_max_, 0, MaxOp());
+  }
+  if (use_sat) {
+    FilterPlane(&s_min_, 255, MinOp());
+    FilterPlane(&s_max_, 0, MaxOp());
+  }
+
+  // Hue and alpha are always preserved.
+  for (int i = 0; i < led_count; ++i) {
+    uint8_t* hls = colors + i * 4;
+    uint32_t cell = led_cells_[i];
+    if (use_lum)
+      hls[1] = EXTEND256(hls[1], l_min_[cell], l_max_[cell]);
+    if (use_sat)
+      hls[2] = EXTEND256(hls[2], s_min_[cell], s_max_[cell]);
+  }
+}
+
+template<class Op>
+void HdrFilter::FilterPlane(
+    std::vector<uint8_t>* plane, uint8_t neutral, Op op) {
+  uint8_t* data = plane->data();
+  for (int y = 0; y < grid_h_; ++y)
+    FilterLine(data + y * grid_w_, grid_w_, 1, neutral, op);
+  for (int x = 0; x < grid_w_; ++x)
+    FilterLine(data + x, grid_h_, grid_w_, neutral, op);
+}
+
+// Applies van Herk/Gil-Werman min or max filter with a window centered
+// on each element. The padded line is split into blocks of window size,
+// with running values accumulated forward in |prefix_| and backward in
+// |suffix_|. Any window then spans at most two blocks.
+template<class Op>
+void HdrFilter::FilterLine(
+    uint8_t* data, int count, int stride, uint8_t neutral, Op op) {
+  int window = radius_ * 2 + 1;
+  int size = (count + radius_ * 2 + window - 1) / window * window;
+  uint8_t* line = line_.data();
+  uint8_t* prefix = prefix_.data();
+  uint8_t* suffix = suffix_.data();
+
+  memset(line, neutral, size);
+  for (int i = 0; i < count; ++i)
+    line[radius_ + i] = data[i * stride];
+
+  for (int start = 0; start < size; start += window) {
+    int end = start + window - 1;
+    prefix[start] = line[start];
+    for (int i = start + 1; i <= end; ++i)
+      prefix[i] = op(prefix[i - 1], line[i]);
+    suffix[end] = line[end];
+    for (int i = end - 1; i >= start; --i)
+      suffix[i] = op(suffix[i + 1], line[i]);
+  }
+
+  for (int i = 0; i < count; ++i)
+    data[i * stride] = op(suffix[i], prefix[i + window - 1]);
+}
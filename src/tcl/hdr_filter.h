@@ -0,0 +1,51 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef TCL_HDR_FILTER_H_
+#define TCL_HDR_FILTER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "tcl/tcl_types.h"
+#include "util/led_layout.h"
+
+// Stretches luminance and/or saturation of each LED to the full range,
+// based on the min and max values of LED's around it.
+//
+// LED values are rasterized into a coarse grid over layout coordinates.
+// Neighborhood min and max are then computed with separable van Herk/
+// Gil-Werman filters, so the cost does not depend on the HDR distance.
+// The neighborhood is a square of roughly 2 * |distance| on each side.
+class HdrFilter {
+ public:
+  HdrFilter(const std::vector<LedCoord>& coords, int distance);
+
+  // Expects |strands| in HSL format, with LED's in |coords| order.
+  void Apply(LedStrands* strands, HdrMode mode);
+
+ private:
+  HdrFilter(const HdrFilter& src);
+  HdrFilter& operator=(const HdrFilter& rhs);
+
+  template<class Op>
+  void FilterPlane(std::vector<uint8_t>* plane, uint8_t neutral, Op op);
+
+  template<class Op>
+  void FilterLine(uint8_t* data, int count, int stride,
+                  uint8_t neutral, Op op);
+
+  int grid_w_ = 0;
+  int grid_h_ = 0;
+  int radius_ = 0;
+  std::vector<uint32_t> led_cells_;
+  std::vector<uint8_t> l_min_;
+  std::vector<uint8_t> l_max_;
+  std::vector<uint8_t> s_min_;
+  std::vector<uint8_t> s_max_;
+  std::vector<uint8_t> line_;
+  std::vector<uint8_t> prefix_;
+  std::vector<uint8_t> suffix_;
+};
+
+#endif  // TCL_HDR_FILTER_H_
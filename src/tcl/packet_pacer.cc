@@ -0,0 +1,43 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "tcl/packet_pacer.h"
+
+#include "util/lock.h"
+#include "util/time.h"
+
+PacketPacer::PacketPacer()
+    : gaps_(kGapBucketUs, kGapBucketCount),
+      gaps_lock_(PTHREAD_MUTEX_INITIALIZER) {}
+
+PacketPacer::~PacketPacer() {
+  pthread_mutex_destroy(&gaps_lock_);
+}
+
+void PacketPacer::Start() {
+  last_packet_us_ = GetCurrentMicros();
+}
+
+void PacketPacer::WaitGap(int gap_us) {
+  // Deadlines are counted from the actual previous packet, not from the
+  // previous deadline, so a late wakeup never shortens the next gap.
+  uint64_t deadline = last_packet_us_ + gap_us;
+  if (deadline > last_packet_us_ + spin_us_)
+    SleepUntilMicros(deadline - spin_us_);
+
+  uint64_t now = GetCurrentMicros();
+  while (now < deadline)
+    now = GetCurrentMicros();
+
+  {
+    Autolock l(gaps_lock_);
+    gaps_.Add(now - last_packet_us_);
+  }
+  last_packet_us_ = now;
+}
+
+std::vector<int> PacketPacer::GetAndClearGapHistogram() {
+  Autolock l(gaps_lock_);
+  std::vector<int> result = gaps_.counts();
+  gaps_.Clear();
+  return result;
+}
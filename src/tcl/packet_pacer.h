@@ -0,0 +1,49 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef TCL_PACKET_PACER_H_
+#define TCL_PACKET_PACER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "util/histogram.h"
+
+// Spaces out UDP packets by sleeping until absolute deadlines, measured
+// from the previous packet. Optionally busy-spins for the last
+// microseconds of each gap to avoid the wakeup latency of the kernel.
+// Achieved gaps are recorded into a histogram.
+class PacketPacer {
+ public:
+  // Histogram resolution, in microseconds.
+  static const int kGapBucketUs = 50;
+  static const int kGapBucketCount = 80;
+
+  PacketPacer();
+  ~PacketPacer();
+
+  // Sets the duration to busy-spin at the end of each gap. 0 disables it.
+  void set_spin_us(int spin_us) { spin_us_ = spin_us; }
+
+  // Marks the time of the first packet in a sequence.
+  void Start();
+
+  // Waits until |gap_us| passed since the previous packet,
+  // and marks the time of the next packet.
+  void WaitGap(int gap_us);
+
+  // Returns counts of achieved gaps, in kGapBucketUs buckets.
+  std::vector<int> GetAndClearGapHistogram();
+
+ private:
+  PacketPacer(const PacketPacer& src);
+  PacketPacer& operator=(const PacketPacer& rhs);
+
+  int spin_us_ = 0;
+  uint64_t last_packet_us_ = 0;
+  Histogram gaps_;
+  pthread_mutex_t gaps_lock_;
+};
+
+#endif  // TCL_PACKET_PACER_H_
@@ -29,20 +29,32 @@ const int kMgsDataDelayUs = 1500;
 const int kFrameSendDurationUs =
     kMgsStartDelayUs + kMgsDataDelayUs * (kControllerFrameLength / 1024);
 
+// TODO(igorc): Compute max distance instead of hard-coding.
+const int kHdrDistance = 13;
+
 }  // namespace
 
 TclController::TclController(
     int id, int width, int height, int fps, const LedLayout& layout,
     double gamma)
-    : id_(id), width_(width), height_(height), fps_(fps), layout_(layout),
-      layout_map_(width, height), effects_lock_(PTHREAD_MUTEX_INITIALIZER) {
+    : id_(id), width_(width), height_(height), fps_(fps),
+      init_status_(INIT_STATUS_UNUSED), layout_(layout),
+      layout_map_(width, height), frame_encoder_(kControllerStrandLength),
+      start_gap_us_(kMgsStartDelayUs), data_gap_us_(kMgsDataDelayUs),
+      lock_(PTHREAD_MUTEX_INITIALIZER), build_lock_(PTHREAD_MUTEX_INITIALIZER),
+      effects_lock_(PTHREAD_MUTEX_INITIALIZER) {
+  CHECK(frame_encoder_.frame_length() == kControllerFrameLength);
   SetGammaRanges(0, 255, gamma, 0, 255, gamma, 0, 255, gamma);
   layout_map_.PopulateLayoutMap(layout_);
+  hdr_filter_.reset(
+      new HdrFilter(layout_map_.GetLayoutCoords(), kHdrDistance));
 }
 
 TclController::~TclController() {
   CloseSocket();
   pthread_mutex_destroy(&effects_lock_);
+  pthread_mutex_destroy(&build_lock_);
+  pthread_mutex_destroy(&lock_);
 }
 
 int TclController::GetFrameSendDurationMs() {
@@ -68,25 +80,69 @@ void TclController::ScheduleReset() {
 }
 
 std::unique_ptr<RgbaImage> TclController::GetAndClearLastImage() {
-  return last_image_.CloneAndClear(true);
+  // Alpha is erased only here, so that building frames does not need
+  // to copy the shared image.
+  std::unique_ptr<RgbaImage> result;
+  {
+    Autolock l(lock_);
+    result = last_image_.CloneAndClear(true);
+  }
+  if (result)
+    EraseAlpha(result->mutable_data(), width_, height_);
+  return result;
 }
 
 std::unique_ptr<RgbaImage> TclController::GetAndClearLastLedImage() {
+  Autolock l(lock_);
   return last_led_pixel_snapshot_.CloneAndClear(true);
 }
 
+int TclController::GetLastImageId() {
+  Autolock l(lock_);
+  return last_image_id_;
+}
+
 void TclController::SetGammaRanges(
     int r_min, int r_max, double r_gamma,
     int g_min, int g_max, double g_gamma,
     int b_min, int b_max, double b_gamma) {
+  Autolock l(lock_);
   gamma_.SetGammaRanges(
       r_min, r_max, r_gamma, g_min, g_max, g_gamma, b_min, b_max, b_gamma);
+  gamma_changed_ = true;
 }
 
 void TclController::SetHdrMode(HdrMode mode) {
+  Autolock l(lock_);
   hdr_mode_ = mode;
 }
 
+void TclController::UpdateBuildSettings() {
+  Autolock l(lock_);
+  build_hdr_mode_ = hdr_mode_;
+  if (gamma_changed_) {
+    build_gamma_ = gamma_;
+    gamma_changed_ = false;
+  }
+}
+
+void TclController::SetAddress(const std::string& host, int port) {
+  CloseSocket();
+  host_ = host;
+  port_ = port;
+}
+
+void TclController::SetPacketPacing(
+    int start_gap_us, int data_gap_us, int spin_us) {
+  start_gap_us_ = start_gap_us;
+  data_gap_us_ = data_gap_us;
+  pacer_.set_spin_us(spin_us);
+}
+
+std::vector<int> TclController::GetAndClearPacketGapHistogram() {
+  return pacer_.GetAndClearGapHistogram();
+}
+
 void TclController::StartEffect(Effect* effect, int priority) {
   Autolock l(effects_lock_);
   effect->Initialize(width_, height_, fps_, layout_);
@@ -126,35 +182,47 @@ void TclController::ApplyEffectsOnLeds(LedStrands* strands) {
 
 void TclController::BuildFrameDataForImage(
     std::vector<uint8_t>* dst, RgbaImage* image, int id, InitStatus* status) {
+  Autolock bl(build_lock_);
   dst->clear();
   *status = init_status_;
 
+  FrameTrace* trace = image->mutable_trace();
   ApplyEffectsOnImage(image);
+  trace->Mark(FRAME_STAGE_EFFECTS);
 
-  std::unique_ptr<LedStrands> strands = ConvertImageToLedStrands(*image);
+  std::unique_ptr<LedStrands> strands =
+      ConvertImageToLedStrands(*image, trace);
   if (!strands)
     return;
 
   ConvertLedStrandsToFrame(dst, *strands.get());
-
-  last_image_id_ = id;
-  last_image_ = *image;
-  EraseAlpha(last_image_.data(), width_, height_);
+  trace->Mark(FRAME_STAGE_ENCODED);
 
   // Only show when OK, to make reset status more obvious.
+  RgbaImage led_image;
   if (init_status_ == INIT_STATUS_OK)
-    SavePixelsForLedStrands(*strands.get());
+    SavePixelsForLedStrands(*strands.get(), &led_image);
+
+  Autolock l(lock_);
+  last_image_id_ = id;
+  last_image_ = *image;
+  if (!led_image.empty())
+    last_led_pixel_snapshot_ = led_image;
 }
 
 std::unique_ptr<LedStrands> TclController::ConvertImageToLedStrands(
-    const RgbaImage& image) {
+    const RgbaImage& image, FrameTrace* trace) {
+  UpdateBuildSettings();
+
   std::unique_ptr<LedStrands> strands(new LedStrands(layout_map_));
   if (!PopulateLedStrandsColors(strands.get(), image))
     return nullptr;
+  trace->Mark(FRAME_STAGE_SAMPLED);
 
   strands->ConvertTo(LedStrands::TYPE_HSL);
 
   PerformHdr(strands.get());
+  trace->Mark(FRAME_STAGE_HDR);
 
   // TODO(igorc): Adjust S and L through a user-controlled gamma curve.
 
@@ -162,19 +230,21 @@ std::unique_ptr<LedStrands> TclController::ConvertImageToLedStrands(
 
   ApplyEffectsOnLeds(strands.get());
 
+  // Gamma is applied by the frame encoder, to preserve linear
+  // RGB-HSL conversions and to avoid a separate pass over colors.
   strands->ConvertTo(LedStrands::TYPE_RGB);
-
-  // Apply gamma at the end to preserve linear RGB-HSL conversions.
-  ApplyLedStrandsGamma(strands.get());
   return strands;
 }
 
 std::vector<uint8_t> TclController::GetFrameDataForTest(
     const RgbaImage& image) {
+  Autolock bl(build_lock_);
   std::vector<uint8_t> result;
   if (image.empty())
     return result;
-  std::unique_ptr<LedStrands> strands = ConvertImageToLedStrands(image);
+  FrameTrace trace;
+  std::unique_ptr<LedStrands> strands =
+      ConvertImageToLedStrands(image, &trace);
   if (!strands)
     return result;
   ConvertLedStrandsToFrame(&result, *strands.get());
@@ -183,206 +253,81 @@ std::vector<uint8_t> TclController::GetFrameDataForTest(
 
 bool TclController::PopulateLedStrandsColors(
     LedStrands* strands, const RgbaImage& image) {
+  if (image.width() != width_ || image.height() != height_) {
+    fprintf(stderr, "Unexpected image size %dx%d, expected %dx%d\n",
+            image.width(), image.height(), width_, height_);
+    return false;
+  }
+
+  const std::vector<LedRange>& ranges = layout_map_.GetSampleRanges();
+  const uint32_t* offsets = layout_map_.GetSampleOffsets().data();
+  CHECK(static_cast<int>(ranges.size()) == strands->GetTotalLedCount());
+
   const uint8_t* image_data = image.data();
-  int image_len = RGBA_LEN(width_, height_);
-  for (int strand_id  = 0; strand_id < strands->GetStrandCount(); ++strand_id) {
-    int strand_len = strands->GetLedCount(strand_id);
-    uint8_t* dst_colors = strands->GetColorData(strand_id);
-    for (int led_id = 0; led_id < strand_len; ++led_id) {
-      const std::vector<LedCoord> coords =
-          layout_map_.GetLedCoords(strand_id, led_id);
-      uint32_t coord_count = coords.size();
-      if (!coord_count)
-        continue;
-
-      uint32_t r1 = 0, g1 = 0, b1 = 0, c1 = 0;
-      uint32_t r2 = 0, g2 = 0, b2 = 0, c2 = 0;
-      for (uint32_t c_id = 0; c_id < coord_count; ++c_id) {
-        int x = coords[c_id].x;
-        int y = coords[c_id].y;
-        int color_idx = (y * width_ + x) * 4;
-        if (color_idx < 0 || (color_idx + 4) > image_len) {
-          fprintf(stderr,
-                  "Not enough data in image. Accessing %d, len=%d, strand=%d, "
-                  "led=%d, x=%d, y=%d\n",
-                  color_idx, image_len, strand_id, led_id, x, y);
-          return false;
-        }
-        if (image_data[color_idx + 3] == 255) {
-          r1 += image_data[color_idx];
-          g1 += image_data[color_idx + 1];
-          b1 += image_data[color_idx + 2];
-          c1++;
-        } else {
-          r2 += image_data[color_idx];
-          g2 += image_data[color_idx + 1];
-          b2 += image_data[color_idx + 2];
-          c2++;
-        }
-      }
-
-      if (c1 && c1 >= coord_count / 2) {
-        r1 = (r1 / c1) & 0xFF;
-        g1 = (g1 / c1) & 0xFF;
-        b1 = (b1 / c1) & 0xFF;
-      } else if (c2) {
-        r1 = (r2 / c2) & 0xFF;
-        g1 = (g2 / c2) & 0xFF;
-        b1 = (b2 / c2) & 0xFF;
-      } else {
-        r1 = 0;
-        g1 = 0;
-        b1 = 0;
-      }
-
-      uint32_t color = PACK_COLOR32(r1, g1, b1, 255);
-
-      int dst_idx = led_id * 4;
-      *((uint32_t*) (dst_colors + dst_idx)) = color;
+  uint8_t* dst_colors = strands->GetAllColorData();
+  for (size_t led_idx = 0; led_idx < ranges.size(); ++led_idx) {
+    uint32_t coord_count = ranges[led_idx].count;
+    if (!coord_count)
+      continue;
+
+    // Opaque pixels are accumulated in sums[1], the rest in sums[0].
+    // Each entry is {r, g, b, count}.
+    uint32_t sums[2][4] = {{0, 0, 0, 0}, {0, 0, 0, 0}};
+    const uint32_t* led_offsets = offsets + ranges[led_idx].start;
+    for (uint32_t c_id = 0; c_id < coord_count; ++c_id) {
+      const uint8_t* pixel = image_data + led_offsets[c_id];
+      uint32_t* sum = sums[pixel[3] == 255];
+      sum[0] += pixel[0];
+      sum[1] += pixel[1];
+      sum[2] += pixel[2];
+      sum[3]++;
+    }
+
+    uint32_t r = 0, g = 0, b = 0;
+    uint32_t c1 = sums[1][3];
+    const uint32_t* sum = nullptr;
+    if (c1 && c1 >= coord_count / 2) {
+      sum = sums[1];
+    } else if (sums[0][3]) {
+      sum = sums[0];
+    }
+    if (sum) {
+      r = (sum[0] / sum[3]) & 0xFF;
+      g = (sum[1] / sum[3]) & 0xFF;
+      b = (sum[2] / sum[3]) & 0xFF;
     }
-  }
-  return true;
-}
 
-void TclController::ApplyLedStrandsGamma(LedStrands* strands) {
-  uint8_t* all_colors = strands->GetAllColorData();
-  for (int i = 0; i < strands->GetTotalLedCount(); ++i) {
-    uint32_t* color = (uint32_t*) (all_colors + i * 4);
-    *color = gamma_.Apply(*color);
+    uint32_t color = PACK_COLOR32(r, g, b, 255);
+    *((uint32_t*) (dst_colors + led_idx * 4)) = color;
   }
+  return true;
 }
 
-void TclController::SavePixelsForLedStrands(const LedStrands& strands) {
-  uint8_t* led_image_data = new uint8_t[RGBA_LEN(width_, height_)];
+void TclController::SavePixelsForLedStrands(
+    const LedStrands& strands, RgbaImage* dst) {
+  dst->ResizeStorage(width_, height_);
+  uint8_t* led_image_data = dst->mutable_data();
   memset(led_image_data, 0, RGBA_LEN(width_, height_));
-  for (int strand_id  = 0; strand_id < strands.GetStrandCount(); ++strand_id) {
-    int strand_len = strands.GetLedCount(strand_id);
-    const uint8_t* colors = strands.GetColorData(strand_id);
-    for (int led_id = 0; led_id < strand_len; ++led_id) {
-      const std::vector<LedCoord>& coords =
-          layout_map_.GetLedCoords(strand_id, led_id);
-      uint32_t color = *((uint32_t*) (colors + led_id * 4));
-      for (size_t c_id = 0; c_id < coords.size(); ++c_id) {
-        int x = coords[c_id].x;
-        int y = coords[c_id].y;
-        int color_idx = (y * width_ + x) * 4;
-        *((uint32_t*) (led_image_data + color_idx)) = color;
-      }
-    }
+  const std::vector<LedRange>& ranges = layout_map_.GetSampleRanges();
+  const uint32_t* offsets = layout_map_.GetSampleOffsets().data();
+  const uint8_t* colors = strands.GetAllColorData();
+  for (size_t led_idx = 0; led_idx < ranges.size(); ++led_idx) {
+    uint32_t color = build_gamma_.Apply(
+        *((const uint32_t*) (colors + led_idx * 4)));
+    const uint32_t* led_offsets = offsets + ranges[led_idx].start;
+    for (uint32_t c_id = 0; c_id < ranges[led_idx].count; ++c_id)
+      *((uint32_t*) (led_image_data + led_offsets[c_id])) = color;
   }
-  last_led_pixel_snapshot_.Set(led_image_data, width_, height_);
-  delete[] led_image_data;
 }
 
-// Extrapolates value to a range from 0 to 255.
-#define EXTEND256(value, min, max)   \
-  ((max) == (min) ? (max) :          \
-      ((255 * ((value) - (min)) / ((max) - (min))) & 0xFF))
-
 void TclController::PerformHdr(LedStrands* strands) {
-  if (hdr_mode_ == HDR_MODE_NONE)
-    return;
-
-  uint8_t* res_colors[strands->GetStrandCount()];
-  for (int i = 0; i < strands->GetStrandCount(); ++i) {
-    res_colors[i] = new uint8_t[strands->GetLedCount(i) * 4];
-  }
-
-  // Populate resulting colors with HDR image.
-  for (int strand_id  = 0; strand_id < strands->GetStrandCount(); ++strand_id) {
-    int strand_len = strands->GetLedCount(strand_id);
-    const uint8_t* src_strand_colors = strands->GetColorData(strand_id);
-    for (int led_id = 0; led_id < strand_len; ++led_id) {
-      uint32_t l_min = 255, l_max = 0, s_min = 255, s_max = 0;
-      const std::vector<LedAddress>& siblings =
-          layout_map_.GetHdrSiblings(strand_id, led_id);
-      size_t siblings_size = siblings.size();
-      const LedAddress* siblings_data = siblings.data();
-      const uint8_t* src_color = src_strand_colors + led_id * 4;
-      uint8_t* res_color = res_colors[strand_id] + led_id * 4;
-      for (size_t i = 0; i < siblings_size; ++i) {
-        uint8_t* hls = strands->GetColorData(siblings_data[i].strand_id) +
-            siblings_data[i].led_id * 4;
-        uint8_t l = hls[1];
-        uint8_t s = hls[2];
-        if (l < l_min) {
-          l_min = l;
-        }
-        if (l > l_max) {
-          l_max = l;
-        }
-        if (s < s_min) {
-          s_min = s;
-        }
-        if (s > s_max) {
-          s_max = s;
-        }
-      }
-      // Always preserve the hue and alpha.
-      res_color[0] = src_color[0];
-      if (hdr_mode_ == HDR_MODE_LUM_SAT ||
-	  hdr_mode_ == HDR_MODE_LUM) {
-        res_color[1] = EXTEND256(src_color[1], l_min, l_max);
-      } else {
-        res_color[1] = src_color[1];
-      }
-      if (hdr_mode_ == HDR_MODE_LUM_SAT ||
-	  hdr_mode_ == HDR_MODE_SAT) {
-        res_color[2] = EXTEND256(src_color[2], s_min, s_max);
-      } else {
-        res_color[2] = src_color[2];
-      }
-      res_color[3] = src_color[3];
-    }
-  }
-
-  // Copy resulting colors back to the strand.
-  for (int strand_id  = 0; strand_id < strands->GetStrandCount(); ++strand_id) {
-    int strand_len = strands->GetLedCount(strand_id);
-    memcpy(strands->GetColorData(strand_id), res_colors[strand_id],
-           strand_len * 4);
-  }
-
-  for (int i = 0; i < strands->GetStrandCount(); ++i)
-    delete[] res_colors[i];
+  hdr_filter_->Apply(strands, build_hdr_mode_);
 }
 
 void TclController::ConvertLedStrandsToFrame(
     std::vector<uint8_t>* dst, const LedStrands& strands) {
   dst->resize(kControllerFrameLength);
-  int pos = 0;
-  for (int led_id = 0; led_id < kControllerStrandLength; led_id++) {
-    pos += BuildFrameColorSeq(&(*dst)[pos], strands, led_id, 2);
-    pos += BuildFrameColorSeq(&(*dst)[pos], strands, led_id, 1);
-    pos += BuildFrameColorSeq(&(*dst)[pos], strands, led_id, 0);
-  }
-  CHECK(pos == kControllerFrameLength);
-  for (int i = 0; i < kControllerFrameLength; i++) {
-    // Black color is offset by 0x2C.
-    (*dst)[i] = ((*dst)[i] + 0x2C) & 0xFF;
-  }
-}
-
-int TclController::BuildFrameColorSeq(
-    uint8_t* dst, const LedStrands& strands, int led_id, int color_component) {
-  int pos = 0;
-  int color_bit_mask = 0x80;
-  while (color_bit_mask > 0) {
-    uint8_t dst_byte = 0;
-    for (int strand_id  = 0; strand_id < strands.GetStrandCount();
-	 strand_id++) {
-      if (led_id >= strands.GetLedCount(strand_id))
-        continue;
-      const uint8_t* colors = strands.GetColorData(strand_id);
-      uint8_t color = colors[led_id * 4 + color_component];
-      if ((color & color_bit_mask) != 0)
-        dst_byte |= 1 << strand_id;
-    }
-    color_bit_mask >>= 1;
-    dst[pos++] = dst_byte;
-  }
-  CHECK(pos == 8);
-  return pos;
+  frame_encoder_.Encode(strands, &build_gamma_, dst->data());
 }
 
 void TclController::CloseSocket() {
@@ -420,12 +365,16 @@ bool TclController::Connect() {
   }
 
   char addr_str[65];
-  snprintf(addr_str, sizeof(addr_str), "192.168.60.%d", (49 + id_));
+  if (host_.empty()) {
+    snprintf(addr_str, sizeof(addr_str), "192.168.60.%d", (49 + id_));
+  } else {
+    snprintf(addr_str, sizeof(addr_str), "%s", host_.c_str());
+  }
 
   struct sockaddr_in si_remote;
   memset(&si_remote, 0, sizeof(si_remote));
   si_remote.sin_family = AF_INET;
-  si_remote.sin_port = htons(5000);
+  si_remote.sin_port = htons(port_);
   if (inet_aton(addr_str, &si_remote.sin_addr) == 0) {
     fprintf(stderr, "inet_aton() failed\n");
     CloseSocket();
@@ -505,7 +454,7 @@ InitStatus TclController::InitController() {
   return init_status_;
 }
 
-bool TclController::SendFrame(const uint8_t* frame_data) {
+bool TclController::SendFrame(const uint8_t* frame_data, FrameTrace* trace) {
   static const uint8_t MSG_START_FRAME[] = {0xC5, 0x77, 0x88, 0x00, 0x00};
   static const uint8_t MSG_END_FRAME[] = {0xAA, 0x01, 0x8C, 0x01, 0x55};
   static const uint8_t FRAME_MSG_PREFIX[] = {
@@ -513,12 +462,12 @@ bool TclController::SendFrame(const uint8_t* frame_data) {
       0x60, 0x8B, 0x95, 0xEF, 0x04, 0x69};
   static const uint8_t FRAME_MSG_SUFFIX[] = {0x00, 0x00, 0x00, 0x00};
 
-  // uint64_t start_time = GetCurrentMillis();
-  // int total_delay = kMgsStartDelayUs;
   ConsumeReplyData();
+  pacer_.Start();
   if (!SendPacket(MSG_START_FRAME, sizeof(MSG_START_FRAME)))
     return false;
-  SleepUs(kMgsStartDelayUs);
+  trace->Mark(FRAME_STAGE_FIRST_PACKET);
+  pacer_.WaitGap(start_gap_us_);
 
   uint8_t packet[sizeof(FRAME_MSG_PREFIX) + 1024 + sizeof(FRAME_MSG_SUFFIX)];
   memcpy(packet, FRAME_MSG_PREFIX, sizeof(FRAME_MSG_PREFIX));
@@ -535,19 +484,16 @@ bool TclController::SendFrame(const uint8_t* frame_data) {
 
     if (!SendPacket(packet, sizeof(packet)))
       return false;
-    SleepUs(kMgsDataDelayUs);
-    // total_delay += kMgsDataDelayUs;
+    pacer_.WaitGap(data_gap_us_);
   }
   CHECK(frame_data_pos == kControllerFrameLength);
   CHECK(message_idx == 12);
 
   if (!SendPacket(MSG_END_FRAME, sizeof(MSG_END_FRAME)))
     return false;
+  trace->Mark(FRAME_STAGE_LAST_PACKET);
   ConsumeReplyData();
   frames_sent_after_reply_++;
-  // uint64_t delay = GetCurrentMillis() - start_time;
-  // fprintf(stderr, "Wanted to wait for %d, waited for %d\n",
-  //         total_delay, (int) delay * 1000);
   return true;
 }
 
@@ -7,10 +7,16 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <atomic>
 #include <memory>
+#include <string>
 #include <vector>
 
+#include "tcl/frame_encoder.h"
+#include "tcl/hdr_filter.h"
+#include "tcl/packet_pacer.h"
 #include "tcl/tcl_types.h"
+#include "util/frame_trace.h"
 #include "util/led_layout.h"
 #include "util/pixels.h"
 
@@ -32,7 +38,7 @@ class TclController {
 
   std::unique_ptr<RgbaImage> GetAndClearLastImage();
   std::unique_ptr<RgbaImage> GetAndClearLastLedImage();
-  int last_image_id() const { return last_image_id_; }
+  int GetLastImageId();
 
   void StartEffect(Effect* effect, int priority);
 
@@ -45,8 +51,12 @@ class TclController {
   void UpdateAutoReset(uint64_t auto_reset_after_no_data_ms);
   void ScheduleReset();
   InitStatus InitController();
-  bool SendFrame(const uint8_t* frame_data);
+  // Marks packet stages in |trace|.
+  bool SendFrame(const uint8_t* frame_data, FrameTrace* trace);
 
+  // Builds frame data for the image, and marks build stages in its trace.
+  // Does not block API calls on this controller, except for
+  // GetFrameDataForTest().
   void BuildFrameDataForImage(
       std::vector<uint8_t>* dst, RgbaImage* img, int id, InitStatus* status);
 
@@ -54,6 +64,19 @@ class TclController {
 
   void SetHdrMode(HdrMode mode);
 
+  // Overrides the default address of 192.168.60.(49 + id):5000,
+  // e.g. to talk to an emulator. Must not be called while sending.
+  void SetAddress(const std::string& host, int port);
+
+  // Sets delays after the start packet and after each data packet,
+  // and the duration to busy-spin at the end of each delay.
+  // Must not be called while frames are being sent.
+  void SetPacketPacing(int start_gap_us, int data_gap_us, int spin_us);
+
+  // Returns counts of achieved packet gaps, in buckets
+  // of PacketPacer::kGapBucketUs.
+  std::vector<int> GetAndClearPacketGapHistogram();
+
   static int GetFrameSendDurationMs();
 
  private:
@@ -77,15 +100,14 @@ class TclController {
 
   bool PopulateLedStrandsColors(
       LedStrands* strands, const RgbaImage& image);
-  void SavePixelsForLedStrands(const LedStrands& strands);
+  void SavePixelsForLedStrands(const LedStrands& strands, RgbaImage* dst);
+  void UpdateBuildSettings();
   void PerformHdr(LedStrands* strands);
-  void ApplyLedStrandsGamma(LedStrands* strands);
 
-  std::unique_ptr<LedStrands> ConvertImageToLedStrands(const RgbaImage& image);
+  std::unique_ptr<LedStrands> ConvertImageToLedStrands(
+      const RgbaImage& image, FrameTrace* trace);
   void ConvertLedStrandsToFrame(
       std::vector<uint8_t>* dst, const LedStrands& strands);
-  int BuildFrameColorSeq(
-      uint8_t* dst, const LedStrands& strands, int led_id, int color_component);
 
   bool Connect();
   void CloseSocket();
@@ -100,23 +122,44 @@ class TclController {
   int width_;
   int height_;
   int fps_;
-  // TODO(igorc): Do atomic read.
-  volatile InitStatus init_status_ = INIT_STATUS_UNUSED;
-  RgbGamma gamma_;
+  // Written by the sender thread, read by the build stage and API calls.
+  std::atomic<InitStatus> init_status_;
   LedLayout layout_;
   LedLayoutMap layout_map_;
+  FrameEncoder frame_encoder_;
+  std::unique_ptr<HdrFilter> hdr_filter_;
   int socket_ = -1;
+  std::string host_;
+  int port_ = 5000;
+  int start_gap_us_;
+  int data_gap_us_;
+  PacketPacer pacer_;
   bool require_reset_ = true;
   uint64_t last_reply_time_ = 0;
   uint64_t reset_start_time_ = 0;
+  int frames_sent_after_reply_ = 0;
+
+  // Guards settings and results shared between frame building
+  // and API calls. Held only for short periods.
+  pthread_mutex_t lock_;
+  RgbGamma gamma_;
+  bool gamma_changed_ = true;
+  HdrMode hdr_mode_ = HDR_MODE_NONE;
   RgbaImage last_image_;
   RgbaImage last_led_pixel_snapshot_;
   int last_image_id_ = 0;
-  int frames_sent_after_reply_ = 0;
-  HdrMode hdr_mode_ = HDR_MODE_NONE;
+
+  // Serializes frame building, which uses internal scratch buffers.
+  // Settings are copied from the shared ones at the start of each build.
+  pthread_mutex_t build_lock_;
+  RgbGamma build_gamma_;
+  HdrMode build_hdr_mode_ = HDR_MODE_NONE;
 
   pthread_mutex_t effects_lock_;
   EffectList effects_;
+
+  // Times the individual build stages.
+  friend class TclControllerBench;
 };
 
 #endif  // TCL_TCL_CONTROLLER_H_
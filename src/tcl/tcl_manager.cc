@@ -2,21 +2,31 @@
 
 #include "tcl/tcl_manager.h"
 
+#include <errno.h>
 #include <string.h>
 
+#include "tcl/frame_mailbox.h"
 #include "tcl/tcl_controller.h"
+#include "tcl/tcl_sender.h"
+#include "util/frame_trace.h"
 #include "util/lock.h"
 #include "util/logging.h"
 #include "util/time.h"
 
 namespace {
 
+const int kDefaultSenderPriority = 10;
+
 }  // namespace
 
 TclManager::TclManager()
     : lock_(PTHREAD_MUTEX_INITIALIZER),
       cond_(PTHREAD_COND_INITIALIZER) {
   base_time_ = GetCurrentMillis();
+  if (sem_init(&mailbox_sem_, 0, 0) == -1) {
+    REPORT_ERRNO("sem_init");
+    CHECK(false);
+  }
 }
 
 TclManager::~TclManager() {
@@ -26,17 +36,30 @@ TclManager::~TclManager() {
       is_shutting_down_ = true;
       pthread_cond_broadcast(&cond_);
     }
+    sem_post(&mailbox_sem_);
 
     pthread_join(thread_, nullptr);
   }
 
   ResetImageQueue();
 
+  for (std::vector<FrameMailbox*>::iterator it = mailboxes_.begin();
+        it != mailboxes_.end(); ++it) {
+    delete (*it);
+  }
+
+  // Senders use controllers, and are stopped first.
+  for (std::vector<TclSender*>::iterator it = senders_.begin();
+        it != senders_.end(); ++it) {
+    delete (*it);
+  }
+
   for (std::vector<TclController*>::iterator it = controllers_.begin();
         it != controllers_.end(); ++it) {
     delete (*it);
   }
 
+  sem_destroy(&mailbox_sem_);
   pthread_cond_destroy(&cond_);
   pthread_mutex_destroy(&lock_);
 }
@@ -50,6 +73,10 @@ void TclManager::AddController(
   TclController* controller = new TclController(
       id, width, height, fps_, layout, gamma);
   controllers_.push_back(controller);
+  TclSender* sender = new TclSender(controller);
+  sender->SetPriority(kDefaultSenderPriority);
+  senders_.push_back(sender);
+  mailboxes_.push_back(new FrameMailbox());
 }
 
 TclController* TclManager::FindControllerLocked(int id) {
@@ -61,11 +88,48 @@ TclController* TclManager::FindControllerLocked(int id) {
   return nullptr;
 }
 
+// Controllers are not changed after LockControllers(),
+// so this can be called without holding lock_.
+int TclManager::FindControllerIndex(int id) const {
+  CHECK(controllers_locked_);
+  for (size_t i = 0; i < controllers_.size(); ++i) {
+    if (controllers_[i]->id() == id)
+      return i;
+  }
+  return -1;
+}
+
+TclSender* TclManager::FindSenderLocked(TclController* controller) {
+  for (size_t i = 0; i < controllers_.size(); ++i) {
+    if (controllers_[i] == controller)
+      return senders_[i];
+  }
+  return nullptr;
+}
+
 void TclManager::LockControllers() {
   Autolock l(lock_);
   controllers_locked_ = true;
 }
 
+void TclManager::SetFrameMailboxMode(bool enable) {
+  Autolock l(lock_);
+  CHECK(!controllers_locked_);
+  use_mailboxes_ = enable;
+}
+
+void TclManager::SetSenderPriority(int controller_id, int priority) {
+  Autolock l(lock_);
+  CHECK(!has_started_thread_);
+  TclSender* sender = FindSenderLocked(FindControllerLocked(controller_id));
+  if (!sender) {
+    fprintf(stderr, "Ignoring TclManager::SetSenderPriority on %d\n",
+            controller_id);
+    return;
+  }
+  sender->SetPriority(priority);
+}
+
 bool TclManager::GetControllerImageSize(int controller_id, int* w, int* h) {
   Autolock l(lock_);
   TclController* controller = FindControllerLocked(controller_id);
@@ -76,6 +140,32 @@ bool TclManager::GetControllerImageSize(int controller_id, int* w, int* h) {
   return true;
 }
 
+void TclManager::SetControllerAddress(
+    int controller_id, const std::string& host, int port) {
+  Autolock l(lock_);
+  CHECK(!has_started_thread_);
+  TclController* controller = FindControllerLocked(controller_id);
+  if (!controller) {
+    fprintf(stderr, "Ignoring TclManager::SetControllerAddress on %d\n",
+            controller_id);
+    return;
+  }
+  controller->SetAddress(host, port);
+}
+
+void TclManager::SetPacketPacing(
+    int controller_id, int start_gap_us, int data_gap_us, int spin_us) {
+  Autolock l(lock_);
+  CHECK(!has_started_thread_);
+  TclController* controller = FindControllerLocked(controller_id);
+  if (!controller) {
+    fprintf(stderr, "Ignoring TclManager::SetPacketPacing on %d\n",
+            controller_id);
+    return;
+  }
+  controller->SetPacketPacing(start_gap_us, data_gap_us, spin_us);
+}
+
 void TclManager::StartMessageLoop(int fps, bool enable_net) {
   Autolock l(lock_);
   CHECK(controllers_locked_);
@@ -85,6 +175,13 @@ void TclManager::StartMessageLoop(int fps, bool enable_net) {
   enable_net_ = enable_net;
   has_started_thread_ = true;
 
+  if (enable_net_) {
+    for (std::vector<TclSender*>::iterator it = senders_.begin();
+          it != senders_.end(); ++it) {
+      (*it)->Start();
+    }
+  }
+
   int err = pthread_create(&thread_, nullptr, &ThreadEntry, this);
   if (err != 0) {
     fprintf(stderr, "pthread_create failed with %d\n", err);
@@ -117,6 +214,28 @@ void TclManager::SetHdrMode(HdrMode mode) {
 void TclManager::SetAutoResetAfterNoDataMs(int value) {
   Autolock l(lock_);
   auto_reset_after_no_data_ms_ = value;
+  for (std::vector<TclSender*>::iterator it = senders_.begin();
+        it != senders_.end(); ++it) {
+    (*it)->SetAutoResetAfterNoDataMs(value);
+  }
+}
+
+void TclManager::SetSkipUnchangedFrames(bool enable, int keepalive_ms) {
+  Autolock l(lock_);
+  for (std::vector<TclSender*>::iterator it = senders_.begin();
+        it != senders_.end(); ++it) {
+    (*it)->SetSkipUnchangedFrames(enable, keepalive_ms);
+  }
+}
+
+int TclManager::GetAndClearSkippedFrameCount() {
+  Autolock l(lock_);
+  int result = 0;
+  for (std::vector<TclSender*>::iterator it = senders_.begin();
+        it != senders_.end(); ++it) {
+    result += (*it)->GetAndClearSkippedFrameCount();
+  }
+  return result;
 }
 
 std::string TclManager::GetInitStatus() {
@@ -152,9 +271,29 @@ std::vector<int> TclManager::GetAndClearFrameDelays() {
   Autolock l(lock_);
   std::vector<int> result = frame_delays_;
   frame_delays_.clear();
+  for (std::vector<TclSender*>::iterator it = senders_.begin();
+        it != senders_.end(); ++it) {
+    (*it)->GetAndClearFrameDelays(&result);
+  }
   return result;
 }
 
+std::vector<int> TclManager::GetAndClearPacketGapHistogram(
+    int controller_id) {
+  Autolock l(lock_);
+  TclController* controller = FindControllerLocked(controller_id);
+  return (controller ? controller->GetAndClearPacketGapHistogram()
+          : std::vector<int>());
+}
+
+std::vector<int> TclManager::GetAndClearFrameStageHistograms(
+    int controller_id) {
+  Autolock l(lock_);
+  TclSender* sender = FindSenderLocked(FindControllerLocked(controller_id));
+  return (sender ? sender->GetAndClearFrameStageHistograms()
+          : std::vector<int>());
+}
+
 // static
 int TclManager::GetFrameSendDurationMs() {
   return TclController::GetFrameSendDurationMs();
@@ -176,12 +315,17 @@ std::unique_ptr<RgbaImage> TclManager::GetAndClearLastLedImage(
 int TclManager::GetLastImageId(int controller_id) {
   Autolock l(lock_);
   TclController* controller = FindControllerLocked(controller_id);
-  return (controller ? controller->last_image_id() : -1);
+  return (controller ? controller->GetLastImageId() : -1);
 }
 
 void TclManager::ScheduleImageAt(
     int controller_id, const RgbaImage& image, int id,
     uint64_t time, bool wakeup) {
+  if (use_mailboxes_) {
+    PostToMailbox(controller_id, image, id, time, wakeup);
+    return;
+  }
+
   Autolock l(lock_);
   CHECK(has_started_thread_);
   if (is_shutting_down_)
@@ -198,15 +342,13 @@ void TclManager::ScheduleImageAt(
     return;
   }
 
-  if (time > base_time_) {
-    // Align with FPS.
-    double frame_num = round(((double) (time - base_time_)) / 1000.0 * fps_);
-    time = base_time_ + (uint64_t) (frame_num * 1000.0 / fps_);
-    // fprintf(stderr, "Changed target time from %ld to %ld, f=%.2f\n",
-    //         time, time, frame_num);
-  }
-
-  queue_.push(WorkItem(false, controller, image, id, time));
+  time = AlignTimeWithFps(time);
+  WorkItem item(false, controller, image, id, time);
+  FrameTrace* trace = item.img.mutable_trace();
+  if (!trace->frame_id)
+    trace->frame_id = id;
+  trace->Mark(FRAME_STAGE_ENQUEUED);
+  queue_.push(item);
 
   // fprintf(stderr, "Scheduled item with time=%ld\n", time_abs);
 
@@ -214,7 +356,47 @@ void TclManager::ScheduleImageAt(
     WakeupLocked();
 }
 
+// Mailbox mode does not use lock_ or the queue, so that producers
+// are never blocked by the build thread or by API calls.
+void TclManager::PostToMailbox(
+    int controller_id, const RgbaImage& image, int id,
+    uint64_t time, bool wakeup) {
+  int index = FindControllerIndex(controller_id);
+  if (index < 0) {
+    fprintf(stderr, "Ignoring TclManager::ScheduleImageAt on %d\n", controller_id);
+    return;
+  }
+  TclController* controller = controllers_[index];
+  if (image.width() != controller->width() ||
+      image.height() != controller->height()) {
+    fprintf(stderr, "Image/controller size mismatch for %d\n", controller_id);
+    return;
+  }
+
+  RgbaImage img(image);
+  FrameTrace* trace = img.mutable_trace();
+  if (!trace->frame_id)
+    trace->frame_id = id;
+  trace->Mark(FRAME_STAGE_ENQUEUED);
+  mailboxes_[index]->Post(img, id, AlignTimeWithFps(time));
+
+  if (wakeup)
+    sem_post(&mailbox_sem_);
+}
+
+// fps_ is not changed after StartMessageLoop().
+uint64_t TclManager::AlignTimeWithFps(uint64_t time) const {
+  if (time <= base_time_)
+    return time;
+  double frame_num = round(((double) (time - base_time_)) / 1000.0 * fps_);
+  return base_time_ + (uint64_t) (frame_num * 1000.0 / fps_);
+}
+
 void TclManager::Wakeup() {
+  if (use_mailboxes_) {
+    sem_post(&mailbox_sem_);
+    return;
+  }
   Autolock l(lock_);
   WakeupLocked();
 }
@@ -236,6 +418,10 @@ void TclManager::StartEffect(int controller_id, Effect* effect, int priority) {
 
 void TclManager::ResetImageQueue() {
   Autolock l(lock_);
+  for (std::vector<FrameMailbox*>::iterator it = mailboxes_.begin();
+        it != mailboxes_.end(); ++it) {
+    (*it)->Clear();
+  }
   while (!queue_.empty()) {
     WorkItem item = queue_.top();
     queue_.pop();
@@ -244,9 +430,13 @@ void TclManager::ResetImageQueue() {
 
 std::vector<int> TclManager::GetFrameDataForTest(
     int controller_id, const RgbaImage& image) {
-  Autolock l(lock_);
+  TclController* controller = nullptr;
+  {
+    Autolock l(lock_);
+    controller = FindControllerLocked(controller_id);
+  }
+  // Building the frame only locks the controller.
   std::vector<int> result;
-  TclController* controller = FindControllerLocked(controller_id);
   if (controller) {
     std::vector<uint8_t> frame_data = controller->GetFrameDataForTest(image);
     for (auto b : frame_data) {
@@ -258,158 +448,145 @@ std::vector<int> TclManager::GetFrameDataForTest(
 
 int TclManager::GetQueueSize() {
   Autolock l(lock_);
-  return queue_.size();
+  int result = queue_.size();
+  for (std::vector<FrameMailbox*>::iterator it = mailboxes_.begin();
+        it != mailboxes_.end(); ++it) {
+    if ((*it)->has_frame())
+      result++;
+  }
+  return result;
 }
 
 // static
 void* TclManager::ThreadEntry(void* arg) {
   TclManager* self = reinterpret_cast<TclManager*>(arg);
-  self->Run();
+  if (self->use_mailboxes_) {
+    self->RunMailboxes();
+  } else {
+    self->Run();
+  }
   return nullptr;
 }
 
-struct FoundItem {
-  FoundItem(TclController* controller) : controller(controller) {}
-
-  FoundItem(const FoundItem& src) {
-    *this = src;
-  }
-
-  FoundItem& operator=(const FoundItem& rhs) {
-    controller = rhs.controller;
-    frame_data_ = rhs.frame_data_;
-    time_ = rhs.time_;
-    return *this;
-  }
-
-  TclController* controller;
-  std::vector<uint8_t> frame_data_;
-  uint64_t time_ = 0;
-};
-
 void TclManager::Run() {
-  if (enable_net_) {
-    int policy = SCHED_RR;
-    struct sched_param param;
-    param.sched_priority = 10;
-    fprintf(stderr, "Requesting policy=%d, priority=%d\n",
-            policy, param.sched_priority);
-    int err = pthread_setschedparam(pthread_self(), policy, &param);
-    if (err != 0) {
-      fprintf(stderr, "pthread_setschedparam failed with %d\n", err);
-      // CHECK(false);
-    }
-    err = pthread_getschedparam(pthread_self(), &policy, &param);
-    if (err != 0) {
-      fprintf(stderr, "pthread_getschedparam failed with %d\n", err);
-      CHECK(false);
-    }
-    fprintf(stderr, "Obtained policy=%d, priority=%d\n",
-            policy, param.sched_priority);
-  }
-
+  // This thread is the build stage of the pipeline, and per-controller
+  // senders are the send stage. Frames are built without holding lock_,
+  // so API calls are not blocked by building, and a frame can be built
+  // while the previous one is being sent.
+  std::vector<uint8_t> frame_data;
   while (true) {
+    WorkItem item(false, nullptr, RgbaImage(), 0, 0);
+    TclSender* sender = nullptr;
     {
       Autolock l(lock_);
       if (is_shutting_down_)
         break;
 
-      if (enable_net_) {
-        for (std::vector<TclController*>::iterator it = controllers_.begin();
-              it != controllers_.end(); ++it) {
-          (*it)->UpdateAutoReset(auto_reset_after_no_data_ms_);
-        }
-      } else {
+      if (!enable_net_) {
         for (std::vector<TclController*>::iterator it = controllers_.begin();
               it != controllers_.end(); ++it) {
           (*it)->MarkInitialized();
         }
       }
-    }
 
-    if (enable_net_) {
-      bool failed_init = false;
-      for (std::vector<TclController*>::iterator it = controllers_.begin();
-            it != controllers_.end(); ++it) {
-        InitStatus status = (*it)->InitController();
-        failed_init |= (status == INIT_STATUS_FAIL);
-      }
-      if (failed_init) {
-        Sleep(1);
+      int64_t next_time;
+      if (!PopNextWorkItemLocked(&item, &next_time)) {
+        WaitForQueueLocked(next_time);
         continue;
       }
+      sender = FindSenderLocked(item.controller);
     }
+    item.img.mutable_trace()->Mark(FRAME_STAGE_DEQUEUED);
 
-    std::vector<FoundItem> items;
-    uint64_t min_time = GetCurrentMillis();
-    {
-      Autolock l(lock_);
-      while (!is_shutting_down_) {
-        int64_t next_time;
-        WorkItem item(false, nullptr, RgbaImage(), 0, 0);
-        if (!PopNextWorkItemLocked(&item, &next_time)) {
-          if (!items.empty())
-            break;
-          WaitForQueueLocked(next_time);
-          continue;
-        }
+    //fprintf(stderr, "Found item with time=%ld\n", item.time_);
 
-        //fprintf(stderr, "Found item with time=%ld\n", item.time_);
+    if (item.needs_reset) {
+      sender->ScheduleReset();
+      continue;
+    }
 
-        if (item.needs_reset) {
-          item.controller->ScheduleReset();
-          continue;
-        }
+    BuildAndPostFrame(
+        item.controller, sender, &item.img, item.id, item.time, &frame_data);
+  }
+}
 
-        if (item.img.empty()) {
-          fprintf(stderr, "Skipping an item with no image on %d\n",
-                  item.controller->id());
-          continue;
-        }
+void TclManager::RunMailboxes() {
+  // Same pipeline as Run(), but frames are taken from mailboxes.
+  // A taken frame whose time has not come yet is held until then,
+  // unless a newer frame replaces it.
+  std::vector<FrameMailbox::Frame*> held(mailboxes_.size(), nullptr);
+  std::vector<uint8_t> frame_data;
+  while (true) {
+    {
+      Autolock l(lock_);
+      if (is_shutting_down_)
+        break;
 
-        FoundItem found_item(item.controller);
-        found_item.time_ = item.time;
-        InitStatus status = INIT_STATUS_FAIL;
-        item.controller->BuildFrameDataForImage(
-            &found_item.frame_data_, &item.img, item.id, &status);
-        if (found_item.frame_data_.empty()) {
-          if (status == INIT_STATUS_FAIL) {
-            fprintf(stderr, "Failed to build frame_data for an image on %d\n",
-                    item.controller->id());
-          }
-          continue;
+      if (!enable_net_) {
+        for (std::vector<TclController*>::iterator it = controllers_.begin();
+              it != controllers_.end(); ++it) {
+          (*it)->MarkInitialized();
         }
+      }
+    }
+
+    int64_t next_time = 0;
+    for (size_t i = 0; i < mailboxes_.size(); ++i) {
+      // Taking a frame invalidates the previously taken one.
+      FrameMailbox::Frame* frame = mailboxes_[i]->Take();
+      if (frame)
+        held[i] = frame;
+      if (held[i] && mailboxes_[i]->IsStale(held[i]))
+        held[i] = nullptr;
+      if (!held[i])
+        continue;
 
-        if (item.time < min_time)
-          min_time = item.time;
-        items.push_back(found_item);
+      int64_t time = held[i]->time;
+      if (time > (int64_t) GetCurrentMillis()) {
+        if (!next_time || time < next_time)
+          next_time = time;
+        continue;
       }
 
-      if (is_shutting_down_)
-        break;
+      frame = held[i];
+      held[i] = nullptr;
+      frame->image.mutable_trace()->Mark(FRAME_STAGE_DEQUEUED);
+      BuildAndPostFrame(
+          controllers_[i], senders_[i], &frame->image, frame->id,
+          frame->time, &frame_data);
     }
 
-    // fprintf(stderr, "Processing %ld items\n", items.size());
+    WaitForMailboxes(next_time);
+  }
+}
 
-    if (!enable_net_) {
-      Autolock l(lock_);
-      frame_delays_.push_back(GetCurrentMillis() - min_time);
-      continue;
-    }
+void TclManager::BuildAndPostFrame(
+    TclController* controller, TclSender* sender,
+    RgbaImage* image, int id, uint64_t time,
+    std::vector<uint8_t>* frame_data) {
+  if (image->empty()) {
+    fprintf(stderr, "Skipping an item with no image on %d\n",
+            controller->id());
+    return;
+  }
 
-    for (std::vector<FoundItem>::iterator it = items.begin();
-          it != items.end(); ++it) {
-      if (it->controller->SendFrame(it->frame_data_.data())) {
-        Autolock l(lock_);
-        frame_delays_.push_back(GetCurrentMillis() - min_time);
-        // fprintf(stderr, "Sent frame for %ld at %ld\n",
-        //         it->time_, GetCurrentMillis());
-      } else {
-        fprintf(stderr, "Scheduling reset after failed frame\n");
-        it->controller->ScheduleReset();
-      }
+  InitStatus status = INIT_STATUS_FAIL;
+  controller->BuildFrameDataForImage(frame_data, image, id, &status);
+  if (frame_data->empty()) {
+    if (status == INIT_STATUS_FAIL) {
+      fprintf(stderr, "Failed to build frame_data for an image on %d\n",
+              controller->id());
     }
+    return;
+  }
+
+  if (!enable_net_) {
+    Autolock l(lock_);
+    frame_delays_.push_back(GetCurrentMillis() - time);
+    return;
   }
+
+  sender->PostFrame(frame_data, time, image->trace());
 }
 
 bool TclManager::PopNextWorkItemLocked(
@@ -468,3 +645,26 @@ void TclManager::WaitForQueueLocked(int64_t next_time) {
     CHECK(false);
   }
 }
+
+// Waits for a mailbox post, Wakeup() or shutdown, or until |next_time|.
+void TclManager::WaitForMailboxes(int64_t next_time) {
+  int err;
+  if (next_time) {
+    struct timespec timeout;
+    if (clock_gettime(CLOCK_REALTIME, &timeout) == -1) {
+      REPORT_ERRNO("clock_gettime(realtime)");
+      CHECK(false);
+    }
+    int64_t delay = next_time - (int64_t) GetCurrentMillis();
+    AddTimeMillis(&timeout, delay > 0 ? delay : 0);
+    err = sem_timedwait(&mailbox_sem_, &timeout);
+  } else {
+    err = sem_wait(&mailbox_sem_);
+  }
+  if (err == -1 && errno != ETIMEDOUT && errno != EINTR) {
+    REPORT_ERRNO("sem_wait");
+    CHECK(false);
+  }
+  // Posts made while building are all handled by the next pass.
+  while (sem_trywait(&mailbox_sem_) == 0) {}
+}
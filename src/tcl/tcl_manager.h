@@ -4,16 +4,20 @@
 #define TCL_TCL_MANAGER_H_
 
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 
 #include <queue>
+#include <string>
 
 #include "tcl/tcl_types.h"
 #include "util/led_layout.h"
 #include "util/pixels.h"
 
 class Effect;
+class FrameMailbox;
 class TclController;
+class TclSender;
 
 class TclManager {
  public:
@@ -32,6 +36,28 @@ class TclManager {
       const LedLayout& layout, double gamma);
   void LockControllers();
 
+  // In mailbox mode, each controller keeps only its newest scheduled
+  // frame in a lock-free FrameMailbox instead of the shared queue.
+  // ScheduleImageAt() then never blocks, but frames must be scheduled
+  // from one thread per controller. Must be called before
+  // LockControllers().
+  void SetFrameMailboxMode(bool enable);
+
+  // Sets SCHED_RR priority of the controller's sender thread,
+  // or 0 for the default policy. Default is 10.
+  void SetSenderPriority(int controller_id, int priority);
+
+  // Overrides controller's address, e.g. to use an emulator.
+  // Must be called before StartMessageLoop().
+  void SetControllerAddress(
+      int controller_id, const std::string& host, int port);
+
+  // Sets delays after the start packet and after each data packet,
+  // and the duration to busy-spin at the end of each delay.
+  // Must be called before StartMessageLoop().
+  void SetPacketPacing(
+      int controller_id, int start_gap_us, int data_gap_us, int spin_us);
+
   bool GetControllerImageSize(int controller_id, int* w, int* h);
 
   void SetGammaRanges(
@@ -54,19 +80,36 @@ class TclManager {
 
   std::vector<int> GetAndClearFrameDelays();
 
+  // Returns counts of achieved gaps between packets, in buckets
+  // of PacketPacer::kGapBucketUs microseconds.
+  std::vector<int> GetAndClearPacketGapHistogram(int controller_id);
+
+  // Returns latency histograms of frame stages for frames sent by
+  // the controller, laid out as in FrameTraceStats::GetFlattenedCounts().
+  std::vector<int> GetAndClearFrameStageHistograms(int controller_id);
+
   // Reset controller if no reply data in ms. Default is 5000.
   void SetAutoResetAfterNoDataMs(int value);
 
+  // When enabled, frames identical to the last sent one are not sent
+  // again, except for keepalives every |keepalive_ms|. Keepalives are
+  // also sent often enough to avoid the no-data auto-reset.
+  void SetSkipUnchangedFrames(bool enable, int keepalive_ms);
+
+  // Returns the number of frames skipped as unchanged, for all controllers.
+  int GetAndClearSkippedFrameCount();
+
   void SetHdrMode(HdrMode mode);
 
-  // Returns the number of currently queued frames.
+  // Returns the number of currently queued frames. In mailbox mode,
+  // returns the number of posted frames that were not taken yet.
   int GetQueueSize();
 
   std::string GetInitStatus();
   void ResetImageQueue();
 
   // Returns the total of all artificial delays
-  // added during sending of data.
+  // added during sending of data, with default pacing.
   static int GetFrameSendDurationMs();
 
  private:
@@ -91,13 +134,26 @@ class TclManager {
   };
 
   void Run();
+  void RunMailboxes();
   static void* ThreadEntry(void* arg);
 
   TclController* FindControllerLocked(int id);
+  int FindControllerIndex(int id) const;
+
+  void PostToMailbox(
+      int controller_id, const RgbaImage& image, int id,
+      uint64_t time, bool wakeup);
+  uint64_t AlignTimeWithFps(uint64_t time) const;
+  TclSender* FindSenderLocked(TclController* controller);
 
   bool PopNextWorkItemLocked(WorkItem* item, int64_t* next_time);
   void WaitForQueueLocked(int64_t next_time);
   void WakeupLocked();
+  void WaitForMailboxes(int64_t next_time);
+  void BuildAndPostFrame(
+      TclController* controller, TclSender* sender,
+      RgbaImage* image, int id, uint64_t time,
+      std::vector<uint8_t>* frame_data);
 
   int fps_ = 15;
   int auto_reset_after_no_data_ms_ = 5000;
@@ -105,6 +161,7 @@ class TclManager {
   bool has_started_thread_ = false;
   bool enable_net_ = false;
   bool controllers_locked_ = false;
+  bool use_mailboxes_ = false;
   uint64_t base_time_;
   std::priority_queue<WorkItem> queue_;
   pthread_mutex_t lock_;
@@ -112,6 +169,12 @@ class TclManager {
   pthread_t thread_;
   std::vector<int> frame_delays_;
   std::vector<TclController*> controllers_;
+  // One sender per controller, in the same order.
+  std::vector<TclSender*> senders_;
+  // One mailbox per controller, used in mailbox mode. The semaphore
+  // wakes up the build thread without taking lock_.
+  std::vector<FrameMailbox*> mailboxes_;
+  sem_t mailbox_sem_;
 };
 
 #endif  // TCL_TCL_MANAGER_H_
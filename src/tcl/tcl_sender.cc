@@ -0,0 +1,266 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "tcl/tcl_sender.h"
+
+#include <sched.h>
+
+#include <algorithm>
+
+#include "tcl/tcl_controller.h"
+#include "util/lock.h"
+#include "util/logging.h"
+#include "util/time.h"
+
+namespace {
+
+// FNV-1a over 64-bit words. Frame length is a multiple of 8.
+uint64_t HashFrame(const std::vector<uint8_t>& frame) {
+  uint64_t hash = 14695981039346656037ULL;
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(frame.data());
+  for (size_t i = 0; i < frame.size() / 8; ++i) {
+    hash ^= words[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+}  // namespace
+
+TclSender::TclSender(TclController* controller)
+    : controller_(controller), lock_(PTHREAD_MUTEX_INITIALIZER) {
+  // Keepalive deadlines are computed with GetCurrentMicros().
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  int err = pthread_cond_init(&cond_, &attr);
+  pthread_condattr_destroy(&attr);
+  if (err != 0) {
+    fprintf(stderr, "pthread_cond_init failed with %d\n", err);
+    CHECK(false);
+  }
+}
+
+TclSender::~TclSender() {
+  if (has_started_thread_) {
+    {
+      Autolock l(lock_);
+      is_shutting_down_ = true;
+      pthread_cond_broadcast(&cond_);
+    }
+
+    pthread_join(thread_, nullptr);
+  }
+
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&lock_);
+}
+
+void TclSender::SetPriority(int priority) {
+  Autolock l(lock_);
+  CHECK(!has_started_thread_);
+  priority_ = priority;
+}
+
+void TclSender::Start() {
+  Autolock l(lock_);
+  if (has_started_thread_)
+    return;
+  has_started_thread_ = true;
+
+  int err = pthread_create(&thread_, nullptr, &ThreadEntry, this);
+  if (err != 0) {
+    fprintf(stderr, "pthread_create failed with %d\n", err);
+    CHECK(false);
+  }
+}
+
+void TclSender::PostFrame(
+    std::vector<uint8_t>* frame_data, uint64_t time,
+    const FrameTrace& trace) {
+  Autolock l(lock_);
+  pending_frame_.swap(*frame_data);
+  pending_time_ = time;
+  pending_trace_ = trace;
+  has_frame_ = true;
+  pthread_cond_broadcast(&cond_);
+}
+
+void TclSender::ScheduleReset() {
+  Autolock l(lock_);
+  needs_reset_ = true;
+  has_frame_ = false;
+  pthread_cond_broadcast(&cond_);
+}
+
+void TclSender::SetAutoResetAfterNoDataMs(int value) {
+  Autolock l(lock_);
+  auto_reset_after_no_data_ms_ = value;
+}
+
+void TclSender::SetSkipUnchangedFrames(bool enable, int keepalive_ms) {
+  Autolock l(lock_);
+  skip_unchanged_frames_ = enable;
+  keepalive_ms_ = keepalive_ms;
+  pthread_cond_broadcast(&cond_);
+}
+
+int TclSender::GetKeepaliveMsLocked() const {
+  int result = keepalive_ms_;
+  if (auto_reset_after_no_data_ms_ > 0)
+    result = std::min(result, auto_reset_after_no_data_ms_ / 2);
+  return std::max(result, 1);
+}
+
+int TclSender::GetAndClearSkippedFrameCount() {
+  Autolock l(lock_);
+  int result = skipped_frame_count_;
+  skipped_frame_count_ = 0;
+  return result;
+}
+
+void TclSender::GetAndClearFrameDelays(std::vector<int>* dst) {
+  Autolock l(lock_);
+  dst->insert(dst->end(), frame_delays_.begin(), frame_delays_.end());
+  frame_delays_.clear();
+}
+
+std::vector<int> TclSender::GetAndClearFrameStageHistograms() {
+  Autolock l(lock_);
+  std::vector<int> result = stage_stats_.GetFlattenedCounts();
+  stage_stats_.Clear();
+  return result;
+}
+
+// static
+void* TclSender::ThreadEntry(void* arg) {
+  TclSender* self = reinterpret_cast<TclSender*>(arg);
+  self->Run();
+  return nullptr;
+}
+
+void TclSender::Run() {
+  if (priority_ > 0) {
+    int policy = SCHED_RR;
+    struct sched_param param;
+    param.sched_priority = priority_;
+    fprintf(stderr, "Requesting policy=%d, priority=%d for TCL%d\n",
+            policy, param.sched_priority, controller_->id());
+    int err = pthread_setschedparam(pthread_self(), policy, &param);
+    if (err != 0) {
+      fprintf(stderr, "pthread_setschedparam failed with %d\n", err);
+      // CHECK(false);
+    }
+    err = pthread_getschedparam(pthread_self(), &policy, &param);
+    if (err != 0) {
+      fprintf(stderr, "pthread_getschedparam failed with %d\n", err);
+      CHECK(false);
+    }
+    fprintf(stderr, "Obtained policy=%d, priority=%d for TCL%d\n",
+            policy, param.sched_priority, controller_->id());
+  }
+
+  // Socket and reset state of the controller is only touched here.
+  // After a successful send, |frame_data| holds the last sent frame.
+  std::vector<uint8_t> frame_data;
+  FrameTrace trace;
+  bool has_sent_frame = false;
+  uint64_t last_hash = 0;
+  uint64_t last_send_time_us = 0;
+  while (true) {
+    {
+      Autolock l(lock_);
+      if (is_shutting_down_)
+        break;
+      if (needs_reset_) {
+        needs_reset_ = false;
+        has_sent_frame = false;
+        controller_->ScheduleReset();
+      }
+      controller_->UpdateAutoReset(auto_reset_after_no_data_ms_);
+    }
+
+    InitStatus status = controller_->InitController();
+    if (status == INIT_STATUS_FAIL) {
+      Sleep(1);
+      continue;
+    }
+
+    uint64_t time = 0;
+    bool is_keepalive = false;
+    bool skip_unchanged = false;
+    uint64_t keepalive_time_us = 0;
+    {
+      Autolock l(lock_);
+      skip_unchanged = skip_unchanged_frames_ && has_sent_frame &&
+          status == INIT_STATUS_OK;
+      if (skip_unchanged) {
+        keepalive_time_us =
+            last_send_time_us + GetKeepaliveMsLocked() * 1000ULL;
+      }
+      if (!WaitForFrameLocked(keepalive_time_us)) {
+        // Re-send the last frame, unless woken up for other reasons.
+        is_keepalive = (skip_unchanged && !has_frame_ && !needs_reset_ &&
+                        !is_shutting_down_);
+      }
+      if (is_shutting_down_ || (!has_frame_ && !is_keepalive))
+        continue;
+      if (has_frame_) {
+        is_keepalive = false;
+        frame_data.swap(pending_frame_);
+        time = pending_time_;
+        trace = pending_trace_;
+        has_frame_ = false;
+      } else {
+        time = GetCurrentMillis();
+        trace.Clear();
+      }
+    }
+
+    uint64_t hash = HashFrame(frame_data);
+    if (skip_unchanged && !is_keepalive && hash == last_hash &&
+        GetCurrentMicros() < keepalive_time_us) {
+      Autolock l(lock_);
+      skipped_frame_count_++;
+      continue;
+    }
+
+    last_send_time_us = GetCurrentMicros();
+    if (controller_->SendFrame(frame_data.data(), &trace)) {
+      has_sent_frame = true;
+      last_hash = hash;
+      Autolock l(lock_);
+      if (!is_keepalive) {
+        frame_delays_.push_back(GetCurrentMillis() - time);
+        stage_stats_.Add(trace);
+      }
+    } else {
+      has_sent_frame = false;
+      fprintf(stderr, "Scheduling reset after failed frame on %d\n",
+              controller_->id());
+      controller_->ScheduleReset();
+    }
+  }
+}
+
+// Waits until a frame is posted, reset is requested or shutdown starts.
+// Returns false if |keepalive_time_us| passed first. Zero time
+// means waiting without a deadline.
+bool TclSender::WaitForFrameLocked(uint64_t keepalive_time_us) {
+  while (!has_frame_ && !needs_reset_ && !is_shutting_down_) {
+    if (!keepalive_time_us) {
+      pthread_cond_wait(&cond_, &lock_);
+      continue;
+    }
+    struct timespec timeout;
+    timeout.tv_sec = keepalive_time_us / 1000000;
+    timeout.tv_nsec = (keepalive_time_us % 1000000) * 1000;
+    int err = pthread_cond_timedwait(&cond_, &lock_, &timeout);
+    if (err == ETIMEDOUT)
+      return false;
+    if (err != 0) {
+      fprintf(stderr, "Unable to wait on condition: %d\n", err);
+      CHECK(false);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,90 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef TCL_TCL_SENDER_H_
+#define TCL_TCL_SENDER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "util/frame_trace.h"
+
+class TclController;
+
+// Sends frames to one controller from a dedicated thread, so that
+// the packet delays of one controller do not hold back the others.
+// Only the latest posted frame is kept, older unsent frames are dropped.
+// Frames are double-buffered: the pending frame and the frame being sent
+// are separate buffers, swapped without copying, so the next frame can
+// be posted while the current one is on the wire.
+class TclSender {
+ public:
+  explicit TclSender(TclController* controller);
+  ~TclSender();
+
+  TclController* controller() const { return controller_; }
+
+  // Sets SCHED_RR priority of the sender thread, or 0 to use
+  // the default scheduling policy. Must be called before Start().
+  void SetPriority(int priority);
+
+  void Start();
+
+  // Replaces the pending frame with |frame_data|. The vector is swapped
+  // with the previous pending frame, so that buffers can be reused.
+  // |time| is the scheduled frame time, used for delay reporting.
+  // |trace| is completed with packet times and added to statistics.
+  void PostFrame(
+      std::vector<uint8_t>* frame_data, uint64_t time,
+      const FrameTrace& trace);
+
+  void ScheduleReset();
+
+  // Reset controller if no reply data in ms.
+  void SetAutoResetAfterNoDataMs(int value);
+
+  // When enabled, frames identical to the last sent one are not sent.
+  // The last frame is still re-sent every |keepalive_ms|, but at least
+  // twice per auto-reset period, so that the controller keeps replying.
+  void SetSkipUnchangedFrames(bool enable, int keepalive_ms);
+
+  // Appends delays between scheduled and sent times, in ms.
+  void GetAndClearFrameDelays(std::vector<int>* dst);
+
+  int GetAndClearSkippedFrameCount();
+
+  // See FrameTraceStats::GetFlattenedCounts().
+  std::vector<int> GetAndClearFrameStageHistograms();
+
+ private:
+  TclSender(const TclSender& src);
+  TclSender& operator=(const TclSender& rhs);
+
+  void Run();
+  static void* ThreadEntry(void* arg);
+
+  int GetKeepaliveMsLocked() const;
+  bool WaitForFrameLocked(uint64_t keepalive_time_us);
+
+  TclController* controller_;
+  int priority_ = 0;
+  int auto_reset_after_no_data_ms_ = 5000;
+  bool skip_unchanged_frames_ = false;
+  int keepalive_ms_ = 1000;
+  bool is_shutting_down_ = false;
+  bool has_started_thread_ = false;
+  bool needs_reset_ = false;
+  bool has_frame_ = false;
+  std::vector<uint8_t> pending_frame_;
+  uint64_t pending_time_ = 0;
+  FrameTrace pending_trace_;
+  std::vector<int> frame_delays_;
+  FrameTraceStats stage_stats_;
+  int skipped_frame_count_ = 0;
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+  pthread_t thread_;
+};
+
+#endif  // TCL_TCL_SENDER_H_
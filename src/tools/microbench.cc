@@ -0,0 +1,434 @@
+// Copyright 2016, Igor Chernyshev.
+//
+// Microbenchmarks for the pixel, PCM and LED hot paths, at production sizes:
+// 512x512 source images, 500x50 main and 65x250 fin controllers.
+// Layouts are read from text files exported by tools/export_layouts.py,
+// or generated as 8x512 strands when not given. Results are printed,
+// and optionally written as JSON to compare builds.
+//
+// Usage: build/microbench [--layout_main=FILE] [--layout_fin=FILE]
+//     [--json=FILE] [--min_time_ms=500] [--filter=SUBSTRING]
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tcl/tcl_controller.h"
+#include "tcl/tcl_types.h"
+#include "util/led_layout.h"
+#include "util/pcm.h"
+#include "util/pixels.h"
+#include "util/time.h"
+
+// Provides access to the private build stages of TclController.
+class TclControllerBench {
+ public:
+  static void UpdateBuildSettings(TclController* controller) {
+    controller->UpdateBuildSettings();
+  }
+
+  static bool PopulateLedStrandsColors(
+      TclController* controller, LedStrands* strands,
+      const RgbaImage& image) {
+    return controller->PopulateLedStrandsColors(strands, image);
+  }
+
+  static void PerformHdr(TclController* controller, LedStrands* strands) {
+    controller->PerformHdr(strands);
+  }
+
+  static void ConvertLedStrandsToFrame(
+      TclController* controller, std::vector<uint8_t>* dst,
+      const LedStrands& strands) {
+    controller->ConvertLedStrandsToFrame(dst, strands);
+  }
+};
+
+namespace {
+
+const int kSourceSize = 512;
+const int kStrandCount = 8;
+const int kStrandLength = 512;
+// Iterations are timed in batches of at least this duration.
+const uint64_t kMinBatchUs = 2000;
+
+struct Options {
+  std::string layout_main;
+  std::string layout_fin;
+  std::string json_path;
+  std::string filter;
+  int min_time_ms = 500;
+};
+
+struct Result {
+  std::string name;
+  std::string size;
+  int64_t iterations;
+  double min_ns;
+  double median_ns;
+  double mean_ns;
+};
+
+class Runner {
+ public:
+  Runner(int min_time_ms, const std::string& filter)
+      : min_time_us_(min_time_ms * 1000ULL), filter_(filter) {}
+
+  const std::vector<Result>& results() const { return results_; }
+
+  template <typename Fn>
+  void Run(const std::string& name, const std::string& size, Fn fn);
+
+ private:
+  Runner(const Runner& src);
+  Runner& operator=(const Runner& rhs);
+
+  uint64_t min_time_us_;
+  std::string filter_;
+  std::vector<Result> results_;
+};
+
+template <typename Fn>
+void Runner::Run(const std::string& name, const std::string& size, Fn fn) {
+  if (!filter_.empty() && (name + " " + size).find(filter_) ==
+      std::string::npos) {
+    return;
+  }
+
+  for (int i = 0; i < 3; ++i)
+    fn();
+
+  // Grow the batch until it is long enough to be timed accurately.
+  int64_t batch_size = 1;
+  while (true) {
+    uint64_t start = GetCurrentMicros();
+    for (int64_t i = 0; i < batch_size; ++i)
+      fn();
+    if (GetCurrentMicros() - start >= kMinBatchUs)
+      break;
+    batch_size *= 2;
+  }
+
+  std::vector<double> batch_ns;
+  int64_t iterations = 0;
+  uint64_t total_us = 0;
+  while (total_us < min_time_us_ || batch_ns.size() < 5) {
+    uint64_t start = GetCurrentMicros();
+    for (int64_t i = 0; i < batch_size; ++i)
+      fn();
+    uint64_t duration = GetCurrentMicros() - start;
+    batch_ns.push_back(duration * 1000.0 / batch_size);
+    iterations += batch_size;
+    total_us += duration;
+  }
+  std::sort(batch_ns.begin(), batch_ns.end());
+
+  Result result;
+  result.name = name;
+  result.size = size;
+  result.iterations = iterations;
+  result.min_ns = batch_ns.front();
+  result.median_ns = batch_ns[batch_ns.size() / 2];
+  result.mean_ns = total_us * 1000.0 / iterations;
+  results_.push_back(result);
+  printf("%-40s %-18s %12.0f ns  (min %.0f, %lld iterations)\n",
+         name.c_str(), size.c_str(), result.median_ns, result.min_ns,
+         static_cast<long long>(iterations));
+  fflush(stdout);
+}
+
+std::string SizeString(int w, int h) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%dx%d", w, h);
+  return buf;
+}
+
+// Reads lines of "strand_id x y", as written by tools/export_layouts.py.
+bool LoadLayout(const std::string& path, LedLayout* layout) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    fprintf(stderr, "Unable to open layout '%s'\n", path.c_str());
+    return false;
+  }
+  int strand_id, x, y;
+  int count = 0;
+  while (fscanf(file, "%d %d %d", &strand_id, &x, &y) == 3) {
+    layout->AddCoord(strand_id, x, y);
+    count++;
+  }
+  fclose(file);
+  if (!count) {
+    fprintf(stderr, "No LED's in layout '%s'\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Zig-zags 8x512 LED's over the whole image.
+LedLayout CreateSyntheticLayout(int width, int height) {
+  LedLayout layout;
+  int total_count = kStrandCount * kStrandLength;
+  int row_length = std::max(1, total_count / height);
+  for (int i = 0; i < total_count; ++i) {
+    int row = i / row_length;
+    int col = i % row_length;
+    if (row & 1)
+      col = row_length - 1 - col;
+    layout.AddCoord(i / kStrandLength,
+                    std::min(width - 1, col * width / row_length),
+                    std::min(height - 1, row * height / (total_count /
+                                                         row_length)));
+  }
+  return layout;
+}
+
+void FillImage(uint8_t* data, int w, int h, unsigned int seed) {
+  for (int i = 0; i < w * h; ++i) {
+    data[i * 4] = rand_r(&seed);
+    data[i * 4 + 1] = rand_r(&seed);
+    data[i * 4 + 2] = rand_r(&seed);
+    data[i * 4 + 3] = 255;
+  }
+}
+
+struct ControllerSetup {
+  ControllerSetup(const char* name, int id, int width, int height)
+      : name(name), id(id), width(width), height(height) {}
+
+  std::string name;
+  int id;
+  int width;
+  int height;
+  std::string layout_source;
+  LedLayout layout;
+};
+
+void RunPixelBenchmarks(Runner* runner) {
+  const int kHalfWidth = 250;
+  const int kHeight = 50;
+  std::vector<uint8_t> src(RGBA_LEN(kSourceSize, kSourceSize));
+  FillImage(src.data(), kSourceSize, kSourceSize, 1);
+  std::vector<uint8_t> dst(RGBA_LEN(kSourceSize, kSourceSize));
+  std::vector<uint8_t> half(RGBA_LEN(kHalfWidth, kHeight));
+  FillImage(half.data(), kHalfWidth, kHeight, 2);
+  std::vector<uint8_t> overlay(RGBA_LEN(kHalfWidth * 2, kHeight));
+  FillImage(overlay.data(), kHalfWidth * 2, kHeight, 3);
+  for (int i = 0; i < kHalfWidth * 2 * kHeight; ++i)
+    overlay[i * 4 + 3] = i & 0xFF;
+  std::string source_size = SizeString(kSourceSize, kSourceSize);
+
+  runner->Run("ResizeImage", source_size + "->250x50", [&]() {
+    ResizeImage(src.data(), kSourceSize, kSourceSize,
+                dst.data(), kHalfWidth, kHeight);
+  });
+  runner->Run("ResizeImage", source_size + "->500x50", [&]() {
+    ResizeImage(src.data(), kSourceSize, kSourceSize,
+                dst.data(), kHalfWidth * 2, kHeight);
+  });
+  runner->Run("ResizeImage", source_size + "->65x250", [&]() {
+    ResizeImage(src.data(), kSourceSize, kSourceSize, dst.data(), 65, 250);
+  });
+  runner->Run("FlipImage/vertical", source_size, [&]() {
+    FlipImage(src.data(), kSourceSize, kSourceSize, false, dst.data());
+  });
+  runner->Run("FlipImage/horizontal", "250x50", [&]() {
+    FlipImage(half.data(), kHalfWidth, kHeight, true, dst.data());
+  });
+  runner->Run("CropImage", source_size + "->400x400", [&]() {
+    delete[] CropImage(src.data(), kSourceSize, kSourceSize,
+                       56, 56, 400, 400);
+  });
+  runner->Run("RotateImage/90", source_size, [&]() {
+    delete[] RotateImage(src.data(), kSourceSize, kSourceSize,
+                         kSourceSize, kSourceSize, 90);
+  });
+  runner->Run("PasteSubImage/opaque", "250x50->500x50", [&]() {
+    PasteSubImage(half.data(), kHalfWidth, kHeight,
+                  dst.data(), kHalfWidth, 0, kHalfWidth * 2, kHeight,
+                  false, true);
+  });
+  runner->Run("PasteSubImage/alpha", "500x50->500x50", [&]() {
+    PasteSubImage(overlay.data(), kHalfWidth * 2, kHeight,
+                  dst.data(), 0, 0, kHalfWidth * 2, kHeight,
+                  true, false);
+  });
+}
+
+void RunPcmBenchmarks(Runner* runner) {
+  const int kFrameCount = 2048;
+  std::vector<int16_t> src(kFrameCount * 2);
+  for (size_t i = 0; i < src.size(); ++i)
+    src[i] = static_cast<int16_t>(i * 7919);
+  std::vector<float> dst(kFrameCount * 2);
+  PcmLevels levels;
+
+  runner->Run("ConvertPcmS16ToFloat", "2048 frames", [&]() {
+    ConvertPcmS16ToFloat(src.data(), kFrameCount, 1.5f, dst.data(), &levels);
+  });
+}
+
+void RunLedBenchmarks(Runner* runner, const ControllerSetup& setup) {
+  std::string size = SizeString(setup.width, setup.height);
+  std::string prefix = setup.name + " ";
+
+  runner->Run("LedLayoutMap::PopulateLayoutMap", prefix + size, [&]() {
+    LedLayoutMap map(setup.width, setup.height);
+    map.PopulateLayoutMap(setup.layout);
+  });
+
+  LedLayoutMap map(setup.width, setup.height);
+  map.PopulateLayoutMap(setup.layout);
+  LedStrands strands(map);
+  for (int i = 0; i < strands.GetAllColorDataSize(); ++i)
+    strands.GetAllColorData()[i] = i * 7;
+  runner->Run("LedStrands::ConvertTo/hsl+rgb", prefix + size, [&]() {
+    strands.ConvertTo(LedStrands::TYPE_HSL);
+    strands.ConvertTo(LedStrands::TYPE_RGB);
+  });
+
+  TclController controller(
+      setup.id, setup.width, setup.height, 15, setup.layout, 2.0);
+  controller.SetHdrMode(HDR_MODE_SAT);
+  TclControllerBench::UpdateBuildSettings(&controller);
+  RgbaImage image;
+  image.ResizeStorage(setup.width, setup.height);
+  FillImage(image.mutable_data(), setup.width, setup.height, 4);
+  LedStrands controller_strands(map);
+
+  runner->Run("TclController::PopulateLedStrandsColors", prefix + size,
+              [&]() {
+    TclControllerBench::PopulateLedStrandsColors(
+        &controller, &controller_strands, image);
+  });
+
+  controller_strands.ConvertTo(LedStrands::TYPE_HSL);
+  runner->Run("TclController::PerformHdr/sat", prefix + size, [&]() {
+    TclControllerBench::PerformHdr(&controller, &controller_strands);
+  });
+
+  controller_strands.ConvertTo(LedStrands::TYPE_RGB);
+  std::vector<uint8_t> frame;
+  runner->Run("TclController::ConvertLedStrandsToFrame", prefix + size,
+              [&]() {
+    TclControllerBench::ConvertLedStrandsToFrame(
+        &controller, &frame, controller_strands);
+  });
+}
+
+void WriteJsonString(FILE* file, const std::string& value) {
+  fputc('"', file);
+  for (size_t i = 0; i < value.size(); ++i) {
+    char c = value[i];
+    if (c == '"' || c == '\\')
+      fputc('\\', file);
+    fputc(c, file);
+  }
+  fputc('"', file);
+}
+
+bool WriteJson(const std::string& path, const Options& options,
+               const std::vector<ControllerSetup>& setups,
+               const std::vector<Result>& results) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "Unable to write '%s'\n", path.c_str());
+    return false;
+  }
+  fprintf(file, "{\n  \"compiler\": ");
+  WriteJsonString(file, __VERSION__);
+  fprintf(file, ",\n  \"min_time_ms\": %d,\n  \"layouts\": {",
+          options.min_time_ms);
+  for (size_t i = 0; i < setups.size(); ++i) {
+    fprintf(file, "%s\n    ", (i ? "," : ""));
+    WriteJsonString(file, setups[i].name);
+    fprintf(file, ": ");
+    WriteJsonString(file, setups[i].layout_source);
+  }
+  fprintf(file, "\n  },\n  \"results\": [");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    fprintf(file, "%s\n    {\"name\": ", (i ? "," : ""));
+    WriteJsonString(file, r.name);
+    fprintf(file, ", \"size\": ");
+    WriteJsonString(file, r.size);
+    fprintf(file,
+            ", \"iterations\": %lld, \"median_ns\": %.1f, "
+            "\"min_ns\": %.1f, \"mean_ns\": %.1f}",
+            static_cast<long long>(r.iterations), r.median_ns, r.min_ns,
+            r.mean_ns);
+  }
+  fprintf(file, "\n  ]\n}\n");
+  fclose(file);
+  return true;
+}
+
+void PrintUsage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [--layout_main=FILE] [--layout_fin=FILE]\n"
+          "    [--json=FILE] [--min_time_ms=500] [--filter=SUBSTRING]\n",
+          name);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  static const struct option kOptions[] = {
+      {"layout_main", required_argument, nullptr, 'm'},
+      {"layout_fin", required_argument, nullptr, 'f'},
+      {"json", required_argument, nullptr, 'j'},
+      {"min_time_ms", required_argument, nullptr, 't'},
+      {"filter", required_argument, nullptr, 'F'},
+      {nullptr, 0, nullptr, 0}};
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", kOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'm': options.layout_main = optarg; break;
+      case 'f': options.layout_fin = optarg; break;
+      case 'j': options.json_path = optarg; break;
+      case 't': options.min_time_ms = atoi(optarg); break;
+      case 'F': options.filter = optarg; break;
+      default:
+        PrintUsage(argv[0]);
+        return 1;
+    }
+  }
+
+  // Same controllers as configured in dfplayer/player.py.
+  std::vector<ControllerSetup> setups;
+  setups.push_back(ControllerSetup("main", 1, 500, 50));
+  setups.push_back(ControllerSetup("fin", 3, 65, 250));
+  const std::string* layout_paths[] = {
+      &options.layout_main, &options.layout_fin};
+  for (size_t i = 0; i < setups.size(); ++i) {
+    ControllerSetup& setup = setups[i];
+    const std::string& path = *layout_paths[i];
+    if (path.empty()) {
+      setup.layout = CreateSyntheticLayout(setup.width, setup.height);
+      setup.layout_source = "synthetic";
+    } else {
+      if (!LoadLayout(path, &setup.layout))
+        return 1;
+      setup.layout_source = path;
+    }
+  }
+
+  Runner runner(options.min_time_ms, options.filter);
+  RunPixelBenchmarks(&runner);
+  RunPcmBenchmarks(&runner);
+  for (size_t i = 0; i < setups.size(); ++i)
+    RunLedBenchmarks(&runner, setups[i]);
+
+  if (!options.json_path.empty() &&
+      !WriteJson(options.json_path, options, setups, runner.results())) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,233 @@
+// Copyright 2016, Igor Chernyshev.
+//
+// Measures end-to-end throughput of TclManager: schedules changing images
+// for several controllers at the target rate, sends them over UDP and
+// reports the sustained frame rate, frame delays and packet gaps.
+// Intended to run against tcl_emulator, one instance per controller:
+//   build/tcl_emulator --port=5001 &
+//   build/tcl_emulator --port=5002 &
+//   build/tcl_benchmark --controllers=2 --port=5001 --fps=40
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "tcl/packet_pacer.h"
+#include "tcl/tcl_manager.h"
+#include "util/frame_trace.h"
+#include "util/led_layout.h"
+#include "util/pixels.h"
+#include "util/time.h"
+
+namespace {
+
+const int kImageWidth = 500;
+const int kImageHeight = 50;
+const int kStrandCount = 8;
+const int kStrandLength = 512;
+const int kInitTimeoutMs = 15000;
+
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 5000;
+  int controllers = 1;
+  int fps = 40;
+  int duration_s = 10;
+  int start_gap_us = -1;
+  int data_gap_us = -1;
+  int spin_us = 0;
+  bool mailbox = false;
+};
+
+LedLayout CreateLayout() {
+  LedLayout layout;
+  for (int s = 0; s < kStrandCount; ++s) {
+    for (int i = 0; i < kStrandLength; ++i) {
+      layout.AddCoord(s, i * kImageWidth / kStrandLength,
+                      s * kImageHeight / kStrandCount);
+    }
+  }
+  return layout;
+}
+
+void FillImage(RgbaImage* image, int frame) {
+  uint8_t* data = image->mutable_data();
+  for (int y = 0; y < image->height(); ++y) {
+    uint8_t* row = data + y * image->width() * 4;
+    for (int x = 0; x < image->width(); ++x) {
+      row[x * 4] = (x + frame) & 0xFF;
+      row[x * 4 + 1] = (y * 5 + frame) & 0xFF;
+      row[x * 4 + 2] = (frame * 3) & 0xFF;
+      row[x * 4 + 3] = 0xFF;
+    }
+  }
+}
+
+// Controllers only leave the initial reset while frames are being sent,
+// so keep sending the first frame until all of them are ready.
+bool WaitForControllers(
+    TclManager* manager, int count, const RgbaImage& image) {
+  uint64_t end_time = GetCurrentMillis() + kInitTimeoutMs;
+  std::string status;
+  while (GetCurrentMillis() < end_time) {
+    for (int id = 1; id <= count; ++id)
+      manager->ScheduleImageAt(id, image, 0, GetCurrentMillis(), id == count);
+    status = manager->GetInitStatus();
+    int ok_count = 0;
+    for (size_t pos = status.find("= OK"); pos != std::string::npos;
+         pos = status.find("= OK", pos + 1)) {
+      ok_count++;
+    }
+    if (ok_count == count)
+      return true;
+    Sleep(0.1);
+  }
+  fprintf(stderr, "Controllers failed to initialize: %s\n", status.c_str());
+  return false;
+}
+
+int GetSortedPercentile(const std::vector<int>& values, double percentile) {
+  if (values.empty())
+    return 0;
+  size_t pos = static_cast<size_t>(values.size() * percentile / 100.0);
+  return values[std::min(pos, values.size() - 1)];
+}
+
+int GetHistogramPercentile(const std::vector<int>& counts, double percentile) {
+  int total = 0;
+  for (size_t i = 0; i < counts.size(); ++i)
+    total += counts[i];
+  if (!total)
+    return 0;
+  double threshold = total * percentile / 100.0;
+  int sum = 0;
+  for (size_t i = 0; i < counts.size(); ++i) {
+    sum += counts[i];
+    if (sum >= threshold)
+      return (i + 1) * PacketPacer::kGapBucketUs;
+  }
+  return counts.size() * PacketPacer::kGapBucketUs;
+}
+
+void PrintUsage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [--host=127.0.0.1] [--port=5000] [--controllers=1]\n"
+          "    [--fps=40] [--duration_s=10] [--start_gap_us=US]\n"
+          "    [--data_gap_us=US] [--spin_us=US] [--mailbox]\n"
+          "Controller N uses port + N - 1.\n", name);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  static const struct option kOptions[] = {
+      {"host", required_argument, nullptr, 'h'},
+      {"port", required_argument, nullptr, 'p'},
+      {"controllers", required_argument, nullptr, 'c'},
+      {"fps", required_argument, nullptr, 'f'},
+      {"duration_s", required_argument, nullptr, 't'},
+      {"start_gap_us", required_argument, nullptr, 'S'},
+      {"data_gap_us", required_argument, nullptr, 'D'},
+      {"spin_us", required_argument, nullptr, 'P'},
+      {"mailbox", no_argument, nullptr, 'm'},
+      {nullptr, 0, nullptr, 0}};
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", kOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'h': options.host = optarg; break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'c': options.controllers = atoi(optarg); break;
+      case 'f': options.fps = atoi(optarg); break;
+      case 't': options.duration_s = atoi(optarg); break;
+      case 'S': options.start_gap_us = atoi(optarg); break;
+      case 'D': options.data_gap_us = atoi(optarg); break;
+      case 'P': options.spin_us = atoi(optarg); break;
+      case 'm': options.mailbox = true; break;
+      default:
+        PrintUsage(argv[0]);
+        return 1;
+    }
+  }
+  if (options.controllers < 1 || options.fps < 1 || options.duration_s < 1) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  TclManager manager;
+  LedLayout layout = CreateLayout();
+  for (int id = 1; id <= options.controllers; ++id) {
+    manager.AddController(id, kImageWidth, kImageHeight, layout, 2.4);
+    manager.SetControllerAddress(id, options.host, options.port + id - 1);
+    if (options.start_gap_us >= 0 && options.data_gap_us >= 0) {
+      manager.SetPacketPacing(
+          id, options.start_gap_us, options.data_gap_us, options.spin_us);
+    }
+  }
+  manager.SetFrameMailboxMode(options.mailbox);
+  manager.LockControllers();
+  manager.StartMessageLoop(options.fps, true);
+
+  fprintf(stderr, "Waiting for %d controller(s) to initialize...\n",
+          options.controllers);
+  RgbaImage image;
+  image.ResizeStorage(kImageWidth, kImageHeight);
+  FillImage(&image, 0);
+  if (!WaitForControllers(&manager, options.controllers, image))
+    return 1;
+  Sleep(0.2);
+  manager.GetAndClearFrameDelays();
+  for (int id = 1; id <= options.controllers; ++id) {
+    manager.GetAndClearPacketGapHistogram(id);
+    manager.GetAndClearFrameStageHistograms(id);
+  }
+
+  // Keep only a few frames queued, as the real renderer does.
+  // Mailboxes keep only the newest frame, so frames are scheduled
+  // when due, as the visualizer does.
+  int lookahead_ms = (options.mailbox ? 0 : 50);
+  int frame_count = options.fps * options.duration_s;
+  uint64_t start_time = GetCurrentMillis() + 100;
+  for (int frame = 0; frame < frame_count; ++frame) {
+    uint64_t time = start_time + frame * 1000ULL / options.fps;
+    while (GetCurrentMillis() + lookahead_ms < time)
+      SleepUs(1000);
+    FillImage(&image, frame);
+    for (int id = 1; id <= options.controllers; ++id) {
+      manager.ScheduleImageAt(
+          id, image, frame, time, id == options.controllers);
+    }
+  }
+  uint64_t end_time = start_time + frame_count * 1000ULL / options.fps;
+  while (GetCurrentMillis() < end_time + 500 && manager.GetQueueSize() > 0)
+    SleepUs(1000);
+  Sleep(0.2);
+  double elapsed_s = (GetCurrentMillis() - start_time) / 1000.0;
+
+  std::vector<int> delays = manager.GetAndClearFrameDelays();
+  std::sort(delays.begin(), delays.end());
+  int sent_frames = delays.size() / options.controllers;
+  printf("controllers=%d target_fps=%d sent_frames=%d/%d "
+         "sustained_fps=%.1f\n",
+         options.controllers, options.fps, sent_frames, frame_count,
+         sent_frames / std::max(elapsed_s - 0.2, 0.001));
+  printf("frame_delay_ms p50=%d p90=%d p99=%d max=%d\n",
+         GetSortedPercentile(delays, 50), GetSortedPercentile(delays, 90),
+         GetSortedPercentile(delays, 99),
+         (delays.empty() ? 0 : delays.back()));
+  for (int id = 1; id <= options.controllers; ++id) {
+    std::vector<int> gaps = manager.GetAndClearPacketGapHistogram(id);
+    printf("TCL%d packet_gap_us p50=%d p99=%d\n", id,
+           GetHistogramPercentile(gaps, 50), GetHistogramPercentile(gaps, 99));
+    printf("%s", FrameTraceStats::FormatCounts(
+        manager.GetAndClearFrameStageHistograms(id)).c_str());
+  }
+  printf("status: %s\n", manager.GetInitStatus().c_str());
+  return 0;
+}
@@ -0,0 +1,386 @@
+// Copyright 2016, Igor Chernyshev.
+//
+// Emulates a TCL controller on a local UDP port, for testing and
+// benchmarking the sender without the real hardware. Speaks the protocol
+// used by TclController: init/reset, start, 12 data packets and end
+// of frame, replying with 0x55 after each complete frame. Received frames
+// are decoded back into LED colors.
+//
+// Packets can be dropped, reordered and delayed before they are processed,
+// to emulate a lossy network. Prints statistics once per second.
+//
+// Example, for controller 1 redirected with SetControllerAddress():
+//   build/tcl_emulator --port=5001 --loss=1 --reorder=0.5 --delay_us=200
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "tcl/frame_encoder.h"
+#include "util/histogram.h"
+#include "util/logging.h"
+#include "util/time.h"
+
+namespace {
+
+const int kStrandLength = 512;
+const int kFrameLength = kStrandLength * FrameEncoder::kStrandCount * 3;
+const int kDataPacketCount = kFrameLength / 1024;
+const int kDataPrefixSize = 12;
+const int kDataPacketSize = kDataPrefixSize + 1024 + 4;
+
+const uint8_t kMsgInit[] = {0xC5, 0x77, 0x88, 0x00, 0x00};
+const uint8_t kMsgReset[] = {0xC2, 0x77, 0x88, 0x00, 0x00};
+const uint8_t kMsgEndFrame[] = {0xAA, 0x01, 0x8C, 0x01, 0x55};
+const uint8_t kMsgReply[] = {0x55, 0x00, 0x00, 0x00, 0x00};
+
+volatile sig_atomic_t g_is_shutting_down = 0;
+
+void HandleSignal(int signal) {
+  (void) signal;
+  g_is_shutting_down = 1;
+}
+
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 5000;
+  double loss_percent = 0;
+  double reorder_percent = 0;
+  int delay_us = 0;
+  int duration_s = 0;
+  unsigned int seed = 1;
+  bool verbose = false;
+};
+
+struct Packet {
+  std::vector<uint8_t> data;
+  struct sockaddr_in from;
+  uint64_t deliver_time_us;
+};
+
+struct Stats {
+  Stats() : data_gaps(50, 200) {}
+
+  void Clear() {
+    *this = Stats();
+  }
+
+  int packets = 0;
+  int dropped = 0;
+  int reordered = 0;
+  int frames = 0;
+  int incomplete_frames = 0;
+  int inits = 0;
+  int resets = 0;
+  int unknown = 0;
+  // Gaps between received start/data packets, in us.
+  Histogram data_gaps;
+};
+
+class Emulator {
+ public:
+  explicit Emulator(const Options& options)
+      : options_(options), frame_(kFrameLength),
+        colors_(kStrandLength * FrameEncoder::kStrandCount) {}
+
+  ~Emulator() {
+    if (socket_ != -1)
+      close(socket_);
+  }
+
+  bool Bind();
+  void Run();
+
+ private:
+  Emulator(const Emulator& src);
+  Emulator& operator=(const Emulator& rhs);
+
+  bool Chance(double percent) {
+    return (percent > 0 && rand_r(&seed_) < RAND_MAX / 100.0 * percent);
+  }
+
+  void ReceivePackets(uint64_t now);
+  void DeliverPackets(uint64_t now);
+  void ProcessPacket(const Packet& packet, uint64_t now);
+  void CompleteFrame(const Packet& packet);
+  void PrintStats(const char* title, const Stats& stats, double seconds);
+
+  Options options_;
+  unsigned int seed_ = 1;
+  int socket_ = -1;
+  std::deque<Packet> pending_;
+  // Packet held back to be delivered after the next one.
+  std::deque<Packet> held_;
+  bool in_frame_ = false;
+  int received_data_mask_ = 0;
+  uint64_t last_packet_time_us_ = 0;
+  std::vector<uint8_t> frame_;
+  std::vector<uint32_t> colors_;
+  Stats interval_stats_;
+  Stats total_stats_;
+};
+
+bool Emulator::Bind() {
+  seed_ = options_.seed;
+  socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (socket_ == -1) {
+    REPORT_ERRNO("socket");
+    return false;
+  }
+
+  struct sockaddr_in si_local;
+  memset(&si_local, 0, sizeof(si_local));
+  si_local.sin_family = AF_INET;
+  si_local.sin_port = htons(options_.port);
+  if (inet_aton(options_.host.c_str(), &si_local.sin_addr) == 0) {
+    fprintf(stderr, "Invalid address: %s\n", options_.host.c_str());
+    return false;
+  }
+  if (bind(socket_, (struct sockaddr*) &si_local, sizeof(si_local)) == -1) {
+    REPORT_ERRNO("bind");
+    return false;
+  }
+  fprintf(stderr, "Emulating TCL controller on %s:%d\n",
+          options_.host.c_str(), options_.port);
+  return true;
+}
+
+void Emulator::Run() {
+  uint64_t start_time = GetCurrentMicros();
+  uint64_t next_stats_time = start_time + 1000000;
+  uint64_t interval_start = start_time;
+  while (!g_is_shutting_down) {
+    uint64_t now = GetCurrentMicros();
+    if (options_.duration_s &&
+        now - start_time >= options_.duration_s * 1000000ULL) {
+      break;
+    }
+
+    uint64_t wakeup_time = next_stats_time;
+    if (!pending_.empty() && pending_.front().deliver_time_us < wakeup_time)
+      wakeup_time = pending_.front().deliver_time_us;
+    int timeout_ms = 0;
+    if (wakeup_time > now)
+      timeout_ms = static_cast<int>((wakeup_time - now + 999) / 1000);
+
+    struct pollfd fd;
+    fd.fd = socket_;
+    fd.events = POLLIN;
+    fd.revents = 0;
+    int result = poll(&fd, 1, timeout_ms);
+    if (result == -1 && errno != EINTR) {
+      REPORT_ERRNO("poll");
+      break;
+    }
+
+    now = GetCurrentMicros();
+    if (result > 0)
+      ReceivePackets(now);
+    DeliverPackets(now);
+
+    if (now >= next_stats_time) {
+      PrintStats("1s", interval_stats_, (now - interval_start) / 1000000.0);
+      interval_stats_.Clear();
+      interval_start = now;
+      next_stats_time = now + 1000000;
+    }
+  }
+
+  PrintStats("total", total_stats_,
+             (GetCurrentMicros() - start_time) / 1000000.0);
+}
+
+void Emulator::ReceivePackets(uint64_t now) {
+  while (true) {
+    Packet packet;
+    packet.data.resize(65536);
+    socklen_t from_len = sizeof(packet.from);
+    ssize_t size = TEMP_FAILURE_RETRY(recvfrom(
+        socket_, packet.data.data(), packet.data.size(), MSG_DONTWAIT,
+        (struct sockaddr*) &packet.from, &from_len));
+    if (size == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        REPORT_ERRNO("recvfrom");
+      break;
+    }
+    packet.data.resize(size);
+    interval_stats_.packets++;
+    total_stats_.packets++;
+
+    if (Chance(options_.loss_percent)) {
+      interval_stats_.dropped++;
+      total_stats_.dropped++;
+      continue;
+    }
+    packet.deliver_time_us = now + options_.delay_us;
+    pending_.push_back(packet);
+  }
+}
+
+void Emulator::DeliverPackets(uint64_t now) {
+  while (!pending_.empty() && pending_.front().deliver_time_us <= now) {
+    Packet packet = pending_.front();
+    pending_.pop_front();
+    if (held_.empty() && Chance(options_.reorder_percent)) {
+      interval_stats_.reordered++;
+      total_stats_.reordered++;
+      held_.push_back(packet);
+      continue;
+    }
+    ProcessPacket(packet, now);
+    if (!held_.empty()) {
+      ProcessPacket(held_.front(), now);
+      held_.pop_front();
+    }
+  }
+}
+
+void Emulator::ProcessPacket(const Packet& packet, uint64_t now) {
+  const std::vector<uint8_t>& data = packet.data;
+  if (data.size() == sizeof(kMsgInit) &&
+      !memcmp(data.data(), kMsgInit, sizeof(kMsgInit))) {
+    // Init and start of frame use the same message.
+    interval_stats_.inits++;
+    total_stats_.inits++;
+    if (in_frame_) {
+      interval_stats_.incomplete_frames++;
+      total_stats_.incomplete_frames++;
+    }
+    in_frame_ = true;
+    received_data_mask_ = 0;
+    last_packet_time_us_ = now;
+    return;
+  }
+
+  if (data.size() == sizeof(kMsgReset) &&
+      !memcmp(data.data(), kMsgReset, sizeof(kMsgReset))) {
+    interval_stats_.resets++;
+    total_stats_.resets++;
+    in_frame_ = false;
+    return;
+  }
+
+  if (data.size() == kDataPacketSize && data[0] == 0x88) {
+    int idx = data[1];
+    if (!in_frame_ || idx >= kDataPacketCount) {
+      interval_stats_.unknown++;
+      total_stats_.unknown++;
+      return;
+    }
+    memcpy(frame_.data() + idx * 1024, data.data() + kDataPrefixSize, 1024);
+    received_data_mask_ |= (1 << idx);
+    int gap = static_cast<int>(now - last_packet_time_us_);
+    interval_stats_.data_gaps.Add(gap);
+    total_stats_.data_gaps.Add(gap);
+    last_packet_time_us_ = now;
+    return;
+  }
+
+  if (data.size() == sizeof(kMsgEndFrame) &&
+      !memcmp(data.data(), kMsgEndFrame, sizeof(kMsgEndFrame))) {
+    if (in_frame_ && received_data_mask_ == (1 << kDataPacketCount) - 1) {
+      CompleteFrame(packet);
+    } else {
+      interval_stats_.incomplete_frames++;
+      total_stats_.incomplete_frames++;
+    }
+    in_frame_ = false;
+    return;
+  }
+
+  interval_stats_.unknown++;
+  total_stats_.unknown++;
+}
+
+void Emulator::CompleteFrame(const Packet& packet) {
+  interval_stats_.frames++;
+  total_stats_.frames++;
+  FrameEncoder::Decode(frame_.data(), kStrandLength, colors_.data());
+  if (options_.verbose) {
+    fprintf(stderr, "Frame %d, first LED's:", total_stats_.frames);
+    for (int i = 0; i < FrameEncoder::kStrandCount; ++i)
+      fprintf(stderr, " %06X", colors_[i * kStrandLength] & 0xFFFFFF);
+    fprintf(stderr, "\n");
+  }
+
+  if (sendto(socket_, kMsgReply, sizeof(kMsgReply), 0,
+             (const struct sockaddr*) &packet.from,
+             sizeof(packet.from)) == -1) {
+    REPORT_ERRNO("sendto");
+  }
+}
+
+void Emulator::PrintStats(
+    const char* title, const Stats& stats, double seconds) {
+  fprintf(stderr,
+          "[%s] fps=%.1f frames=%d incomplete=%d packets=%d dropped=%d "
+          "reordered=%d inits=%d resets=%d unknown=%d "
+          "gap_p50=%dus gap_p99=%dus\n",
+          title, (seconds > 0 ? stats.frames / seconds : 0), stats.frames,
+          stats.incomplete_frames, stats.packets, stats.dropped,
+          stats.reordered, stats.inits, stats.resets, stats.unknown,
+          stats.data_gaps.GetPercentile(50),
+          stats.data_gaps.GetPercentile(99));
+}
+
+void PrintUsage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [--host=127.0.0.1] [--port=5000] [--loss=PERCENT]\n"
+          "    [--reorder=PERCENT] [--delay_us=US] [--duration_s=S]\n"
+          "    [--seed=N] [--verbose]\n", name);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  static const struct option kOptions[] = {
+      {"host", required_argument, nullptr, 'h'},
+      {"port", required_argument, nullptr, 'p'},
+      {"loss", required_argument, nullptr, 'l'},
+      {"reorder", required_argument, nullptr, 'r'},
+      {"delay_us", required_argument, nullptr, 'd'},
+      {"duration_s", required_argument, nullptr, 't'},
+      {"seed", required_argument, nullptr, 's'},
+      {"verbose", no_argument, nullptr, 'v'},
+      {nullptr, 0, nullptr, 0}};
+
+  Options options;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", kOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 'h': options.host = optarg; break;
+      case 'p': options.port = atoi(optarg); break;
+      case 'l': options.loss_percent = atof(optarg); break;
+      case 'r': options.reorder_percent = atof(optarg); break;
+      case 'd': options.delay_us = atoi(optarg); break;
+      case 't': options.duration_s = atoi(optarg); break;
+      case 's': options.seed = atoi(optarg); break;
+      case 'v': options.verbose = true; break;
+      default:
+        PrintUsage(argv[0]);
+        return 1;
+    }
+  }
+
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+
+  Emulator emulator(options);
+  if (!emulator.Bind())
+    return 1;
+  emulator.Run();
+  return 0;
+}
@@ -0,0 +1,59 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "util/fft.h"
+
+#include <math.h>
+
+#include "util/logging.h"
+
+PowerSpectrum::PowerSpectrum(int size)
+    : size_(size), window_(size), bit_reverse_(size),
+      cos_table_(size / 2), sin_table_(size / 2), re_(size), im_(size) {
+  CHECK(size >= 2 && (size & (size - 1)) == 0);
+  int bits = 0;
+  while ((1 << bits) < size)
+    ++bits;
+  for (int i = 0; i < size; ++i) {
+    window_[i] = 0.5 - 0.5 * cos(2 * M_PI * i / size);
+    int reversed = 0;
+    for (int b = 0; b < bits; ++b) {
+      if (i & (1 << b))
+        reversed |= 1 << (bits - 1 - b);
+    }
+    bit_reverse_[i] = reversed;
+  }
+  for (int i = 0; i < size / 2; ++i) {
+    cos_table_[i] = cos(2 * M_PI * i / size);
+    sin_table_[i] = -sin(2 * M_PI * i / size);
+  }
+}
+
+void PowerSpectrum::Compute(const float* input, float* power) {
+  for (int i = 0; i < size_; ++i) {
+    int j = bit_reverse_[i];
+    re_[j] = input[i] * window_[i];
+    im_[j] = 0;
+  }
+
+  for (int len = 2; len <= size_; len *= 2) {
+    int half = len / 2;
+    int step = size_ / len;
+    for (int start = 0; start < size_; start += len) {
+      for (int k = 0; k < half; ++k) {
+        float w_re = cos_table_[k * step];
+        float w_im = sin_table_[k * step];
+        int a = start + k;
+        int b = a + half;
+        float t_re = re_[b] * w_re - im_[b] * w_im;
+        float t_im = re_[b] * w_im + im_[b] * w_re;
+        re_[b] = re_[a] - t_re;
+        im_[b] = im_[a] - t_im;
+        re_[a] += t_re;
+        im_[a] += t_im;
+      }
+    }
+  }
+
+  for (int i = 0; i <= size_ / 2; ++i)
+    power[i] = re_[i] * re_[i] + im_[i] * im_[i];
+}
@@ -0,0 +1,35 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_FFT_H_
+#define UTIL_FFT_H_
+
+#include <vector>
+
+// Computes power spectrum of real signal blocks with radix-2 FFT,
+// applying a Hann window. Tables are prepared in the constructor,
+// so that Compute() does not allocate. Not thread-safe.
+class PowerSpectrum {
+ public:
+  // |size| must be a power of two.
+  explicit PowerSpectrum(int size);
+
+  int size() const { return size_; }
+
+  // Reads |size| samples from |input|, and stores |size| / 2 + 1 powers
+  // into |power|, from DC to Nyquist frequency.
+  void Compute(const float* input, float* power);
+
+ private:
+  PowerSpectrum(const PowerSpectrum& src);
+  PowerSpectrum& operator=(const PowerSpectrum& rhs);
+
+  int size_;
+  std::vector<float> window_;
+  std::vector<int> bit_reverse_;
+  std::vector<float> cos_table_;
+  std::vector<float> sin_table_;
+  std::vector<float> re_;
+  std::vector<float> im_;
+};
+
+#endif  // UTIL_FFT_H_
@@ -0,0 +1,116 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "util/frame_trace.h"
+
+#include <stdio.h>
+
+#include "util/logging.h"
+#include "util/time.h"
+
+void FrameTrace::Clear() {
+  frame_id = 0;
+  for (int i = 0; i < FRAME_STAGE_COUNT; ++i)
+    stage_us[i] = 0;
+}
+
+void FrameTrace::Mark(FrameStage stage) {
+  stage_us[stage] = GetCurrentMicros();
+}
+
+FrameTraceStats::FrameTraceStats()
+    : rows_(kRowCount, Histogram(kBucketUs, kBucketCount)) {}
+
+void FrameTraceStats::Add(const FrameTrace& trace) {
+  uint64_t first_us = 0;
+  uint64_t prev_us = 0;
+  for (int stage = 0; stage < FRAME_STAGE_COUNT; ++stage) {
+    uint64_t time = trace.stage_us[stage];
+    if (!time)
+      continue;
+    if (!first_us) {
+      first_us = time;
+    } else {
+      // Stages are marked by different threads, but on the same clock.
+      rows_[stage].Add(time > prev_us ? time - prev_us : 0);
+    }
+    prev_us = time;
+  }
+  if (first_us)
+    rows_[FRAME_STAGE_COUNT].Add(prev_us - first_us);
+}
+
+void FrameTraceStats::Clear() {
+  for (size_t i = 0; i < rows_.size(); ++i)
+    rows_[i].Clear();
+}
+
+std::vector<int> FrameTraceStats::GetFlattenedCounts() const {
+  std::vector<int> result;
+  result.reserve(kRowCount * kBucketCount);
+  for (size_t i = 0; i < rows_.size(); ++i) {
+    const std::vector<int>& counts = rows_[i].counts();
+    result.insert(result.end(), counts.begin(), counts.end());
+  }
+  return result;
+}
+
+// static
+std::string FrameTraceStats::FormatCounts(const std::vector<int>& counts) {
+  if (counts.size() != static_cast<size_t>(kRowCount * kBucketCount))
+    return "";
+
+  std::string result;
+  for (int row = 0; row < kRowCount; ++row) {
+    Histogram histogram(kBucketUs, kBucketCount);
+    histogram.AddCounts(std::vector<int>(
+        counts.begin() + row * kBucketCount,
+        counts.begin() + (row + 1) * kBucketCount));
+    if (!histogram.total_count())
+      continue;
+    char line[128];
+    snprintf(line, sizeof(line),
+             "%-13s count=%-6d p50=%.2f p90=%.2f p99=%.2f ms\n",
+             GetStageName(row), histogram.total_count(),
+             histogram.GetPercentile(50) / 1000.0,
+             histogram.GetPercentile(90) / 1000.0,
+             histogram.GetPercentile(99) / 1000.0);
+    result += line;
+  }
+  return result;
+}
+
+// static
+const char* FrameTraceStats::GetStageName(int stage) {
+  switch (stage) {
+    case FRAME_STAGE_RENDER_START:
+      return "render_start";
+    case FRAME_STAGE_RENDER_END:
+      return "render_end";
+    case FRAME_STAGE_READBACK:
+      return "readback";
+    case FRAME_STAGE_POSTED:
+      return "posted";
+    case FRAME_STAGE_IMAGE_BUILT:
+      return "image_built";
+    case FRAME_STAGE_ENQUEUED:
+      return "enqueued";
+    case FRAME_STAGE_DEQUEUED:
+      return "dequeued";
+    case FRAME_STAGE_EFFECTS:
+      return "effects";
+    case FRAME_STAGE_SAMPLED:
+      return "sampled";
+    case FRAME_STAGE_HDR:
+      return "hdr";
+    case FRAME_STAGE_ENCODED:
+      return "encoded";
+    case FRAME_STAGE_FIRST_PACKET:
+      return "first_packet";
+    case FRAME_STAGE_LAST_PACKET:
+      return "last_packet";
+    case FRAME_STAGE_COUNT:
+      return "total";
+    default:
+      return "unknown";
+  }
+}
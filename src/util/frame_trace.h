@@ -0,0 +1,70 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_FRAME_TRACE_H_
+#define UTIL_FRAME_TRACE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "util/histogram.h"
+
+// Points in the render pipeline where a frame is timestamped,
+// in the order in which frames pass them.
+enum FrameStage {
+  FRAME_STAGE_RENDER_START = 0,  // ProjectM starts rendering.
+  FRAME_STAGE_RENDER_END,        // ProjectM has rendered.
+  FRAME_STAGE_READBACK,          // Pixels are read back from GL.
+  FRAME_STAGE_POSTED,            // Visualizer posts the frame to TCL.
+  FRAME_STAGE_IMAGE_BUILT,       // Cropped, rotated and resized.
+  FRAME_STAGE_ENQUEUED,          // Added to the TclManager queue.
+  FRAME_STAGE_DEQUEUED,          // Taken from the queue at its time.
+  FRAME_STAGE_EFFECTS,           // Image effects are applied.
+  FRAME_STAGE_SAMPLED,           // LED colors are sampled from the image.
+  FRAME_STAGE_HDR,               // HDR is applied.
+  FRAME_STAGE_ENCODED,           // LED effects applied, frame encoded.
+  FRAME_STAGE_FIRST_PACKET,      // Start packet is sent.
+  FRAME_STAGE_LAST_PACKET,       // End packet is sent.
+  FRAME_STAGE_COUNT,
+};
+
+// Monotonic timestamps of one frame at each stage, in microseconds.
+// Stages that the frame did not pass, e.g. images that do not come
+// from ProjectM, remain at zero.
+struct FrameTrace {
+  void Clear();
+  void Mark(FrameStage stage);
+
+  uint32_t frame_id = 0;
+  uint64_t stage_us[FRAME_STAGE_COUNT] = {};
+};
+
+// Collects latency histograms of traced frames. For each stage, counts
+// the time since the previous stage that the frame passed. Not thread-safe.
+class FrameTraceStats {
+ public:
+  static const int kBucketUs = 50;
+  static const int kBucketCount = 2000;
+  // Rows are indexed by FrameStage. The extra last row holds latency
+  // from the first to the last stage that the frame passed.
+  static const int kRowCount = FRAME_STAGE_COUNT + 1;
+
+  FrameTraceStats();
+
+  void Add(const FrameTrace& trace);
+  void Clear();
+
+  // Returns kRowCount rows of kBucketCount counts each.
+  std::vector<int> GetFlattenedCounts() const;
+
+  // Formats p50/p90/p99 of each row of flattened counts, in ms.
+  static std::string FormatCounts(const std::vector<int>& counts);
+
+  static const char* GetStageName(int stage);
+
+ private:
+  std::vector<Histogram> rows_;
+};
+
+#endif  // UTIL_FRAME_TRACE_H_
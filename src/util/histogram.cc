@@ -0,0 +1,45 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "util/histogram.h"
+
+#include "util/logging.h"
+
+Histogram::Histogram(int bucket_width, int bucket_count)
+    : bucket_width_(bucket_width), counts_(bucket_count, 0) {
+  CHECK(bucket_width > 0);
+  CHECK(bucket_count > 0);
+}
+
+void Histogram::Add(int value) {
+  int bucket = (value > 0 ? value / bucket_width_ : 0);
+  if (bucket >= static_cast<int>(counts_.size()))
+    bucket = counts_.size() - 1;
+  counts_[bucket]++;
+  total_count_++;
+}
+
+void Histogram::AddCounts(const std::vector<int>& counts) {
+  CHECK(counts.size() == counts_.size());
+  for (size_t i = 0; i < counts.size(); ++i) {
+    counts_[i] += counts[i];
+    total_count_ += counts[i];
+  }
+}
+
+void Histogram::Clear() {
+  counts_.assign(counts_.size(), 0);
+  total_count_ = 0;
+}
+
+int Histogram::GetPercentile(double percentile) const {
+  if (!total_count_)
+    return 0;
+  double target = total_count_ * percentile / 100.0;
+  int sum = 0;
+  for (size_t i = 0; i < counts_.size(); ++i) {
+    sum += counts_[i];
+    if (sum >= target && sum > 0)
+      return (i + 1) * bucket_width_;
+  }
+  return counts_.size() * bucket_width_;
+}
@@ -0,0 +1,34 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_HISTOGRAM_H_
+#define UTIL_HISTOGRAM_H_
+
+#include <vector>
+
+// Counts values in fixed-width buckets, starting at zero. Values past
+// the last bucket are counted in the last bucket. Not thread-safe.
+class Histogram {
+ public:
+  Histogram(int bucket_width, int bucket_count);
+
+  int bucket_width() const { return bucket_width_; }
+  const std::vector<int>& counts() const { return counts_; }
+  int total_count() const { return total_count_; }
+
+  void Add(int value);
+  void Clear();
+
+  // Adds counts of another histogram with the same buckets.
+  void AddCounts(const std::vector<int>& counts);
+
+  // Returns the upper bound of the bucket that holds the given
+  // percentile (0..100) of values, or 0 if there are no values.
+  int GetPercentile(double percentile) const;
+
+ private:
+  int bucket_width_;
+  int total_count_ = 0;
+  std::vector<int> counts_;
+};
+
+#endif  // UTIL_HISTOGRAM_H_
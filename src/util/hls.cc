@@ -0,0 +1,250 @@
+// Copyright 2016, Igor Chernyshev.
+//
+// The math below follows OpenCV's RGB2HLS_f and HLS2RGB_f operations
+// step by step, so that float rounding produces the same 8-bit results.
+
+#include "util/hls.h"
+
+#include <float.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const float kHueRange = 180;
+
+// Maps 8-bit values into [0, 1] range, same as OpenCV's "x * (1.f/255.f)".
+struct ScaleTable {
+  ScaleTable() {
+    for (int i = 0; i < 256; ++i)
+      values[i] = i * (1.f / 255.f);
+  }
+
+  float values[256];
+};
+
+const ScaleTable kScaleTable;
+
+inline uint8_t SaturateRound(float value) {
+  long v = lrintf(value);
+  return static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+inline void RgbaToHlsa(uint8_t* color) {
+  float r = kScaleTable.values[color[0]];
+  float g = kScaleTable.values[color[1]];
+  float b = kScaleTable.values[color[2]];
+  float h = 0.f, s = 0.f, l;
+  float vmin, vmax, diff;
+
+  vmax = vmin = r;
+  if (vmax < g) vmax = g;
+  if (vmax < b) vmax = b;
+  if (vmin > g) vmin = g;
+  if (vmin > b) vmin = b;
+
+  diff = vmax - vmin;
+  l = (vmax + vmin) * 0.5f;
+
+  if (diff > FLT_EPSILON) {
+    s = l < 0.5f ? diff / (vmax + vmin) : diff / (2 - vmax - vmin);
+    diff = 60.f / diff;
+
+    if (vmax == r) {
+      h = (g - b) * diff;
+    } else if (vmax == g) {
+      h = (b - r) * diff + 120.f;
+    } else {
+      h = (r - g) * diff + 240.f;
+    }
+
+    if (h < 0.f) h += 360.f;
+  }
+
+  color[0] = SaturateRound(h * (kHueRange * (1.f / 360.f)));
+  color[1] = SaturateRound(l * 255.f);
+  color[2] = SaturateRound(s * 255.f);
+}
+
+inline void HlsaToRgba(uint8_t* color) {
+  float h = color[0];
+  float l = kScaleTable.values[color[1]];
+  float s = kScaleTable.values[color[2]];
+  float b, g, r;
+
+  if (s == 0) {
+    b = g = r = l;
+  } else {
+    static const int kSectorData[][3] =
+        {{1, 3, 0}, {1, 0, 2}, {3, 0, 1}, {0, 2, 1}, {0, 1, 3}, {2, 1, 0}};
+    float tab[4];
+    int sector;
+
+    float p2 = l <= 0.5f ? l * (1 + s) : l + s - l * s;
+    float p1 = 2 * l - p2;
+
+    h *= 6.f / kHueRange;
+    while (h >= 6) h -= 6;
+
+    sector = static_cast<int>(floorf(h));
+    h -= sector;
+
+    tab[0] = p2;
+    tab[1] = p1;
+    tab[2] = p1 + (p2 - p1) * (1 - h);
+    tab[3] = p1 + (p2 - p1) * h;
+
+    b = tab[kSectorData[sector][0]];
+    g = tab[kSectorData[sector][1]];
+    r = tab[kSectorData[sector][2]];
+  }
+
+  color[0] = SaturateRound(r * 255.f);
+  color[1] = SaturateRound(g * 255.f);
+  color[2] = SaturateRound(b * 255.f);
+}
+
+#ifdef __SSE2__
+
+inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline __m128 Channel(__m128i colors, int shift) {
+  __m128i value = _mm_and_si128(
+      _mm_srli_epi32(colors, shift), _mm_set1_epi32(0xFF));
+  return _mm_mul_ps(_mm_cvtepi32_ps(value), _mm_set1_ps(1.f / 255.f));
+}
+
+// Rounds and saturates three channels, and packs them with the alpha.
+inline __m128i PackColors(__m128 c0, __m128 c1, __m128 c2, __m128i colors) {
+  __m128i v02 = _mm_packs_epi32(_mm_cvtps_epi32(c0), _mm_cvtps_epi32(c2));
+  __m128i v1a = _mm_packs_epi32(
+      _mm_cvtps_epi32(c1), _mm_srli_epi32(colors, 24));
+  // Bytes are now grouped as c0 x4, c2 x4, c1 x4, alpha x4.
+  __m128i bytes = _mm_packus_epi16(v02, v1a);
+  __m128i pairs = _mm_unpacklo_epi8(bytes, _mm_srli_si128(bytes, 8));
+  return _mm_unpacklo_epi16(pairs, _mm_srli_si128(pairs, 8));
+}
+
+inline __m128i RgbaToHlsa4(__m128i colors) {
+  const __m128 zero = _mm_setzero_ps();
+  __m128 r = Channel(colors, 0);
+  __m128 g = Channel(colors, 8);
+  __m128 b = Channel(colors, 16);
+
+  __m128 vmax = _mm_max_ps(_mm_max_ps(r, g), b);
+  __m128 vmin = _mm_min_ps(_mm_min_ps(r, g), b);
+  __m128 diff = _mm_sub_ps(vmax, vmin);
+  __m128 sum = _mm_add_ps(vmax, vmin);
+  __m128 l = _mm_mul_ps(sum, _mm_set1_ps(0.5f));
+
+  __m128 s = Select(
+      _mm_cmplt_ps(l, _mm_set1_ps(0.5f)),
+      _mm_div_ps(diff, sum),
+      _mm_div_ps(diff, _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(2), vmax), vmin)));
+  __m128 scale = _mm_div_ps(_mm_set1_ps(60.f), diff);
+
+  __m128 h_r = _mm_mul_ps(_mm_sub_ps(g, b), scale);
+  __m128 h_g = _mm_add_ps(
+      _mm_mul_ps(_mm_sub_ps(b, r), scale), _mm_set1_ps(120.f));
+  __m128 h_b = _mm_add_ps(
+      _mm_mul_ps(_mm_sub_ps(r, g), scale), _mm_set1_ps(240.f));
+  __m128 h = Select(_mm_cmpeq_ps(vmax, r), h_r,
+                    Select(_mm_cmpeq_ps(vmax, g), h_g, h_b));
+  h = Select(_mm_cmplt_ps(h, zero), _mm_add_ps(h, _mm_set1_ps(360.f)), h);
+
+  __m128 has_hue = _mm_cmpgt_ps(diff, _mm_set1_ps(FLT_EPSILON));
+  h = _mm_and_ps(has_hue, h);
+  s = _mm_and_ps(has_hue, s);
+
+  const __m128 max_value = _mm_set1_ps(255.f);
+  return PackColors(
+      _mm_mul_ps(h, _mm_set1_ps(kHueRange * (1.f / 360.f))),
+      _mm_mul_ps(l, max_value), _mm_mul_ps(s, max_value), colors);
+}
+
+inline __m128i HlsaToRgba4(__m128i colors) {
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 six = _mm_set1_ps(6.f);
+  __m128 h = _mm_cvtepi32_ps(
+      _mm_and_si128(colors, _mm_set1_epi32(0xFF)));
+  __m128 l = Channel(colors, 8);
+  __m128 s = Channel(colors, 16);
+
+  __m128 p2 = Select(
+      _mm_cmple_ps(l, _mm_set1_ps(0.5f)),
+      _mm_mul_ps(l, _mm_add_ps(one, s)),
+      _mm_sub_ps(_mm_add_ps(l, s), _mm_mul_ps(l, s)));
+  __m128 p1 = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(2.f), l), p2);
+
+  // Hue is at most 255, so a single wrap brings it below 6.
+  h = _mm_mul_ps(h, _mm_set1_ps(6.f / kHueRange));
+  h = Select(_mm_cmpge_ps(h, six), _mm_sub_ps(h, six), h);
+
+  __m128i sector = _mm_cvttps_epi32(h);
+  h = _mm_sub_ps(h, _mm_cvtepi32_ps(sector));
+
+  __m128 delta = _mm_sub_ps(p2, p1);
+  __m128 tab2 = _mm_add_ps(p1, _mm_mul_ps(delta, _mm_sub_ps(one, h)));
+  __m128 tab3 = _mm_add_ps(p1, _mm_mul_ps(delta, h));
+
+  __m128 s0 = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(0)));
+  __m128 s1 = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(1)));
+  __m128 s2 = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(2)));
+  __m128 s3 = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(3)));
+  __m128 s4 = _mm_castsi128_ps(_mm_cmpeq_epi32(sector, _mm_set1_epi32(4)));
+
+  // Sector to {b, g, r} mapping is {1,3,0}, {1,0,2}, {3,0,1},
+  // {0,2,1}, {0,1,3}, {2,1,0}, where 0 = p2, 1 = p1, 2 = tab2, 3 = tab3.
+  __m128 b = Select(_mm_or_ps(s0, s1), p1,
+             Select(s2, tab3,
+             Select(_mm_or_ps(s3, s4), p2, tab2)));
+  __m128 g = Select(s0, tab3,
+             Select(_mm_or_ps(s1, s2), p2,
+             Select(s3, tab2, p1)));
+  __m128 r = Select(s1, tab2,
+             Select(_mm_or_ps(s2, s3), p1,
+             Select(s4, tab3, p2)));
+
+  __m128 is_gray = _mm_cmpeq_ps(s, _mm_setzero_ps());
+  b = Select(is_gray, l, b);
+  g = Select(is_gray, l, g);
+  r = Select(is_gray, l, r);
+
+  const __m128 max_value = _mm_set1_ps(255.f);
+  return PackColors(
+      _mm_mul_ps(r, max_value), _mm_mul_ps(g, max_value),
+      _mm_mul_ps(b, max_value), colors);
+}
+
+#endif  // __SSE2__
+
+}  // namespace
+
+void ConvertRgbaToHlsa(uint8_t* colors, int count) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= count; i += 4) {
+    __m128i* ptr = reinterpret_cast<__m128i*>(colors + i * 4);
+    _mm_storeu_si128(ptr, RgbaToHlsa4(_mm_loadu_si128(ptr)));
+  }
+#endif
+  for (; i < count; ++i)
+    RgbaToHlsa(colors + i * 4);
+}
+
+void ConvertHlsaToRgba(uint8_t* colors, int count) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= count; i += 4) {
+    __m128i* ptr = reinterpret_cast<__m128i*>(colors + i * 4);
+    _mm_storeu_si128(ptr, HlsaToRgba4(_mm_loadu_si128(ptr)));
+  }
+#endif
+  for (; i < count; ++i)
+    HlsaToRgba(colors + i * 4);
+}
@@ -0,0 +1,14 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_HLS_H_
+#define UTIL_HLS_H_
+
+#include <stdint.h>
+
+// Batch conversions between RGBA and HLSA colors, operating in place on
+// |count| 4-byte colors. Alpha is preserved. Results are identical to
+// OpenCV's 8-bit CV_RGB2HLS and CV_HLS2RGB, with H in [0, 180] range.
+void ConvertRgbaToHlsa(uint8_t* colors, int count);
+void ConvertHlsaToRgba(uint8_t* colors, int count);
+
+#endif  // UTIL_HLS_H_
@@ -40,6 +40,8 @@
 typedef struct {
 	snd_pcm_t *chandle;
 	int loaded;
+	int use_mmap;
+	snd_pcm_uframes_t period_size;
 } alsaPrivate;
 
 #define VISUAL_LOG_ERROR    1
@@ -68,7 +70,8 @@ typedef struct {
 static const int   inp_alsa_var_channels   = 2;
 
 static int inp_alsa_init_internal (
-    const char *alsa_device, alsaPrivate *priv, unsigned int rate)
+    const char *alsa_device, alsaPrivate *priv, unsigned int rate,
+    unsigned int period_us, unsigned int period_count)
 {
 	snd_pcm_hw_params_t *hwparams = NULL;
 	unsigned int exact_rate;
@@ -94,6 +97,8 @@ static int inp_alsa_init_internal (
 	}
 
 	if (snd_pcm_hw_params_set_access(priv->chandle, hwparams,
+					 priv->use_mmap ?
+					 SND_PCM_ACCESS_MMAP_INTERLEAVED :
 					 SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
 		visual_log(VISUAL_LOG_ERROR, "Error setting access");
 		snd_pcm_hw_params_free(hwparams);
@@ -134,18 +139,19 @@ static int inp_alsa_init_internal (
 		return FALSE;
 	}
 
-	/* Setup a large buffer */
+	/* Short periods keep the latency low, the reader thread
+	   wakes up on every period. */
 
-	tmp = 1000000;
+	tmp = period_us;
 	if (snd_pcm_hw_params_set_period_time_near(priv->chandle, hwparams, &tmp, &dir) < 0) {
 		visual_log(VISUAL_LOG_ERROR, "Error setting period time");
 		snd_pcm_hw_params_free(hwparams);
 		return FALSE;
 	}
 
-	tmp = 1000000*4;
-	if (snd_pcm_hw_params_set_buffer_time_near(priv->chandle, hwparams, &tmp, &dir) < 0){
-		visual_log(VISUAL_LOG_ERROR, "Error setting buffer time");
+	tmp = period_count;
+	if (snd_pcm_hw_params_set_periods_near(priv->chandle, hwparams, &tmp, &dir) < 0){
+		visual_log(VISUAL_LOG_ERROR, "Error setting period count");
 		snd_pcm_hw_params_free(hwparams);
 		return FALSE;
 	}
@@ -157,12 +163,26 @@ static int inp_alsa_init_internal (
 		return FALSE;
 	}
 
+	if (snd_pcm_hw_params_get_period_size(hwparams, &priv->period_size,
+					      &dir) < 0) {
+		visual_log(VISUAL_LOG_ERROR, "Error getting period size");
+		snd_pcm_hw_params_free(hwparams);
+		return FALSE;
+	}
+
 	if (snd_pcm_prepare(priv->chandle) < 0) {
 		visual_log(VISUAL_LOG_ERROR, "Failed to prepare interface");
 		snd_pcm_hw_params_free(hwparams);
 		return FALSE;
 	}
 
+	/* Waiting for a period does not start capture by itself. */
+	if (snd_pcm_start(priv->chandle) < 0) {
+		visual_log(VISUAL_LOG_ERROR, "Failed to start capture");
+		snd_pcm_hw_params_free(hwparams);
+		return FALSE;
+	}
+
 	snd_pcm_hw_params_free(hwparams);
 
 	priv->loaded = TRUE;
@@ -170,10 +190,14 @@ static int inp_alsa_init_internal (
 	return TRUE;
 }
 
-AlsaInputHandle *inp_alsa_init (const char* alsa_device, int rate)
+AlsaInputHandle *inp_alsa_init (
+	const char* alsa_device, int rate,
+	int period_us, int period_count, int use_mmap)
 {
 	alsaPrivate *priv = new alsaPrivate();
-	if (!inp_alsa_init_internal (alsa_device, priv, rate)) {
+	priv->use_mmap = use_mmap;
+	if (!inp_alsa_init_internal (alsa_device, priv, rate,
+				     period_us, period_count)) {
 		delete priv;
 		return NULL;
 	}
@@ -191,6 +215,57 @@ void inp_alsa_cleanup (AlsaInputHandle* handle)
 	delete priv;
 }
 
+int inp_alsa_get_period_size (AlsaInputHandle* handle)
+{
+	alsaPrivate *priv =  (alsaPrivate*) handle;
+	return priv->period_size;
+}
+
+/* Restarts capture after an overrun. */
+static int inp_alsa_recover_overrun (alsaPrivate *priv, int *overrunCount)
+{
+	*overrunCount += 1;
+	visual_log(VISUAL_LOG_WARNING, "ALSA: Buffer Overrun");
+	if (snd_pcm_prepare(priv->chandle) < 0 ||
+	    snd_pcm_start(priv->chandle) < 0) {
+		visual_log(VISUAL_LOG_ERROR, "Failed to prepare interface");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+int inp_alsa_wait (
+	AlsaInputHandle* handle, int timeoutMs, int *overrunCount)
+{
+	alsaPrivate *priv =  (alsaPrivate*) handle;
+
+	*overrunCount = 0;
+	int err = snd_pcm_wait(priv->chandle, timeoutMs);
+	if (err == 1 || err == 0) {
+		return err;
+	}
+	if (err == -EPIPE) {
+		/* Captured data is lost, but the device is ready again. */
+		return inp_alsa_recover_overrun(priv, overrunCount) ? 1 : -1;
+	}
+	if (snd_pcm_recover(priv->chandle, err, 1) < 0) {
+		visual_log(VISUAL_LOG_ERROR, "snd_pcm_wait: %s", snd_strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+int inp_alsa_get_delay (AlsaInputHandle* handle)
+{
+	alsaPrivate *priv =  (alsaPrivate*) handle;
+
+	snd_pcm_sframes_t delay = 0;
+	if (snd_pcm_delay(priv->chandle, &delay) < 0) {
+		return -1;
+	}
+	return delay;
+}
+
 int inp_alsa_read (
 	AlsaInputHandle* handle, int16_t* data,
 	int sampleCount, int *overrunCount)
@@ -200,17 +275,21 @@ int inp_alsa_read (
 	*overrunCount = 0;
 	int rcnt;
 	while (true) {
-		rcnt = snd_pcm_readi(priv->chandle, data, sampleCount);
+		if (priv->use_mmap) {
+			rcnt = snd_pcm_mmap_readi(priv->chandle, data, sampleCount);
+		} else {
+			rcnt = snd_pcm_readi(priv->chandle, data, sampleCount);
+		}
 		if (rcnt >= 0) {
 			return rcnt;
 		}
 
+		if (rcnt == -EAGAIN) {
+			return 0;
+		}
+
 		if (rcnt == -EPIPE) {
-			*overrunCount += 1;
-			visual_log(VISUAL_LOG_WARNING, "ALSA: Buffer Overrun");
-			if (snd_pcm_prepare(priv->chandle) < 0) {
-				visual_log(VISUAL_LOG_ERROR,
-						"Failed to prepare interface");
+			if (!inp_alsa_recover_overrun(priv, overrunCount)) {
 				return -1;
 			}
 			continue;
@@ -11,13 +11,29 @@
 typedef struct {
 } AlsaInputHandle;
 
-// Opens ALSA device for reading by name (e.g. "hw:0,0").
-AlsaInputHandle *inp_alsa_init (const char* alsa_device, int rate);
+// Opens ALSA device for reading by name (e.g. "hw:0,0"). The device
+// interrupts every |period_us|, and buffers |period_count| periods.
+// With |use_mmap|, samples are read through MMAP access.
+AlsaInputHandle *inp_alsa_init (
+	const char* alsa_device, int rate,
+	int period_us, int period_count, int use_mmap);
 
 void inp_alsa_cleanup (AlsaInputHandle* handle);
 
-// Reads stereo PCM data, with sample rate of 44100.
+// Returns the period size in frames.
+int inp_alsa_get_period_size (AlsaInputHandle* handle);
+
+// Waits until a period is available. Returns 1 when ready, 0 on
+// timeout, or -1 on errors. Overruns are recovered from and counted.
+int inp_alsa_wait (
+	AlsaInputHandle* handle, int timeoutMs, int *overrunCount);
+
+// Returns the number of captured frames not yet read, or -1.
+int inp_alsa_get_delay (AlsaInputHandle* handle);
+
+// Reads stereo PCM data, with sample rate of 44100, without blocking.
 // |data| must accomodate twice the the amount of |sampleCount|.
+// Returns 0 if no data is available, or -1 on errors.
 int inp_alsa_read (
 	AlsaInputHandle* handle, int16_t* data,
 	int sampleCount, int *overrunCount);
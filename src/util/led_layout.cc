@@ -3,8 +3,10 @@
 #include "util/led_layout.h"
 
 #include <memory.h>
-#include <opencv2/opencv.hpp>
 
+#include <algorithm>
+
+#include "util/hls.h"
 #include "util/logging.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -71,40 +73,21 @@ int LedLayoutMap::GetLedCount(int strand_id) const {
   return (strand ? strand->leds.size() : 0);
 }
 
-std::vector<LedCoord> LedLayoutMap::GetLedCoords(int strand_id,
-						 int led_id) const {
+const std::vector<LedCoord>& LedLayoutMap::GetLedCoords(int strand_id,
+							int led_id) const {
   const StrandData* strand = FindStrand(strand_id);
   if (!strand || static_cast<size_t>(led_id) >= strand->leds.size())
-    return std::vector<LedCoord>();
+    return empty_coords_;
 
   return strand->leds.at(led_id).pixel_coords;
 }
 
-const std::vector<LedAddress>& LedLayoutMap::GetHdrSiblings(
-    int strand_id, int led_id) const {
-  const StrandData* strand = FindStrand(strand_id);
-  if (!strand || static_cast<size_t>(led_id) >= strand->leds.size())
-    return empty_addresses_;
-
-  return strand->leds.at(led_id).hdr_siblings;
-}
-
 void LedLayoutMap::AddLedAndCoord(int strand_id,
 				  int led_id,
 				  const LedCoord& coord) {
   GetLedData(strand_id, led_id)->pixel_coords.push_back(coord);
 }
 
-void LedLayoutMap::AddHdrSibling(int strand_id,
-				 int led_id,
-				 int strand_id2,
-				 int led_id2) {
-  CHECK(strand_id2 >= 0);
-  CHECK(led_id2 >= 0);
-  GetLedData(strand_id, led_id)->hdr_siblings.push_back(
-      LedAddress(strand_id2, led_id2));
-}
-
 LedLayoutMap::StrandData* LedLayoutMap::FindStrand(int strand_id) {
   CHECK(strand_id >= 0);
   return (static_cast<size_t>(strand_id) < strands_.size() ?
@@ -172,7 +155,15 @@ void LedLayoutMap::CopyLedToPixelMapping(int dst_x,
 }
 
 void LedLayoutMap::PopulateLayoutMap(const LedLayout& layout) {
+  // Keep all LED's, even those that do not map to any pixel, so that
+  // LedStrands created from this map match the layout.
   int strand_count = layout.GetStrandCount();
+  for (int strand_id = 0; strand_id < strand_count; ++strand_id) {
+    int led_count = layout.GetLedCount(strand_id);
+    if (led_count > 0)
+      GetLedData(strand_id, led_count - 1);
+  }
+
   for (int strand_id = 0; strand_id < strand_count; ++strand_id) {
     int led_count = layout.GetLedCount(strand_id);
     for (int led_id = 0; led_id < led_count; ++led_id) {
@@ -210,43 +201,43 @@ void LedLayoutMap::PopulateLayoutMap(const LedLayout& layout) {
     }
   }
 
-  // Find HDR siblings.
-  // TODO(igorc): Compute max distance instead of hard-coding.
-  static const int kHdrSiblingsDistance = 13;
-  int max_distance2 = kHdrSiblingsDistance * kHdrSiblingsDistance;
-  for (int strand_id1 = 0; strand_id1 < strand_count; ++strand_id1) {
-    int led_count1 = layout.GetLedCount(strand_id1);
-    for (int led_id1 = 0; led_id1 < led_count1; ++led_id1) {
-      LedCoord coord1;
-      if (!layout.GetLedCoord(strand_id1, led_id1, &coord1))
-	continue;
-
-      for (int strand_id2 = 0; strand_id2 < strand_count; ++strand_id2) {
-        int led_count2 = layout.GetLedCount(strand_id2);
-        for (int led_id2 = 0; led_id2 < led_count2; ++led_id2) {
-          LedCoord coord2;
-          if (!layout.GetLedCoord(strand_id2, led_id2, &coord2))
-            continue;
-
-          int x_d = coord2.x - coord1.x;
-          int y_d = coord1.y - coord1.y;
-          int distance2 = x_d * x_d + y_d * y_d;
-          if (distance2 < max_distance2)
-            AddHdrSibling(strand_id1, led_id1, strand_id2, led_id2);
-        }
-      }
-    }
-  }
+  BuildLayoutCoords(layout);
+  BuildSampleTable();
 
   // TODO(igorc): Warn when no coordingates were found.
+}
+
+void LedLayoutMap::BuildLayoutCoords(const LedLayout& layout) {
+  layout_coords_.clear();
+  for (size_t strand_id = 0; strand_id < strands_.size(); ++strand_id) {
+    for (size_t led_id = 0; led_id < strands_[strand_id].leds.size();
+         ++led_id) {
+      LedCoord coord;
+      layout.GetLedCoord(strand_id, led_id, &coord);
+      layout_coords_.push_back(coord);
+    }
+  }
+}
 
-  /*for (int strand_id  = 0; strand_id < STRAND_COUNT; ++strand_id) {
-    for (int led_id = 0; led_id < layout_.lengths_[strand_id]; ++led_id) {
-      fprintf(stderr, "HDR siblings: strand=%d, led=%d, count=%ld\n",
-              strand_id, led_id,
-              layout_.hdr_siblings_[strand_id][led_id].size());
+void LedLayoutMap::BuildSampleTable() {
+  sample_ranges_.clear();
+  sample_offsets_.clear();
+  for (size_t strand_id = 0; strand_id < strands_.size(); ++strand_id) {
+    const StrandData& strand = strands_[strand_id];
+    for (size_t led_id = 0; led_id < strand.leds.size(); ++led_id) {
+      const std::vector<LedCoord>& coords = strand.leds[led_id].pixel_coords;
+      LedRange range;
+      range.start = sample_offsets_.size();
+      range.count = coords.size();
+      // All coordinates were bounds-checked in MapLedToPixel().
+      for (size_t c_id = 0; c_id < coords.size(); ++c_id) {
+        sample_offsets_.push_back(
+            (coords[c_id].y * width_ + coords[c_id].x) * 4);
+      }
+      std::sort(sample_offsets_.begin() + range.start, sample_offsets_.end());
+      sample_ranges_.push_back(range);
     }
-  }*/
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -287,19 +278,11 @@ void LedStrands::ConvertTo(Type type) {
     return;
 
   type_ = type;
-  uint32_t tmp = 0;
-  cv::Mat hls(1, 1, CV_8UC3, &tmp);
-  cv::Mat rgb(1, 1, CV_8UC3, &tmp);
-  for (int i = 0; i < GetTotalLedCount(); ++i) {
-    uint8_t* color_ptr = &color_data_[i * 4];
-    if (type_ == TYPE_HSL) {
-      memcpy(rgb.data, color_ptr, 3);
-      cv::cvtColor(rgb, hls, CV_RGB2HLS);
-      memcpy(color_ptr, hls.data, 3);
-    } else {
-      memcpy(hls.data, color_ptr, 3);
-      cv::cvtColor(hls, rgb, CV_HLS2RGB);
-      memcpy(color_ptr, rgb.data, 3);
-    }
+  if (color_data_.empty())
+    return;
+  if (type_ == TYPE_HSL) {
+    ConvertRgbaToHlsa(&color_data_[0], GetTotalLedCount());
+  } else {
+    ConvertHlsaToRgba(&color_data_[0], GetTotalLedCount());
   }
 }
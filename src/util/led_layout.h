@@ -48,6 +48,12 @@ struct LedLayout {
   std::vector<StrandInfo> strands_;
 };
 
+// Range of entries that belong to one LED in a flat table of LedLayoutMap.
+struct LedRange {
+  uint32_t start = 0;
+  uint32_t count = 0;
+};
+
 // Assists in mapping LedLayout to a pixel image.
 class LedLayoutMap {
  public:
@@ -55,17 +61,29 @@ class LedLayoutMap {
 
   int GetStrandCount() const;
   int GetLedCount(int strand_id) const;
+  int GetTotalLedCount() const { return sample_ranges_.size(); }
+
+  const std::vector<LedCoord>& GetLedCoords(int strand_id, int led_id) const;
 
-  std::vector<LedCoord> GetLedCoords(int strand_id, int led_id) const;
-  const std::vector<LedAddress>& GetHdrSiblings(
-      int strand_id, int led_id) const;
+  // Compiled sampling table. Ranges are indexed by the LED's position
+  // in LedStrands color data, and point into GetSampleOffsets(), which
+  // contains RGBA byte offsets into the image, sorted in row-major order.
+  const std::vector<LedRange>& GetSampleRanges() const {
+    return sample_ranges_;
+  }
+  const std::vector<uint32_t>& GetSampleOffsets() const {
+    return sample_offsets_;
+  }
 
+  // Layout coordinates of all LED's, in the order of LedStrands color data.
+  const std::vector<LedCoord>& GetLayoutCoords() const {
+    return layout_coords_;
+  }
   void PopulateLayoutMap(const LedLayout& layout);
 
  private:
   struct LedData {
     std::vector<LedCoord> pixel_coords;
-    std::vector<LedAddress> hdr_siblings;
   };
 
   struct StrandData {
@@ -82,9 +100,10 @@ class LedLayoutMap {
   };
 
   void MapLedToPixel(int strand_id, int led_id, int x, int y);
+  void BuildSampleTable();
+  void BuildLayoutCoords(const LedLayout& layout);
   void CopyLedToPixelMapping(int dst_x, int dst_y, int src_x, int src_y);
   void AddLedAndCoord(int strand_id, int led_id, const LedCoord& coord);
-  void AddHdrSibling(int strand_id, int led_id, int strand_id2, int led_id2);
   StrandData* FindStrand(int strand_id);
   const StrandData* FindStrand(int strand_id) const;
   StrandData* FindOrCreateStrand(int strand_id);
@@ -95,7 +114,10 @@ class LedLayoutMap {
   int height_;
   std::vector<PixelUsage> pixel_usage_;
   std::vector<StrandData> strands_;
-  std::vector<LedAddress> empty_addresses_;
+  std::vector<LedRange> sample_ranges_;
+  std::vector<uint32_t> sample_offsets_;
+  std::vector<LedCoord> layout_coords_;
+  std::vector<LedCoord> empty_coords_;
 };
 
 // Contains color data for individual LED's.
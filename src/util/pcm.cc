@@ -0,0 +1,74 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "util/pcm.h"
+
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void ConvertPcmS16ToFloat(
+    const int16_t* src, int count, float gain, float* dst,
+    PcmLevels* levels) {
+  const float scale = gain / 32768.0f;
+  float sum_l = 0;
+  float sum_r = 0;
+  float peak = 0;
+  int i = 0;
+#ifdef __SSE2__
+  // Four stereo frames per iteration. Even lanes hold left samples,
+  // odd lanes hold right ones.
+  const __m128 scale4 = _mm_set1_ps(scale);
+  const __m128 max4 = _mm_set1_ps(1.0f);
+  const __m128 min4 = _mm_set1_ps(-1.0f);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+  __m128 sum4 = _mm_setzero_ps();
+  __m128 peak4 = _mm_setzero_ps();
+  for (; i + 4 <= count; i += 4) {
+    __m128i s16 = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(src + i * 2));
+    // Sign-extends by moving each sample into the upper half.
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s16, s16), 16);
+    __m128 f_lo = _mm_mul_ps(_mm_cvtepi32_ps(lo), scale4);
+    __m128 f_hi = _mm_mul_ps(_mm_cvtepi32_ps(hi), scale4);
+    f_lo = _mm_max_ps(_mm_min_ps(f_lo, max4), min4);
+    f_hi = _mm_max_ps(_mm_min_ps(f_hi, max4), min4);
+    _mm_storeu_ps(dst + i * 2, f_lo);
+    _mm_storeu_ps(dst + i * 2 + 4, f_hi);
+    sum4 = _mm_add_ps(sum4, _mm_mul_ps(f_lo, f_lo));
+    sum4 = _mm_add_ps(sum4, _mm_mul_ps(f_hi, f_hi));
+    peak4 = _mm_max_ps(peak4, _mm_and_ps(f_lo, abs_mask));
+    peak4 = _mm_max_ps(peak4, _mm_and_ps(f_hi, abs_mask));
+  }
+  float sums[4];
+  float peaks[4];
+  _mm_storeu_ps(sums, sum4);
+  _mm_storeu_ps(peaks, peak4);
+  sum_l = sums[0] + sums[2];
+  sum_r = sums[1] + sums[3];
+  for (int k = 0; k < 4; ++k) {
+    if (peaks[k] > peak)
+      peak = peaks[k];
+  }
+#endif
+  for (; i < count; ++i) {
+    float s_l = src[i * 2] * scale;
+    float s_r = src[i * 2 + 1] * scale;
+    s_l = (s_l > 1.0f ? 1.0f : (s_l < -1.0f ? -1.0f : s_l));
+    s_r = (s_r > 1.0f ? 1.0f : (s_r < -1.0f ? -1.0f : s_r));
+    dst[i * 2] = s_l;
+    dst[i * 2 + 1] = s_r;
+    sum_l += s_l * s_l;
+    sum_r += s_r * s_r;
+    peak = fmaxf(peak, fmaxf(fabsf(s_l), fabsf(s_r)));
+  }
+
+  levels->peak = peak;
+  if (count > 0) {
+    levels->rms = (sqrtf(sum_l / count) + sqrtf(sum_r / count)) / 2.0f;
+  } else {
+    levels->rms = 0;
+  }
+}
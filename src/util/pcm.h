@@ -0,0 +1,23 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_PCM_H_
+#define UTIL_PCM_H_
+
+#include <stdint.h>
+
+// Signal levels of a stereo buffer, after gain and clipping.
+struct PcmLevels {
+  // Average of the left and right channel RMS.
+  float rms = 0;
+  // Largest absolute sample in either channel.
+  float peak = 0;
+};
+
+// Converts |count| interleaved S16 stereo frames into floats in [-1, 1]
+// range, multiplying them by |gain| and clipping, and measures levels
+// of the result. All of this is done in a single pass over the buffer.
+void ConvertPcmS16ToFloat(
+    const int16_t* src, int count, float gain, float* dst,
+    PcmLevels* levels);
+
+#endif  // UTIL_PCM_H_
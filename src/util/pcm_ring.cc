@@ -0,0 +1,74 @@
+// Copyright 2016, Igor Chernyshev.
+
+#include "util/pcm_ring.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "util/logging.h"
+
+namespace {
+
+// The writer can lap the reader only if the reader is preempted
+// for the duration of the whole ring.
+const int kMaxReadAttempts = 4;
+
+}  // namespace
+
+PcmRing::PcmRing(int capacity)
+    : capacity_(1), write_pos_(0), reserved_pos_(0),
+      last_write_time_us_(0) {
+  CHECK(capacity > 0);
+  while (capacity_ < capacity)
+    capacity_ *= 2;
+  frames_.reset(new std::atomic<uint32_t>[capacity_]);
+  for (int i = 0; i < capacity_; ++i)
+    frames_[i].store(0, std::memory_order_relaxed);
+}
+
+void PcmRing::Write(const int16_t* frames, int count, uint64_t time_us) {
+  CHECK(count <= capacity_);
+  uint64_t pos = write_pos_.load(std::memory_order_relaxed);
+  // Announces the frames to be overwritten before writing any of them.
+  reserved_pos_.store(pos + count, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  int mask = capacity_ - 1;
+  for (int i = 0; i < count; ++i) {
+    uint32_t frame;
+    memcpy(&frame, frames + i * 2, sizeof(frame));
+    frames_[(pos + i) & mask].store(frame, std::memory_order_relaxed);
+  }
+  // Readers that observe the new position also observe the frames.
+  write_pos_.store(pos + count, std::memory_order_release);
+  last_write_time_us_.store(time_us, std::memory_order_release);
+}
+
+int PcmRing::ReadNewest(
+    int16_t* dst, int max_count, uint64_t* read_pos) const {
+  int mask = capacity_ - 1;
+  for (int attempt = 0; attempt < kMaxReadAttempts; ++attempt) {
+    uint64_t end = write_pos_.load(std::memory_order_acquire);
+    uint64_t start = std::max(*read_pos, end - std::min<uint64_t>(
+        end, std::min(max_count, capacity_)));
+    if (start >= end) {
+      *read_pos = end;
+      return 0;
+    }
+    int count = end - start;
+    for (int i = 0; i < count; ++i) {
+      uint32_t frame = frames_[(start + i) & mask].load(
+          std::memory_order_relaxed);
+      memcpy(dst + i * 2, &frame, sizeof(frame));
+    }
+    // If any copied frame was overwritten, the fences guarantee that
+    // its reservation is visible here.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t reserved = reserved_pos_.load(std::memory_order_relaxed);
+    if (reserved - start <= static_cast<uint64_t>(capacity_)) {
+      *read_pos = end;
+      return count;
+    }
+  }
+  return 0;
+}
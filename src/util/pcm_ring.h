@@ -0,0 +1,55 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_PCM_RING_H_
+#define UTIL_PCM_RING_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+// Lock-free ring of interleaved S16 stereo frames, for one writer and
+// one reader thread. The writer never waits, and overwrites the oldest
+// frames. The reader copies the newest frames, and detects frames that
+// were overwritten while it was copying. Each stereo frame is stored
+// as one 32-bit atomic, so frames are never torn.
+class PcmRing {
+ public:
+  // |capacity| is rounded up to a power of two.
+  explicit PcmRing(int capacity);
+
+  int capacity() const { return capacity_; }
+
+  // Appends |count| stereo frames and records |time_us| as
+  // the capture time of the last one.
+  void Write(const int16_t* frames, int count, uint64_t time_us);
+
+  // Copies up to |max_count| newest frames written after |*read_pos|
+  // into |dst|, oldest first, and advances |*read_pos|. Frames that did
+  // not fit are skipped. Start with zero |*read_pos| to read the newest
+  // frames. Returns the number of copied frames.
+  int ReadNewest(int16_t* dst, int max_count, uint64_t* read_pos) const;
+
+  // Returns the total number of frames ever written.
+  uint64_t write_pos() const {
+    return write_pos_.load(std::memory_order_acquire);
+  }
+
+  // Returns the capture time of the newest frame, or 0.
+  uint64_t last_write_time_us() const {
+    return last_write_time_us_.load(std::memory_order_acquire);
+  }
+
+ private:
+  PcmRing(const PcmRing& src);
+  PcmRing& operator=(const PcmRing& rhs);
+
+  int capacity_;
+  std::unique_ptr<std::atomic<uint32_t>[]> frames_;
+  std::atomic<uint64_t> write_pos_;
+  // Position up to which the writer may be overwriting frames.
+  std::atomic<uint64_t> reserved_pos_;
+  std::atomic<uint64_t> last_write_time_us_;
+};
+
+#endif  // UTIL_PCM_RING_H_
@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
+
 #include "util/logging.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -36,12 +38,12 @@ void RgbGamma::SetGammaRanges(
 
   for (int i = 0; i < 256; i++) {
     double d = ((double) i) / 255.0;
-    gamma_r_[i] =
-        (int) (r_min + floor((r_max - r_min) * pow(d, r_gamma) + 0.5));
-    gamma_g_[i] =
-        (int) (g_min + floor((g_max - g_min) * pow(d, g_gamma) + 0.5));
-    gamma_b_[i] =
-        (int) (b_min + floor((b_max - b_min) * pow(d, b_gamma) + 0.5));
+    gamma_r_[i] = static_cast<uint8_t>(
+        r_min + floor((r_max - r_min) * pow(d, r_gamma) + 0.5));
+    gamma_g_[i] = static_cast<uint8_t>(
+        g_min + floor((g_max - g_min) * pow(d, g_gamma) + 0.5));
+    gamma_b_[i] = static_cast<uint8_t>(
+        b_min + floor((b_max - b_min) * pow(d, b_gamma) + 0.5));
   }
 }
 
@@ -58,36 +60,66 @@ void RgbGamma::Apply(uint8_t* dst, const uint8_t* src, int w, int h) const {
 // RgbaImage
 ////////////////////////////////////////////////////////////////////////////////
 
-RgbaImage::RgbaImage() {
-  Set(NULL, 0, 0);
-}
+RgbaImage::RgbaImage() : width_(0), height_(0) {}
 
 RgbaImage::RgbaImage(const uint8_t* data, int w, int h) {
   Set(data, w, h);
 }
 
-RgbaImage::RgbaImage(const RgbaImage& src) {
-  Set(src.data_, src.width_, src.height_);
-}
+RgbaImage::RgbaImage(const RgbaImage& src)
+    : data_(src.data_), width_(src.width_), height_(src.height_),
+      trace_(src.trace_) {}
 
 RgbaImage& RgbaImage::operator=(const RgbaImage& rhs) {
-  // We could avoid memory copies... but it is not a big deal yet.
-  Set(rhs.data_, rhs.width_, rhs.height_);
+  data_ = rhs.data_;
+  width_ = rhs.width_;
+  height_ = rhs.height_;
+  trace_ = rhs.trace_;
   return *this;
 }
 
 RgbaImage::~RgbaImage() {}
 
+void RgbaImage::Clear() {
+  data_.reset();
+  width_ = 0;
+  height_ = 0;
+  trace_.Clear();
+}
+
+bool RgbaImage::is_shared() const {
+  if (!data_)
+    return false;
+  // use_count() is a relaxed load, so it does not order the caller's
+  // writes after the last reads by other threads on its own.
+  if (data_.use_count() != 1)
+    return true;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return false;
+}
+
 void RgbaImage::ResizeStorage(int w, int h) {
   width_ = w;
   height_ = h;
-  data_.resize(RGBA_LEN(w, h));
+  if (is_shared() || !data_) {
+    data_ = std::make_shared<std::vector<uint8_t>>(RGBA_LEN(w, h));
+  } else {
+    data_->resize(RGBA_LEN(w, h));
+  }
+}
+
+uint8_t* RgbaImage::mutable_data() {
+  if (empty())
+    return nullptr;
+  if (is_shared())
+    data_ = std::make_shared<std::vector<uint8_t>>(*data_);
+  return &(*data_)[0];
 }
 
 void RgbaImage::Set(const uint8_t* data, int w, int h) {
   ResizeStorage(w, h);
-  if (data_.size())
-    memcpy(&data_[0], data, data_.size());
+  if (!empty())
+    memcpy(&(*data_)[0], data, data_->size());
 }
 
 void RgbaImage::Set(const std::vector<uint8_t>& data, int w, int h) {
@@ -110,13 +142,20 @@ std::unique_ptr<RgbaImage> RgbaImage::CloneAndClear(bool null_if_empty) {
 
 // Resizes image using bilinear interpolation.
 void ResizeImage(
-    const uint8_t* src, int src_w, int src_h,
+    const uint8_t* src, int src_w, int src_h, int src_stride,
     uint8_t* dst, int dst_w, int dst_h) {
-  const cv::Mat src_img(src_h, src_w, CV_8UC4, const_cast<uint8_t*>(src));
-  cv::Mat dst_img(cv::Size(dst_w, dst_h), CV_8UC4);
+  const cv::Mat src_img(src_h, src_w, CV_8UC4, const_cast<uint8_t*>(src),
+                        src_stride * 4);
+  // Resize directly into |dst|, as the size and type already match.
+  cv::Mat dst_img(dst_h, dst_w, CV_8UC4, dst);
   cv::resize(src_img, dst_img, dst_img.size());
-  dst_img = dst_img.clone();  // Make it contiguous
-  memcpy(dst, dst_img.data, RGBA_LEN(dst_w, dst_h));
+  CHECK(dst_img.data == dst);
+}
+
+void ResizeImage(
+    const uint8_t* src, int src_w, int src_h,
+    uint8_t* dst, int dst_w, int dst_h) {
+  ResizeImage(src, src_w, src_h, src_w, dst, dst_w, dst_h);
 }
 
 uint8_t* ResizeImage(
@@ -126,13 +165,17 @@ uint8_t* ResizeImage(
   return dst;
 }
 
-uint8_t* FlipImage(const uint8_t* src, int w, int h, bool horizontal) {
+void FlipImage(
+    const uint8_t* src, int w, int h, bool horizontal, uint8_t* dst) {
   const cv::Mat src_img(h, w, CV_8UC4, const_cast<uint8_t*>(src));
-  cv::Mat dst_img(cv::Size(w, h), CV_8UC4);
+  cv::Mat dst_img(h, w, CV_8UC4, dst);
   cv::flip(src_img, dst_img, (horizontal ? 1 : 0));
-  int dst_len = w * h * 4;
-  uint8_t* dst = new uint8_t[dst_len];
-  memcpy(dst, dst_img.data, dst_len);
+  CHECK(dst_img.data == dst);
+}
+
+uint8_t* FlipImage(const uint8_t* src, int w, int h, bool horizontal) {
+  uint8_t* dst = new uint8_t[RGBA_LEN(w, h)];
+  FlipImage(src, w, h, horizontal, dst);
   return dst;
 }
 
@@ -155,12 +198,14 @@ uint8_t* RotateImage(
 uint8_t* CropImage(
     const uint8_t* src, int src_w, int src_h,
     int crop_x, int crop_y, int crop_w, int crop_h) {
-  const cv::Mat src_img(src_h, src_w, CV_8UC4, const_cast<uint8_t*>(src));
-  cv::Rect roi(crop_x, crop_y, crop_w, crop_h);
-  cv::Mat dst_img = src_img(roi);
-  int dst_len = RGBA_LEN(crop_w, crop_h);
-  uint8_t* dst = new uint8_t[dst_len];
-  memcpy(dst, dst_img.clone().data, dst_len);
+  CHECK(crop_x >= 0 && crop_y >= 0 &&
+        crop_x + crop_w <= src_w && crop_y + crop_h <= src_h);
+  uint8_t* dst = new uint8_t[RGBA_LEN(crop_w, crop_h)];
+  for (int y = 0; y < crop_h; y++) {
+    memcpy(dst + RGBA_LEN(crop_w, y),
+           src + RGBA_LEN(src_w, crop_y + y) + RGBA_LEN(crop_x, 1),
+           RGBA_LEN(crop_w, 1));
+  }
   return dst;
 }
 
@@ -9,6 +9,8 @@
 #include <memory>
 #include <vector>
 
+#include "util/frame_trace.h"
+
 #define COPY_PIXEL(dst, dst_pos, src, src_pos)                  \
   *((uint32_t*) ((uint8_t*) (dst) + (dst_pos))) =               \
       *((uint32_t*)((uint8_t*) (src) + (src_pos)))
@@ -41,13 +43,16 @@ struct RgbGamma {
   void Apply(uint8_t* dst, const uint8_t* src, int w, int h) const;
 
  private:
-  double gamma_r_[256];
-  double gamma_g_[256];
-  double gamma_b_[256];
+  uint8_t gamma_r_[256];
+  uint8_t gamma_g_[256];
+  uint8_t gamma_b_[256];
 };
 
-// TODO(igorc): Reduce the number of data copies.
-// Maybe reuse OpenCV classes.
+// Holds RGBA pixels. Copies of the image share the same pixel buffer
+// by reference count, so passing images around does not copy pixels.
+// Writing requires mutable_data(), which makes a private copy of
+// the buffer first if it is still shared with other images.
+// Each image also carries the trace of its frame through the pipeline.
 class RgbaImage {
  public:
   RgbaImage();
@@ -56,27 +61,39 @@ class RgbaImage {
   RgbaImage& operator=(const RgbaImage& rhs);
   ~RgbaImage();
 
-  void Clear() { Set(NULL, 0, 0); }
+  void Clear();
   void Set(const uint8_t* data, int w, int h);
   void Set(const std::vector<uint8_t>& data, int w, int h);
 
   // Resizes image storage. Actual data will likely become garbage.
+  // Never copies pixels, and detaches from the shared buffer if needed.
   void ResizeStorage(int w, int h);
 
   int width() const { return width_; }
   int height() const { return height_; }
 
-  bool empty() const { return data_.empty(); }
-  uint8_t* data() { return &data_[0]; }
-  const uint8_t* data() const { return &data_[0]; }
-  int data_size() const { return data_.size(); }
+  bool empty() const { return !data_ || data_->empty(); }
+  const uint8_t* data() const { return empty() ? nullptr : &(*data_)[0]; }
+  uint8_t* mutable_data();
+  int data_size() const { return data_ ? data_->size() : 0; }
+
+  // Returns true if pixel buffer is shared with another image. When it
+  // returns false, reads of the buffer by images released on other
+  // threads happen before the caller writes to it: the reference count
+  // is decremented with release ordering, and is checked here with
+  // an acquire fence.
+  bool is_shared() const;
 
   std::unique_ptr<RgbaImage> CloneAndClear(bool null_if_empty);
 
+  const FrameTrace& trace() const { return trace_; }
+  FrameTrace* mutable_trace() { return &trace_; }
+
  private:
-  std::vector<uint8_t> data_;
+  std::shared_ptr<std::vector<uint8_t>> data_;
   int width_;
   int height_;
+  FrameTrace trace_;
 };
 
 // Resizes image using bilinear interpolation.
@@ -86,8 +103,15 @@ uint8_t* ResizeImage(
 void ResizeImage(
     const uint8_t* src, int src_w, int src_h,
     uint8_t* dst, int dst_w, int dst_h);
+// Resizes a region of the image, with rows that are |src_stride| pixels
+// apart. Allows to crop the image without copying it.
+void ResizeImage(
+    const uint8_t* src, int src_w, int src_h, int src_stride,
+    uint8_t* dst, int dst_w, int dst_h);
 
 uint8_t* FlipImage(const uint8_t* src, int w, int h, bool horizontal);
+void FlipImage(
+    const uint8_t* src, int w, int h, bool horizontal, uint8_t* dst);
 
 uint8_t* RotateImage(
     const uint8_t* src, int src_w, int src_h, int w, int h, int angle);
@@ -0,0 +1,76 @@
+// Copyright 2016, Igor Chernyshev.
+
+#ifndef UTIL_SEQLOCK_H_
+#define UTIL_SEQLOCK_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+#include <type_traits>
+
+// Publishes snapshots of a trivially copyable value from one writer
+// thread to any number of readers. Neither side takes a lock. Readers
+// retry if the writer updated the value while they were copying it.
+// The value is stored as 64-bit atomics, so copies are never racy.
+template <typename T>
+class Seqlock {
+ public:
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Seqlock requires a trivially copyable type");
+
+  Seqlock() : sequence_(0) {
+    for (int i = 0; i < kWordCount; ++i)
+      words_[i].store(0, std::memory_order_relaxed);
+  }
+
+  // Called by the single writer thread.
+  void Write(const T& value) {
+    uint64_t words[kWordCount] = {};
+    memcpy(words, &value, sizeof(T));
+    uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < kWordCount; ++i)
+      words_[i].store(words[i], std::memory_order_relaxed);
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Copies the newest value into |dst|, or zero-filled value if there
+  // were no writes. The writer only holds the value
+  // for the duration of a short copy, so retries are rare.
+  void Read(T* dst) const {
+    while (!TryRead(dst)) {}
+  }
+
+  // Returns false if the value was being written.
+  bool TryRead(T* dst) const {
+    uint32_t start = sequence_.load(std::memory_order_acquire);
+    if (start & 1)
+      return false;
+    uint64_t words[kWordCount];
+    for (int i = 0; i < kWordCount; ++i)
+      words[i] = words_[i].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) != start)
+      return false;
+    memcpy(dst, words, sizeof(T));
+    return true;
+  }
+
+  // Returns the number of writes so far.
+  uint32_t write_count() const {
+    return sequence_.load(std::memory_order_acquire) / 2;
+  }
+
+ private:
+  Seqlock(const Seqlock& src);
+  Seqlock& operator=(const Seqlock& rhs);
+
+  static const int kWordCount = (sizeof(T) + 7) / 8;
+
+  std::atomic<uint32_t> sequence_;
+  std::atomic<uint64_t> words_[kWordCount];
+};
+
+#endif  // UTIL_SEQLOCK_H_
@@ -13,6 +13,15 @@ uint64_t GetCurrentMillis() {
   return ((uint64_t) time.tv_sec) * 1000 + time.tv_nsec / 1000000;
 }
 
+uint64_t GetCurrentMicros() {
+  struct timespec time;
+  if (clock_gettime(CLOCK_MONOTONIC, &time) == -1) {
+    REPORT_ERRNO("clock_gettime(monotonic)");
+    CHECK(false);
+  }
+  return ((uint64_t) time.tv_sec) * 1000000 + time.tv_nsec / 1000;
+}
+
 void Sleep(double seconds) {
   struct timespec time;
   clock_gettime(CLOCK_REALTIME, &time);
@@ -56,6 +65,22 @@ void SleepUs(int delay_us) {
   }
 }
 
+void SleepUntilMicros(uint64_t time_us) {
+  struct timespec time;
+  time.tv_sec = time_us / 1000000;
+  time.tv_nsec = (time_us % 1000000) * 1000;
+  while (true) {
+    int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, nullptr);
+    if (err == EINTR)
+      continue;
+    if (err != 0) {
+      fprintf(stderr, "clock_nanosleep %d\n", err);
+      CHECK(false);
+    }
+    break;
+  }
+}
+
 void AddTimeMillis(struct timespec* time, uint64_t increment) {
   uint64_t nsec = (increment % 1000000) * 1000000 + time->tv_nsec;
   time->tv_sec += increment / 1000 + nsec / 1000000000;
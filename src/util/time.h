@@ -7,10 +7,14 @@
 #include <time.h>
 
 uint64_t GetCurrentMillis();
+uint64_t GetCurrentMicros();
 
 void Sleep(double seconds);
 void SleepUs(int delay_us);
 
+// Sleeps until the given GetCurrentMicros() time.
+void SleepUntilMicros(uint64_t time_us);
+
 void AddTimeMillis(struct timespec* time, uint64_t increment);
 
 #endif  // UTIL_TIME_H_
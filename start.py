@@ -26,6 +26,7 @@ def main():
   arg_parser.add_argument('--max', action='store_true')
   arg_parser.add_argument('--no-sound', action='store_true')
   arg_parser.add_argument('--no-sound-config', action='store_true')
+  arg_parser.add_argument('--sound-input')
   arg_parser.add_argument('--prod', action='store_true')
   arg_parser.add_argument('--enable-kinect', action='store_true')
   args = arg_parser.parse_args()
@@ -43,6 +44,8 @@ def main():
     params.append('--no-reset')
   if args.no_sound:
     params.append('--no-sound')
+  if args.sound_input:
+    params.append('--sound-input=' + args.sound_input)
   if args.disable_net:
     params.append('--disable-net')
   if args.disable_fin:
@@ -0,0 +1,42 @@
+#!/usr/bin/python
+#
+# Exports TCL layouts from DXF files as plain text, for C++ tools
+# that cannot parse DXF. Each line is "strand_id x y", in LED order.
+# Must run from the repository root, as TclLayout customizes layouts
+# by their relative paths.
+#
+# Usage: tools/export_layouts.py OUTPUT_DIR
+
+import os
+import sys
+
+sys.path.insert(0, os.getcwd())
+from dfplayer.tcl_layout import TclLayout
+
+# Controller id, width and height, as configured in dfplayer/player.py.
+_CONTROLLERS = ((1, 500, 50), (3, 65, 250))
+
+
+def export_layout(controller_id, width, height, out_dir):
+  layout = TclLayout(
+      'dfplayer/layout%d.dxf' % controller_id, width - 1, height - 1)
+  out_path = os.path.join(out_dir, 'layout%d.txt' % controller_id)
+  with open(out_path, 'w') as f:
+    for s in layout.get_strands():
+      for c in s.get_coords():
+        f.write('%d %d %d\n' % (s.get_id(), c[0], c[1]))
+
+
+def main():
+  if len(sys.argv) != 2:
+    print 'Usage: %s OUTPUT_DIR' % sys.argv[0]
+    sys.exit(1)
+  out_dir = sys.argv[1]
+  if not os.path.exists(out_dir):
+    os.makedirs(out_dir)
+  for controller_id, width, height in _CONTROLLERS:
+    export_layout(controller_id, width, height, out_dir)
+
+
+if __name__ == '__main__':
+  main()